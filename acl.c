@@ -0,0 +1,515 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "ip.h"
+#include "acl.h"
+
+#define ACL_PORT_PREFIXES_MAX 30 /* a 16-bit range splits into 2*(16-1) prefixes at most */
+
+#define ACL_FRAG_CACHE_SIZE 256 /* must be a power of 2 */
+#define ACL_FRAG_TIMEOUT 30 /* seconds, same as the reassembly */
+
+/*
+ * Access Control List (ACL)
+ *
+ * NOTE: tuple space search. The rules are grouped into tuples by the prefix lengths of their
+ *       fields, a port range is split into prefixes beforehand. Each tuple is a hash table keyed
+ *       by the masked fields, so a packet takes one probe per tuple regardless of the number of
+ *       the rules. The tuples are sorted by the first rule they hold, the search stops once no
+ *       remaining tuple can hold a rule earlier than the one found. A ruleset is compiled before
+ *       it is published, and replaces the current one with RCU.
+ */
+
+struct acl_key {
+    ip_addr_t src;
+    ip_addr_t dst;
+    uint16_t sport;
+    uint16_t dport;
+    uint8_t protocol;
+};
+
+struct acl_entry {
+    struct acl_key key;
+    int rule; /* -1 means unused */
+};
+
+struct acl_tuple {
+    struct acl_key mask;
+    int first; /* the smallest index of the rules it holds */
+    unsigned int num;
+    unsigned int size; /* slots of the table, a power of 2 */
+    struct acl_entry *entries;
+};
+
+struct acl_ruleset {
+    int action; /* for the packets which match no rule */
+    struct acl_rule *rules;
+    int num;
+    int capacity;
+    struct acl_stats *stats; /* per rule, followed by the one of the default action */
+    struct acl_tuple *tuples;
+    int ntuples;
+    int tcapacity;
+    unsigned int gen; /* assigned on commit */
+};
+
+/* NOTE: the rule the first fragment of a datagram matched, the later ones follow it */
+struct acl_frag {
+    ip_addr_t src;
+    ip_addr_t dst;
+    uint16_t id;
+    uint8_t protocol;
+    unsigned int gen; /* of the ruleset, 0 means unused */
+    int rule;
+    time_t expire;
+};
+
+static mutex_t mutex = MUTEX_INITIALIZER; /* serializes the writers */
+static struct rcu rcu = RCU_INITIALIZER;
+static struct acl_ruleset *current;
+static unsigned int gen;
+
+static mutex_t frag_mutex = MUTEX_INITIALIZER;
+static struct acl_frag frags[ACL_FRAG_CACHE_SIZE];
+
+static int
+acl_mask_valid(ip_addr_t mask)
+{
+    uint32_t inv;
+
+    inv = ~ntoh32(mask);
+    return !(inv & (inv + 1));
+}
+
+/* NOTE: splits [min, max] into the aligned blocks of the power of 2, returns the number of them */
+static int
+acl_port_split(uint16_t min, uint16_t max, uint16_t *values, uint16_t *masks)
+{
+    uint32_t lo, hi;
+    int bits, num = 0;
+
+    lo = min;
+    hi = max;
+    while (lo <= hi) {
+        bits = lo ? __builtin_ctz(lo) : 16;
+        while ((1U << bits) > hi - lo + 1) {
+            bits--;
+        }
+        values[num] = lo;
+        masks[num] = (0xffff << bits) & 0xffff;
+        num++;
+        lo += 1U << bits;
+    }
+    return num;
+}
+
+struct acl_ruleset *
+acl_ruleset_alloc(int action)
+{
+    struct acl_ruleset *set;
+
+    if (action != ACL_ACTION_ACCEPT && action != ACL_ACTION_DROP) {
+        errorf("invalid action, action=%d", action);
+        return NULL;
+    }
+    set = memory_alloc(sizeof(*set));
+    if (!set) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    set->action = action;
+    return set;
+}
+
+/* NOTE: returns the index of the rule, the earlier rule takes precedence */
+int
+acl_ruleset_add(struct acl_ruleset *set, const struct acl_rule *rule)
+{
+    struct acl_rule *rules;
+    int capacity;
+
+    if (rule->action != ACL_ACTION_ACCEPT && rule->action != ACL_ACTION_DROP) {
+        errorf("invalid action, action=%d", rule->action);
+        return -1;
+    }
+    if (!acl_mask_valid(rule->src_mask) || !acl_mask_valid(rule->dst_mask)) {
+        errorf("non-contiguous mask");
+        return -1;
+    }
+    if (rule->sport_min > rule->sport_max || rule->dport_min > rule->dport_max) {
+        errorf("invalid port range");
+        return -1;
+    }
+    if (set->num == set->capacity) {
+        capacity = set->capacity ? set->capacity * 2 : 16;
+        rules = memory_alloc(sizeof(*rules) * capacity);
+        if (!rules) {
+            errorf("memory_alloc() failure");
+            return -1;
+        }
+        if (set->rules) {
+            memcpy(rules, set->rules, sizeof(*rules) * set->num);
+            memory_free(set->rules);
+        }
+        set->rules = rules;
+        set->capacity = capacity;
+    }
+    set->rules[set->num] = *rule;
+    return set->num++;
+}
+
+void
+acl_ruleset_free(struct acl_ruleset *set)
+{
+    int i;
+
+    if (!set) {
+        return;
+    }
+    for (i = 0; i < set->ntuples; i++) {
+        memory_free(set->tuples[i].entries);
+    }
+    memory_free(set->tuples);
+    memory_free(set->stats);
+    memory_free(set->rules);
+    memory_free(set);
+}
+
+static int
+acl_key_equal(const struct acl_key *a, const struct acl_key *b)
+{
+    return a->src == b->src && a->dst == b->dst && a->sport == b->sport && a->dport == b->dport && a->protocol == b->protocol;
+}
+
+static void
+acl_key_mask(struct acl_key *key, const struct acl_key *mask)
+{
+    key->src &= mask->src;
+    key->dst &= mask->dst;
+    key->sport &= mask->sport;
+    key->dport &= mask->dport;
+    key->protocol &= mask->protocol;
+}
+
+static struct acl_entry *
+acl_tuple_probe(const struct acl_tuple *tuple, const struct acl_key *key)
+{
+    struct acl_entry *entry;
+    unsigned int i;
+
+    i = ip_route_hash(key->protocol, key->src, key->dst, key->sport, key->dport) & (tuple->size - 1);
+    for (;; i = (i + 1) & (tuple->size - 1)) {
+        entry = &tuple->entries[i];
+        if (entry->rule == -1 || acl_key_equal(&entry->key, key)) {
+            return entry;
+        }
+    }
+}
+
+/*
+ * ACL Compiler
+ *
+ * NOTE: the ruleset is not published yet, no lock is required
+ */
+
+static struct acl_tuple *
+acl_tuple_get(struct acl_ruleset *set, const struct acl_key *mask)
+{
+    struct acl_tuple *tuples;
+    int i, capacity;
+
+    for (i = 0; i < set->ntuples; i++) {
+        if (acl_key_equal(&set->tuples[i].mask, mask)) {
+            return &set->tuples[i];
+        }
+    }
+    if (set->ntuples == set->tcapacity) {
+        capacity = set->tcapacity ? set->tcapacity * 2 : 16;
+        tuples = memory_alloc(sizeof(*tuples) * capacity);
+        if (!tuples) {
+            errorf("memory_alloc() failure");
+            return NULL;
+        }
+        if (set->tuples) {
+            memcpy(tuples, set->tuples, sizeof(*tuples) * set->ntuples);
+            memory_free(set->tuples);
+        }
+        set->tuples = tuples;
+        set->tcapacity = capacity;
+    }
+    set->tuples[set->ntuples].mask = *mask;
+    set->tuples[set->ntuples].first = -1;
+    return &set->tuples[set->ntuples++];
+}
+
+/* NOTE: the first pass counts the entries of each tuple, the second one fills in the tables */
+static int
+acl_compile_pass(struct acl_ruleset *set, int fill)
+{
+    struct acl_rule *rule;
+    uint16_t svalues[ACL_PORT_PREFIXES_MAX], smasks[ACL_PORT_PREFIXES_MAX];
+    uint16_t dvalues[ACL_PORT_PREFIXES_MAX], dmasks[ACL_PORT_PREFIXES_MAX];
+    int i, s, d, snum, dnum;
+    struct acl_key mask, key;
+    struct acl_tuple *tuple;
+    struct acl_entry *entry;
+
+    for (i = 0; i < set->num; i++) {
+        rule = &set->rules[i];
+        snum = acl_port_split(rule->sport_min, rule->sport_max, svalues, smasks);
+        dnum = acl_port_split(rule->dport_min, rule->dport_max, dvalues, dmasks);
+        for (s = 0; s < snum; s++) {
+            for (d = 0; d < dnum; d++) {
+                mask.src = rule->src_mask;
+                mask.dst = rule->dst_mask;
+                mask.sport = smasks[s];
+                mask.dport = dmasks[d];
+                mask.protocol = rule->protocol ? 0xff : 0;
+                tuple = acl_tuple_get(set, &mask);
+                if (!tuple) {
+                    return -1;
+                }
+                if (!fill) {
+                    if (tuple->first == -1) {
+                        tuple->first = i;
+                    }
+                    tuple->num++;
+                    continue;
+                }
+                key.src = rule->src;
+                key.dst = rule->dst;
+                key.sport = svalues[s];
+                key.dport = dvalues[d];
+                key.protocol = rule->protocol;
+                acl_key_mask(&key, &mask);
+                entry = acl_tuple_probe(tuple, &key);
+                if (entry->rule == -1) {
+                    entry->key = key;
+                    entry->rule = i;
+                }
+                /* NOTE: the same key of a later rule is shadowed, the earlier one wins */
+            }
+        }
+    }
+    return 0;
+}
+
+static int
+acl_tuple_cmp(const void *a, const void *b)
+{
+    return ((const struct acl_tuple *)a)->first - ((const struct acl_tuple *)b)->first;
+}
+
+static int
+acl_compile(struct acl_ruleset *set)
+{
+    struct acl_tuple *tuple;
+    unsigned int i;
+    int t;
+
+    if (acl_compile_pass(set, 0) == -1) {
+        return -1;
+    }
+    for (t = 0; t < set->ntuples; t++) {
+        tuple = &set->tuples[t];
+        for (tuple->size = 16; tuple->size < tuple->num * 2; tuple->size <<= 1);
+        tuple->entries = memory_alloc(sizeof(*tuple->entries) * tuple->size);
+        if (!tuple->entries) {
+            errorf("memory_alloc() failure");
+            return -1;
+        }
+        for (i = 0; i < tuple->size; i++) {
+            tuple->entries[i].rule = -1;
+        }
+    }
+    if (acl_compile_pass(set, 1) == -1) {
+        return -1;
+    }
+    qsort(set->tuples, set->ntuples, sizeof(*set->tuples), acl_tuple_cmp);
+    set->stats = memory_alloc(sizeof(*set->stats) * (set->num + 1));
+    if (!set->stats) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * NOTE: takes the ownership of the ruleset even on failure, NULL removes the current one.
+ *       A ruleset committed already is rejected as it is, it is not ours to free.
+ */
+int
+acl_commit(struct acl_ruleset *set)
+{
+    struct acl_ruleset *old;
+
+    if (set) {
+        if (set->stats) {
+            errorf("already committed");
+            return -1;
+        }
+        if (acl_compile(set) == -1) {
+            errorf("acl_compile() failure");
+            acl_ruleset_free(set);
+            return -1;
+        }
+    }
+    mutex_lock(&mutex);
+    if (set) {
+        if (!++gen) {
+            gen++; /* 0 means unused in the fragment cache */
+        }
+        set->gen = gen;
+    }
+    old = current;
+    __atomic_store_n(&current, set, __ATOMIC_RELEASE);
+    rcu_synchronize(&rcu);
+    mutex_unlock(&mutex);
+    acl_ruleset_free(old);
+    infof("committed, rules=%d, tuples=%d, default=%s",
+        set ? set->num : 0, set ? set->ntuples : 0, (!set || set->action == ACL_ACTION_ACCEPT) ? "accept" : "drop");
+    return 0;
+}
+
+/* NOTE: returns the index of the rule, set->num means the default */
+static int
+acl_lookup(struct acl_ruleset *set, uint8_t protocol, ip_addr_t src, ip_addr_t dst, uint16_t sport, uint16_t dport, int ports)
+{
+    struct acl_tuple *tuple;
+    struct acl_entry *entry;
+    struct acl_key key;
+    int t, found;
+
+    found = set->num;
+    for (t = 0; t < set->ntuples; t++) {
+        tuple = &set->tuples[t];
+        if (tuple->first >= found) {
+            /* no earlier rule in the rest */
+            break;
+        }
+        if (!ports && (tuple->mask.sport || tuple->mask.dport)) {
+            continue;
+        }
+        key.src = src;
+        key.dst = dst;
+        key.sport = sport;
+        key.dport = dport;
+        key.protocol = protocol;
+        acl_key_mask(&key, &tuple->mask);
+        entry = acl_tuple_probe(tuple, &key);
+        if (entry->rule != -1 && entry->rule < found) {
+            found = entry->rule;
+        }
+    }
+    return found;
+}
+
+static int
+acl_account(struct acl_ruleset *set, int found, size_t len)
+{
+    struct acl_stats *stats;
+
+    stats = &set->stats[found];
+    __atomic_add_fetch(&stats->packets, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->bytes, len, __ATOMIC_RELAXED);
+    return (found < set->num) ? set->rules[found].action : set->action;
+}
+
+/* NOTE: ports tells whether the packet has them, a rule with ports does not match the one without */
+int
+acl_classify(uint8_t protocol, ip_addr_t src, ip_addr_t dst, uint16_t sport, uint16_t dport, int ports, size_t len)
+{
+    struct acl_ruleset *set;
+    int idx, action;
+
+    if (!__atomic_load_n(&current, __ATOMIC_RELAXED)) {
+        /* no ruleset, skip the read-side section */
+        return ACL_ACTION_ACCEPT;
+    }
+    idx = rcu_read_lock(&rcu);
+    set = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+    if (!set) {
+        rcu_read_unlock(&rcu, idx);
+        return ACL_ACTION_ACCEPT;
+    }
+    action = acl_account(set, acl_lookup(set, protocol, src, dst, sport, dport, ports), len);
+    rcu_read_unlock(&rcu, idx);
+    return action;
+}
+
+/*
+ * NOTE: for the fragments which are not reassembled (e.g. forwarded). The first one (with the
+ *       ports) is classified as usual and its rule is kept for the datagram, the later ones
+ *       take the same rule. A later fragment which overtakes the first one is classified
+ *       by the addresses and the protocol alone.
+ */
+int
+acl_classify_fragment(uint8_t protocol, ip_addr_t src, ip_addr_t dst, uint16_t id, uint16_t sport, uint16_t dport, int ports, size_t len)
+{
+    struct acl_ruleset *set;
+    struct acl_frag *frag;
+    struct timeval now;
+    int idx, found = -1, action;
+
+    if (!__atomic_load_n(&current, __ATOMIC_RELAXED)) {
+        return ACL_ACTION_ACCEPT;
+    }
+    idx = rcu_read_lock(&rcu);
+    set = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+    if (!set) {
+        rcu_read_unlock(&rcu, idx);
+        return ACL_ACTION_ACCEPT;
+    }
+    gettimeofday(&now, NULL);
+    frag = &frags[ip_route_hash(protocol, src, dst, id, 0) & (ACL_FRAG_CACHE_SIZE - 1)];
+    mutex_lock(&frag_mutex);
+    if (ports) {
+        found = acl_lookup(set, protocol, src, dst, sport, dport, ports);
+        frag->src = src;
+        frag->dst = dst;
+        frag->id = id;
+        frag->protocol = protocol;
+        frag->gen = set->gen;
+        frag->rule = found;
+        frag->expire = now.tv_sec + ACL_FRAG_TIMEOUT;
+    } else if (frag->gen == set->gen && frag->src == src && frag->dst == dst && frag->id == id &&
+        frag->protocol == protocol && frag->expire > now.tv_sec) {
+        found = frag->rule;
+    }
+    mutex_unlock(&frag_mutex);
+    if (found == -1) {
+        found = acl_lookup(set, protocol, src, dst, sport, dport, 0);
+    }
+    action = acl_account(set, found, len);
+    rcu_read_unlock(&rcu, idx);
+    return action;
+}
+
+/* NOTE: the counters belong to the ruleset, they start from zero on every commit */
+int
+acl_get_stats(int index, struct acl_stats *stats)
+{
+    struct acl_ruleset *set;
+    int idx;
+
+    idx = rcu_read_lock(&rcu);
+    set = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+    if (!set || index < ACL_RULE_DEFAULT || index >= set->num) {
+        rcu_read_unlock(&rcu, idx);
+        errorf("not found, index=%d", index);
+        return -1;
+    }
+    if (index == ACL_RULE_DEFAULT) {
+        index = set->num;
+    }
+    stats->packets = __atomic_load_n(&set->stats[index].packets, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&set->stats[index].bytes, __ATOMIC_RELAXED);
+    rcu_read_unlock(&rcu, idx);
+    return 0;
+}
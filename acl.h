@@ -0,0 +1,51 @@
+#ifndef ACL_H
+#define ACL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ip.h"
+
+#define ACL_ACTION_ACCEPT 0
+#define ACL_ACTION_DROP   1
+
+#define ACL_RULE_DEFAULT -1 /* index of the default action in acl_get_stats() */
+
+/* NOTE: the addresses and the masks are in network byte order, the ports in host byte order */
+struct acl_rule {
+    ip_addr_t src;
+    ip_addr_t src_mask; /* contiguous, 0 means any */
+    ip_addr_t dst;
+    ip_addr_t dst_mask;
+    uint8_t protocol; /* 0 means any */
+    uint16_t sport_min; /* 0-65535 means any, a rule with ports matches only TCP/UDP (see acl_classify_fragment()) */
+    uint16_t sport_max;
+    uint16_t dport_min;
+    uint16_t dport_max;
+    int action;
+};
+
+struct acl_stats {
+    uint64_t packets; /* matched */
+    uint64_t bytes;
+};
+
+struct acl_ruleset; /* forward declaration */
+
+extern struct acl_ruleset *
+acl_ruleset_alloc(int action);
+extern int
+acl_ruleset_add(struct acl_ruleset *set, const struct acl_rule *rule);
+extern void
+acl_ruleset_free(struct acl_ruleset *set);
+
+extern int
+acl_commit(struct acl_ruleset *set);
+extern int
+acl_classify(uint8_t protocol, ip_addr_t src, ip_addr_t dst, uint16_t sport, uint16_t dport, int ports, size_t len);
+extern int
+acl_classify_fragment(uint8_t protocol, ip_addr_t src, ip_addr_t dst, uint16_t id, uint16_t sport, uint16_t dport, int ports, size_t len);
+extern int
+acl_get_stats(int index, struct acl_stats *stats);
+
+#endif
@@ -51,6 +51,7 @@ struct arp_cache {
 };
 
 static mutex_t mutex = MUTEX_INITIALIZER;
+static unsigned int generation = 1; /* bumped when a resolved address changes or goes away */
 static struct arp_cache caches[ARP_CACHE_SIZE];
 
 static char *
@@ -110,6 +111,10 @@ arp_cache_alloc(void)
             oldest = entry;
         }
     }
+    if (oldest) {
+        /* evicted */
+        __atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+    }
     return oldest;
 }
 
@@ -138,6 +143,9 @@ arp_cache_update(ip_addr_t pa, const uint8_t *ha)
         /* not found */
         return NULL;
     }
+    if (memcmp(cache->ha, ha, ETHER_ADDR_LEN) != 0) {
+        __atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+    }
     cache->state = ARP_CACHE_STATE_RESOLVED;
     memcpy(cache->ha, ha, ETHER_ADDR_LEN);
     gettimeofday(&cache->timestamp, NULL);
@@ -172,6 +180,7 @@ arp_cache_delete(struct arp_cache *cache)
     char addr2[ETHER_ADDR_STR_LEN];
 
     debugf("DELETE: pa=%s, ha=%s", ip_addr_ntop(cache->pa, addr1, sizeof(addr1)), ether_addr_ntop(cache->ha, addr2, sizeof(addr2)));
+    __atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
     cache->state = ARP_CACHE_STATE_FREE;
     cache->pa = 0;
     memset(cache->ha, 0, ETHER_ADDR_LEN);
@@ -194,7 +203,7 @@ arp_request(struct net_iface *iface, ip_addr_t tpa)
     memcpy(request.tpa, &tpa, IP_ADDR_LEN);
     debugf("dev=%s, opcode=%s(0x%04x), len=%zu", iface->dev->name, arp_opcode_ntoa(request.hdr.op), ntoh16(request.hdr.op), sizeof(request));
     arp_dump((uint8_t *)&request, sizeof(request));
-    return net_device_output(iface->dev, ETHER_TYPE_ARP, (uint8_t *)&request, sizeof(request), iface->dev->broadcast);
+    return net_device_output(iface->dev, ETHER_TYPE_ARP, (uint8_t *)&request, sizeof(request), iface->dev->broadcast, 0);
 }
 
 static int
@@ -213,11 +222,18 @@ arp_reply(struct net_iface *iface, const uint8_t *tha, ip_addr_t tpa, const uint
     memcpy(reply.tpa, &tpa, IP_ADDR_LEN);
     debugf("dev=%s, opcode=%s(0x%04x), len=%zu", iface->dev->name, arp_opcode_ntoa(reply.hdr.op), ntoh16(reply.hdr.op), sizeof(reply));
     arp_dump((uint8_t *)&reply, sizeof(reply));
-    return net_device_output(iface->dev, ETHER_TYPE_ARP, (uint8_t *)&reply, sizeof(reply), dst);
+    return net_device_output(iface->dev, ETHER_TYPE_ARP, (uint8_t *)&reply, sizeof(reply), dst, 0);
+}
+
+/* NOTE: address resolution gates the traffic of other peers, it should not wait behind data */
+static int
+arp_classify(const uint8_t *data, size_t len)
+{
+    return NET_INPUT_BAND_CONTROL;
 }
 
 static void
-arp_input(const uint8_t *data, size_t len, struct net_device *dev)
+arp_input(const uint8_t *data, size_t len, struct net_device *dev, int flags)
 {
     struct arp_ether *msg;
     ip_addr_t spa, tpa;
@@ -304,6 +320,28 @@ arp_resolve(struct net_iface *iface, ip_addr_t pa, uint8_t *ha)
     return ARP_RESOLVE_FOUND;
 }
 
+/* NOTE: rfc1112, a group maps to 01:00:5e and its low-order 23 bits, nothing goes on the wire */
+void
+arp_resolve_mcast(ip_addr_t group, uint8_t *ha)
+{
+    uint32_t g;
+
+    g = ntoh32(group);
+    ha[0] = 0x01;
+    ha[1] = 0x00;
+    ha[2] = 0x5e;
+    ha[3] = (g >> 16) & 0x7f;
+    ha[4] = (g >> 8) & 0xff;
+    ha[5] = g & 0xff;
+}
+
+/* NOTE: the resolved addresses copied out before are still valid while this is unchanged */
+unsigned int
+arp_generation(void)
+{
+    return __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+}
+
 static void
 arp_timer(void)
 {
@@ -332,6 +370,7 @@ arp_init(void)
         errorf("net_protocol_register() failure");
         return -1;
     }
+    net_protocol_set_classifier(NET_PROTOCOL_TYPE_ARP, arp_classify);
     if (net_timer_register("ARP Timer", interval, arp_timer) == -1) {
         errorf("net_timer_register() failure");
         return -1;
@@ -12,6 +12,10 @@
 
 extern int
 arp_resolve(struct net_iface *iface, ip_addr_t pa, uint8_t *ha);
+extern void
+arp_resolve_mcast(ip_addr_t group, uint8_t *ha);
+extern unsigned int
+arp_generation(void);
 extern int
 arp_init(void);
 
@@ -0,0 +1,576 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "ether.h"
+
+#include "driver/ether_replay.h"
+
+#define ETHER_REPLAY_BURST 64 /* frames per timer tick */
+#define ETHER_REPLAY_IFACES_MAX 16 /* interfaces per pcapng section */
+
+#define ETHER_REPLAY_FORMAT_PCAP   1
+#define ETHER_REPLAY_FORMAT_PCAPNG 2
+
+#define PCAP_MAGIC_USEC 0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define PCAP_VERSION_MAJOR 2
+#define PCAP_VERSION_MINOR 4
+
+#define PCAPNG_BLOCK_SHB 0x0a0d0d0a
+#define PCAPNG_BLOCK_IDB 0x00000001
+#define PCAPNG_BLOCK_SPB 0x00000003
+#define PCAPNG_BLOCK_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+#define PCAPNG_OPT_ENDOFOPT 0
+#define PCAPNG_OPT_IF_TSRESOL 9
+
+#define LINKTYPE_ETHERNET 1
+
+#define ETHER_REPLAY_BLOCK_SIZE_MAX (ETHER_FRAME_SIZE_JUMBO + 256)
+
+struct pcap_file_hdr {
+    uint32_t magic;
+    uint16_t major;
+    uint16_t minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+struct pcap_record_hdr {
+    uint32_t sec;
+    uint32_t frac; /* usec or nsec, depends on the magic */
+    uint32_t caplen;
+    uint32_t len;
+};
+
+struct ether_replay {
+    struct ether_replay *next;
+    struct net_device *dev;
+    FILE *in;
+    FILE *out;
+    mutex_t mutex; /* protects the output and the stats */
+    int format;
+    int swap; /* the input was written on a host of the other byte order */
+    uint64_t units; /* timestamp units per second (pcap) */
+    struct {
+        uint16_t linktype;
+        uint64_t units;
+    } ifaces[ETHER_REPLAY_IFACES_MAX]; /* pcapng */
+    int nifaces;
+    double speed;
+    int started;
+    uint64_t t0; /* timestamp of the first frame (nsec) */
+    struct timeval start;
+    int pending; /* the next frame is loaded and waits for its time */
+    uint64_t ts; /* nsec */
+    size_t flen;
+    uint8_t frame[ETHER_FRAME_SIZE_JUMBO];
+    uint8_t block[ETHER_REPLAY_BLOCK_SIZE_MAX];
+    struct ether_replay_stats stats;
+};
+
+#define PRIV(x) ((struct ether_replay *)x->priv)
+
+/* NOTE: if you want to add/delete the entries after net_run(), you need to protect this list with a mutex. */
+static struct ether_replay *replays;
+
+static uint32_t
+ether_replay_u32(struct ether_replay *replay, const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return replay->swap ? __builtin_bswap32(v) : v;
+}
+
+static uint16_t
+ether_replay_u16(struct ether_replay *replay, const uint8_t *p)
+{
+    uint16_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return replay->swap ? __builtin_bswap16(v) : v;
+}
+
+static uint64_t
+ether_replay_nsec(uint64_t ts, uint64_t units)
+{
+    uint64_t sec, frac;
+
+    sec = ts / units;
+    frac = ts % units;
+    if (units > 1000000000) {
+        return sec * 1000000000 + frac / (units / 1000000000);
+    }
+    return sec * 1000000000 + frac * 1000000000 / units;
+}
+
+static int
+ether_replay_read(struct ether_replay *replay, void *buf, size_t size)
+{
+    return fread(buf, 1, size, replay->in) == size ? 0 : -1;
+}
+
+static int
+ether_replay_skip(struct ether_replay *replay, size_t size)
+{
+    return fseek(replay->in, size, SEEK_CUR);
+}
+
+/* NOTE: loads the frame, rewrites a unicast destination to the device as a promiscuous capture would be replayed */
+static int
+ether_replay_load(struct ether_replay *replay, const uint8_t *data, size_t caplen, uint64_t ts)
+{
+    if (caplen < ETHER_HDR_SIZE || caplen > sizeof(replay->frame)) {
+        replay->stats.skipped++;
+        return -1;
+    }
+    memcpy(replay->frame, data, caplen);
+    if (!(replay->frame[0] & 0x01)) {
+        memcpy(replay->frame, replay->dev->addr, ETHER_ADDR_LEN);
+    }
+    replay->flen = caplen;
+    replay->ts = ts;
+    replay->pending = 1;
+    return 0;
+}
+
+static int
+ether_replay_pcap_header(struct ether_replay *replay, const uint8_t *magic)
+{
+    struct pcap_file_hdr hdr;
+
+    memcpy(&hdr, magic, sizeof(hdr.magic));
+    if (ether_replay_read(replay, (uint8_t *)&hdr + sizeof(hdr.magic), sizeof(hdr) - sizeof(hdr.magic)) == -1) {
+        errorf("truncated header");
+        return -1;
+    }
+    switch (hdr.magic) {
+    case PCAP_MAGIC_USEC:
+    case PCAP_MAGIC_NSEC:
+        replay->swap = 0;
+        break;
+    default:
+        replay->swap = 1;
+        break;
+    }
+    replay->units = (ether_replay_u32(replay, magic) == PCAP_MAGIC_NSEC) ? 1000000000 : 1000000;
+    if (ether_replay_u32(replay, (uint8_t *)&hdr.linktype) != LINKTYPE_ETHERNET) {
+        errorf("unsupported linktype, linktype=%u", ether_replay_u32(replay, (uint8_t *)&hdr.linktype));
+        return -1;
+    }
+    replay->format = ETHER_REPLAY_FORMAT_PCAP;
+    return 0;
+}
+
+static int
+ether_replay_pcap_next(struct ether_replay *replay)
+{
+    struct pcap_record_hdr hdr;
+    uint32_t caplen;
+    uint64_t ts;
+
+    while (ether_replay_read(replay, &hdr, sizeof(hdr)) == 0) {
+        caplen = ether_replay_u32(replay, (uint8_t *)&hdr.caplen);
+        if (caplen > sizeof(replay->block)) {
+            replay->stats.skipped++;
+            if (ether_replay_skip(replay, caplen) == -1) {
+                break;
+            }
+            continue;
+        }
+        if (ether_replay_read(replay, replay->block, caplen) == -1) {
+            break;
+        }
+        ts = (uint64_t)ether_replay_u32(replay, (uint8_t *)&hdr.sec) * replay->units + ether_replay_u32(replay, (uint8_t *)&hdr.frac);
+        if (ether_replay_load(replay, replay->block, caplen, ether_replay_nsec(ts, replay->units)) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static uint64_t
+ether_replay_pcapng_tsresol(struct ether_replay *replay, const uint8_t *opt, size_t len)
+{
+    uint16_t code, olen;
+    uint64_t units = 1000000;
+    int i, exp;
+
+    while (len >= 4) {
+        code = ether_replay_u16(replay, opt);
+        olen = ether_replay_u16(replay, opt + 2);
+        if (code == PCAPNG_OPT_ENDOFOPT || 4 + (size_t)olen > len) {
+            break;
+        }
+        if (code == PCAPNG_OPT_IF_TSRESOL && olen >= 1) {
+            /* NOTE: the most significant bit selects a power of 2, otherwise of 10 */
+            exp = opt[4] & 0x7f;
+            units = 1;
+            for (i = 0; i < exp && units < UINT64_MAX / 10; i++) {
+                units *= (opt[4] & 0x80) ? 2 : 10;
+            }
+        }
+        olen = (olen + 3) & ~3;
+        if (4 + (size_t)olen > len) {
+            break;
+        }
+        opt += 4 + olen;
+        len -= 4 + olen;
+    }
+    return units;
+}
+
+static int
+ether_replay_pcapng_next(struct ether_replay *replay)
+{
+    uint8_t hdr[8];
+    uint32_t type, total, body, id, caplen;
+    uint64_t ts;
+
+    while (ether_replay_read(replay, hdr, sizeof(hdr)) == 0) {
+        memcpy(&type, hdr, sizeof(type)); /* NOTE: the SHB type is a palindrome */
+        if (type == PCAPNG_BLOCK_SHB) {
+            /* a new section, it may have another byte order */
+            if (ether_replay_read(replay, replay->block, 4) == -1) {
+                break;
+            }
+            memcpy(&id, replay->block, sizeof(id));
+            if (id == PCAPNG_BYTE_ORDER_MAGIC) {
+                replay->swap = 0;
+            } else if (id == __builtin_bswap32(PCAPNG_BYTE_ORDER_MAGIC)) {
+                replay->swap = 1;
+            } else {
+                errorf("invalid byte order magic");
+                break;
+            }
+            total = ether_replay_u32(replay, hdr + 4);
+            if (total < 16 || ether_replay_skip(replay, total - 12) == -1) {
+                break;
+            }
+            replay->nifaces = 0;
+            continue;
+        }
+        type = ether_replay_u32(replay, hdr);
+        total = ether_replay_u32(replay, hdr + 4);
+        if (total < 12 || total % 4) {
+            errorf("invalid block length, type=0x%08x, len=%u", type, total);
+            break;
+        }
+        body = total - 12;
+        if (body > sizeof(replay->block)) {
+            if (type == PCAPNG_BLOCK_EPB || type == PCAPNG_BLOCK_SPB) {
+                replay->stats.skipped++;
+            }
+            if (ether_replay_skip(replay, body + 4) == -1) {
+                break;
+            }
+            continue;
+        }
+        if (ether_replay_read(replay, replay->block, body + 4) == -1) {
+            break;
+        }
+        switch (type) {
+        case PCAPNG_BLOCK_IDB:
+            if (body < 8 || replay->nifaces == ETHER_REPLAY_IFACES_MAX) {
+                break;
+            }
+            replay->ifaces[replay->nifaces].linktype = ether_replay_u16(replay, replay->block);
+            replay->ifaces[replay->nifaces].units = ether_replay_pcapng_tsresol(replay, replay->block + 8, body - 8);
+            replay->nifaces++;
+            break;
+        case PCAPNG_BLOCK_EPB:
+            if (body < 20) {
+                break;
+            }
+            id = ether_replay_u32(replay, replay->block);
+            caplen = ether_replay_u32(replay, replay->block + 12);
+            if (id >= (uint32_t)replay->nifaces || replay->ifaces[id].linktype != LINKTYPE_ETHERNET || caplen > body - 20) {
+                replay->stats.skipped++;
+                break;
+            }
+            ts = ((uint64_t)ether_replay_u32(replay, replay->block + 4) << 32) | ether_replay_u32(replay, replay->block + 8);
+            if (ether_replay_load(replay, replay->block + 20, caplen, ether_replay_nsec(ts, replay->ifaces[id].units)) == 0) {
+                return 0;
+            }
+            break;
+        case PCAPNG_BLOCK_SPB:
+            /* NOTE: no timestamp, replayed right after the previous frame */
+            if (body < 4 || !replay->nifaces || replay->ifaces[0].linktype != LINKTYPE_ETHERNET) {
+                replay->stats.skipped++;
+                break;
+            }
+            caplen = MIN(ether_replay_u32(replay, replay->block), body - 4);
+            if (ether_replay_load(replay, replay->block + 4, caplen, replay->ts) == 0) {
+                return 0;
+            }
+            break;
+        default:
+            /* ignore: name resolution, statistics, custom blocks, ... */
+            break;
+        }
+    }
+    return -1;
+}
+
+static int
+ether_replay_next(struct ether_replay *replay)
+{
+    if (replay->format == ETHER_REPLAY_FORMAT_PCAPNG) {
+        return ether_replay_pcapng_next(replay);
+    }
+    return ether_replay_pcap_next(replay);
+}
+
+static ssize_t
+ether_replay_frame(struct net_device *dev, uint8_t *buf, size_t size)
+{
+    struct ether_replay *replay = PRIV(dev);
+
+    if (!replay->pending || replay->flen > size) {
+        return -1;
+    }
+    memcpy(buf, replay->frame, replay->flen);
+    replay->pending = 0;
+    replay->stats.frames++;
+    replay->stats.bytes += replay->flen;
+    return replay->flen;
+}
+
+static void
+ether_replay_timer(void)
+{
+    struct ether_replay *replay;
+    struct timeval now, diff;
+    uint64_t elapsed;
+    int n;
+
+    for (replay = replays; replay; replay = replay->next) {
+        if (!NET_DEVICE_IS_UP(replay->dev) || replay->stats.finished) {
+            continue;
+        }
+        gettimeofday(&now, NULL);
+        mutex_lock(&replay->mutex);
+        for (n = 0; n < ETHER_REPLAY_BURST; n++) {
+            if (!replay->pending && ether_replay_next(replay) == -1) {
+                replay->stats.finished = 1;
+                infof("finished, dev=%s, frames=%" PRIu64 ", skipped=%" PRIu64, replay->dev->name, replay->stats.frames, replay->stats.skipped);
+                break;
+            }
+            if (!replay->started) {
+                replay->t0 = replay->ts;
+                replay->start = now;
+                replay->started = 1;
+            }
+            if (replay->speed > 0) {
+                timersub(&now, &replay->start, &diff);
+                elapsed = (uint64_t)diff.tv_sec * 1000000000 + diff.tv_usec * 1000;
+                if (replay->ts > replay->t0 && elapsed < (replay->ts - replay->t0) / replay->speed) {
+                    break; /* not yet */
+                }
+            }
+            ether_poll_helper(replay->dev, ether_replay_frame);
+        }
+        mutex_unlock(&replay->mutex);
+    }
+}
+
+static ssize_t
+ether_replay_write(struct net_device *dev, const uint8_t *frame, size_t flen, int flags)
+{
+    struct ether_replay *replay = PRIV(dev);
+    struct pcap_record_hdr hdr;
+    struct timeval now;
+
+    mutex_lock(&replay->mutex);
+    replay->stats.tx_frames++;
+    replay->stats.tx_bytes += flen;
+    if (replay->out) {
+        gettimeofday(&now, NULL);
+        hdr.sec = now.tv_sec;
+        hdr.frac = now.tv_usec;
+        hdr.caplen = flen;
+        hdr.len = flen;
+        if (fwrite(&hdr, sizeof(hdr), 1, replay->out) != 1 || fwrite(frame, flen, 1, replay->out) != 1) {
+            errorf("fwrite: %s, dev=%s", strerror(errno), dev->name);
+        }
+    }
+    mutex_unlock(&replay->mutex);
+    return flen;
+}
+
+static int
+ether_replay_transmit(struct net_device *dev, uint16_t type, const uint8_t *buf, size_t len, const void *dst, int flags)
+{
+    return ether_transmit_helper(dev, type, buf, len, dst, flags, ether_replay_write);
+}
+
+static int
+ether_replay_close(struct net_device *dev)
+{
+    struct ether_replay *replay = PRIV(dev);
+
+    mutex_lock(&replay->mutex);
+    if (replay->out) {
+        fflush(replay->out);
+    }
+    mutex_unlock(&replay->mutex);
+    return 0;
+}
+
+static struct net_device_ops ether_replay_ops = {
+    .close = ether_replay_close,
+    .transmit = ether_replay_transmit,
+};
+
+static int
+ether_replay_open_input(struct ether_replay *replay, const char *input)
+{
+    uint8_t magic[4];
+    uint32_t v;
+
+    replay->in = fopen(input, "rb");
+    if (!replay->in) {
+        errorf("fopen: %s, input=%s", strerror(errno), input);
+        return -1;
+    }
+    if (ether_replay_read(replay, magic, sizeof(magic)) == -1) {
+        errorf("empty file, input=%s", input);
+        return -1;
+    }
+    memcpy(&v, magic, sizeof(v));
+    switch (v) {
+    case PCAP_MAGIC_USEC:
+    case PCAP_MAGIC_NSEC:
+    case __builtin_bswap32(PCAP_MAGIC_USEC):
+    case __builtin_bswap32(PCAP_MAGIC_NSEC):
+        return ether_replay_pcap_header(replay, magic);
+    case PCAPNG_BLOCK_SHB:
+        replay->format = ETHER_REPLAY_FORMAT_PCAPNG;
+        rewind(replay->in);
+        return 0;
+    }
+    errorf("unknown format, input=%s", input);
+    return -1;
+}
+
+static int
+ether_replay_open_output(struct ether_replay *replay, const char *output)
+{
+    struct pcap_file_hdr hdr = {};
+
+    replay->out = fopen(output, "wb");
+    if (!replay->out) {
+        errorf("fopen: %s, output=%s", strerror(errno), output);
+        return -1;
+    }
+    hdr.magic = PCAP_MAGIC_USEC;
+    hdr.major = PCAP_VERSION_MAJOR;
+    hdr.minor = PCAP_VERSION_MINOR;
+    hdr.snaplen = ETHER_FRAME_SIZE_JUMBO;
+    hdr.linktype = LINKTYPE_ETHERNET;
+    if (fwrite(&hdr, sizeof(hdr), 1, replay->out) != 1) {
+        errorf("fwrite: %s, output=%s", strerror(errno), output);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+ether_replay_free(struct ether_replay *replay)
+{
+    if (replay->in) {
+        fclose(replay->in);
+    }
+    if (replay->out) {
+        fclose(replay->out);
+    }
+    memory_free(replay);
+}
+
+struct net_device *
+ether_replay_init(const char *input, const char *output, double speed, const char *addr)
+{
+    static int registered = 0;
+    struct net_device *dev;
+    struct ether_replay *replay;
+    struct timeval interval = {0, 0}; /* every tick of the interrupt timer */
+
+    if (speed < 0) {
+        errorf("invalid speed");
+        return NULL;
+    }
+    replay = memory_alloc(sizeof(*replay));
+    if (!replay) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    replay->speed = speed;
+    mutex_init(&replay->mutex);
+    if (ether_replay_open_input(replay, input) == -1) {
+        ether_replay_free(replay);
+        return NULL;
+    }
+    if (output && ether_replay_open_output(replay, output) == -1) {
+        ether_replay_free(replay);
+        return NULL;
+    }
+    dev = net_device_alloc(ether_setup_helper);
+    if (!dev) {
+        errorf("net_device_alloc() failure");
+        ether_replay_free(replay);
+        return NULL;
+    }
+    if (addr) {
+        if (ether_addr_pton(addr, dev->addr) == -1) {
+            errorf("invalid address, addr=%s", addr);
+            ether_replay_free(replay);
+            return NULL;
+        }
+    }
+    dev->ops = &ether_replay_ops;
+    dev->priv = replay;
+    replay->dev = dev;
+    if (net_device_register(dev) == -1) {
+        errorf("net_device_register() failure");
+        ether_replay_free(replay);
+        return NULL;
+    }
+    if (!registered) {
+        if (net_timer_register("Replay Timer", interval, ether_replay_timer) == -1) {
+            errorf("net_timer_register() failure");
+            return NULL;
+        }
+        registered = 1;
+    }
+    replay->next = replays;
+    replays = replay;
+    debugf("initialized, dev=%s, input=%s, output=%s, speed=%.2f", dev->name, input, output ? output : "(none)", speed);
+    return dev;
+}
+
+int
+ether_replay_get_stats(struct net_device *dev, struct ether_replay_stats *stats)
+{
+    struct ether_replay *replay;
+
+    if (dev->ops != &ether_replay_ops) {
+        errorf("not a replay device, dev=%s", dev->name);
+        return -1;
+    }
+    replay = PRIV(dev);
+    mutex_lock(&replay->mutex);
+    *stats = replay->stats;
+    mutex_unlock(&replay->mutex);
+    return 0;
+}
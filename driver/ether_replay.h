@@ -0,0 +1,24 @@
+#ifndef ETHER_REPLAY_H
+#define ETHER_REPLAY_H
+
+#include <stdint.h>
+
+#include "net.h"
+
+#define ETHER_REPLAY_SPEED_UNLIMITED 0.0 /* ignore the timestamps, inject as fast as possible */
+
+struct ether_replay_stats {
+    uint64_t frames; /* injected */
+    uint64_t bytes;
+    uint64_t skipped; /* not Ethernet, or larger than a jumbo frame */
+    uint64_t tx_frames; /* transmitted by the stack */
+    uint64_t tx_bytes;
+    int finished; /* reached the end of the input */
+};
+
+extern struct net_device *
+ether_replay_init(const char *input, const char *output, double speed, const char *addr);
+extern int
+ether_replay_get_stats(struct net_device *dev, struct ether_replay_stats *stats);
+
+#endif
@@ -0,0 +1,296 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+
+#include "driver/impair.h"
+
+/*
+ * Link Impairment
+ *
+ * NOTE: wraps the transmit of an existing device. Packets are held in a queue
+ *       sorted by the release time and handed to the original transmit by the
+ *       timer, so the resolution is the tick of the interrupt timer (1ms).
+ *       Only the transmit side is impaired, attach it to the both ends for
+ *       a symmetric link.
+ */
+
+/* NOTE: the data follows immediately after the structure */
+struct impair_packet {
+    struct impair_packet *next;
+    struct timeval release;
+    uint16_t type;
+    int flags;
+    int has_dst;
+    uint8_t dst[NET_DEVICE_ADDR_LEN];
+    size_t len;
+};
+
+struct impair {
+    struct impair *next;
+    struct net_device *dev;
+    struct net_device_ops ops; /* installed on the device */
+    struct net_device_ops *lower; /* the original ops of the device */
+    struct impair_config cfg;
+    mutex_t mutex;
+    uint64_t rnd; /* state of the xorshift generator */
+    int lost; /* the previous packet was lost */
+    struct timeval busy; /* the link serializes the queued packets until this time */
+    struct impair_packet *head;
+    struct impair_packet *tail;
+    unsigned int num;
+    struct impair_stats stats;
+};
+
+/* NOTE: if you want to add/delete the entries after net_run(), you need to protect this list with a mutex. */
+static struct impair *impairs;
+
+static struct impair *
+impair_lookup(struct net_device *dev)
+{
+    struct impair *impair;
+
+    for (impair = impairs; impair; impair = impair->next) {
+        if (impair->dev == dev) {
+            return impair;
+        }
+    }
+    return NULL;
+}
+
+static uint32_t
+impair_random(struct impair *impair)
+{
+    /* xorshift64* */
+    impair->rnd ^= impair->rnd >> 12;
+    impair->rnd ^= impair->rnd << 25;
+    impair->rnd ^= impair->rnd >> 27;
+    return (impair->rnd * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+static int
+impair_chance(struct impair *impair, unsigned int ppm)
+{
+    if (!ppm) {
+        return 0;
+    }
+    return impair_random(impair) % IMPAIR_PPM < ppm;
+}
+
+/* NOTE: must be called after mutex locked */
+static void
+impair_insert(struct impair *impair, struct impair_packet *pkt)
+{
+    struct impair_packet *prev = NULL, *entry;
+
+    if (!impair->tail || !timercmp(&pkt->release, &impair->tail->release, <)) {
+        /* the common case, no jitter or reordering */
+        pkt->next = NULL;
+        if (impair->tail) {
+            impair->tail->next = pkt;
+        } else {
+            impair->head = pkt;
+        }
+        impair->tail = pkt;
+    } else {
+        for (entry = impair->head; entry; prev = entry, entry = entry->next) {
+            if (timercmp(&pkt->release, &entry->release, <)) {
+                break;
+            }
+        }
+        pkt->next = entry;
+        if (prev) {
+            prev->next = pkt;
+        } else {
+            impair->head = pkt;
+        }
+    }
+    impair->num++;
+}
+
+/* NOTE: must be called after mutex locked */
+static void
+impair_enqueue(struct impair *impair, uint16_t type, const uint8_t *data, size_t len, const void *dst, int flags)
+{
+    struct impair_packet *pkt;
+    struct timeval now, start;
+    long usec;
+
+    if (impair->num >= (impair->cfg.limit ? impair->cfg.limit : IMPAIR_LIMIT_DEFAULT)) {
+        impair->stats.overlimits++;
+        return;
+    }
+    pkt = memory_alloc(sizeof(*pkt) + len);
+    if (!pkt) {
+        errorf("memory_alloc() failure");
+        return;
+    }
+    pkt->type = type;
+    pkt->flags = flags & ~NET_PACKET_FLAG_MORE; /* NOTE: released one by one, there is no burst to flush */
+    if (dst) {
+        pkt->has_dst = 1;
+        memcpy(pkt->dst, dst, impair->dev->alen);
+    }
+    pkt->len = len;
+    memcpy(pkt + 1, data, len);
+    gettimeofday(&now, NULL);
+    if (impair_chance(impair, impair->cfg.reorder)) {
+        impair->stats.reorders++;
+        pkt->release = now;
+        impair_insert(impair, pkt);
+        return;
+    }
+    /* the link serializes the packets one after another at the rate */
+    start = timercmp(&impair->busy, &now, >) ? impair->busy : now;
+    if (impair->cfg.rate) {
+        usec = (uint64_t)len * 8 * 1000000 / impair->cfg.rate;
+        timeval_add_usec(&start, usec);
+    }
+    impair->busy = start;
+    usec = impair->cfg.delay;
+    if (impair->cfg.jitter) {
+        usec += (long)(impair_random(impair) % (2 * impair->cfg.jitter + 1)) - impair->cfg.jitter;
+    }
+    pkt->release = start;
+    if (usec > 0) {
+        timeval_add_usec(&pkt->release, usec);
+    }
+    impair_insert(impair, pkt);
+}
+
+static int
+impair_transmit(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst, int flags)
+{
+    struct impair *impair;
+    unsigned int loss;
+
+    impair = impair_lookup(dev);
+    if (!impair) {
+        errorf("not attached, dev=%s", dev->name);
+        return -1;
+    }
+    mutex_lock(&impair->mutex);
+    loss = (impair->lost && impair->cfg.loss_burst) ? impair->cfg.loss_burst : impair->cfg.loss;
+    if (impair_chance(impair, loss)) {
+        /* NOTE: lost on the wire, the sender does not notice */
+        impair->lost = 1;
+        impair->stats.losses++;
+        mutex_unlock(&impair->mutex);
+        return 0;
+    }
+    impair->lost = 0;
+    impair_enqueue(impair, type, data, len, dst, flags);
+    if (impair_chance(impair, impair->cfg.duplicate)) {
+        impair->stats.duplicates++;
+        impair_enqueue(impair, type, data, len, dst, flags);
+    }
+    mutex_unlock(&impair->mutex);
+    return 0;
+}
+
+static void
+impair_timer(void)
+{
+    struct impair *impair;
+    struct impair_packet *head, *tail, *pkt;
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    for (impair = impairs; impair; impair = impair->next) {
+        head = tail = NULL;
+        mutex_lock(&impair->mutex);
+        while (impair->head && !timercmp(&impair->head->release, &now, >)) {
+            pkt = impair->head;
+            impair->head = pkt->next;
+            if (!impair->head) {
+                impair->tail = NULL;
+            }
+            impair->num--;
+            impair->stats.packets++;
+            impair->stats.bytes += pkt->len;
+            pkt->next = NULL;
+            if (tail) {
+                tail->next = pkt;
+            } else {
+                head = pkt;
+            }
+            tail = pkt;
+        }
+        mutex_unlock(&impair->mutex);
+        /* NOTE: the device may block, it is called without the mutex */
+        while ((pkt = head) != NULL) {
+            head = pkt->next;
+            if (NET_DEVICE_IS_UP(impair->dev)) {
+                impair->lower->transmit(impair->dev, pkt->type, (uint8_t *)(pkt + 1), pkt->len, pkt->has_dst ? pkt->dst : NULL, pkt->flags);
+            }
+            memory_free(pkt);
+        }
+    }
+}
+
+/* NOTE: must not be call after net_run() */
+int
+impair_attach(struct net_device *dev, const struct impair_config *cfg)
+{
+    static int registered = 0;
+    struct impair *impair;
+    struct timeval interval = {0, 0}; /* every tick of the interrupt timer */
+
+    if (impair_lookup(dev)) {
+        errorf("already attached, dev=%s", dev->name);
+        return -1;
+    }
+    if (cfg->loss > IMPAIR_PPM || cfg->loss_burst > IMPAIR_PPM || cfg->reorder > IMPAIR_PPM || cfg->duplicate > IMPAIR_PPM) {
+        errorf("probability out of range, dev=%s", dev->name);
+        return -1;
+    }
+    impair = memory_alloc(sizeof(*impair));
+    if (!impair) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    impair->dev = dev;
+    impair->cfg = *cfg;
+    impair->rnd = cfg->seed ? cfg->seed : 1;
+    mutex_init(&impair->mutex);
+    impair->lower = dev->ops;
+    impair->ops = *dev->ops;
+    impair->ops.transmit = impair_transmit;
+    impair->ops.transmit_iov = NULL; /* gathered by net_device_output_iov() */
+    impair->ops.flush = NULL;
+    if (!registered) {
+        if (net_timer_register("Impair Timer", interval, impair_timer) == -1) {
+            errorf("net_timer_register() failure");
+            memory_free(impair);
+            return -1;
+        }
+        registered = 1;
+    }
+    dev->ops = &impair->ops;
+    impair->next = impairs;
+    impairs = impair;
+    infof("dev=%s, delay=%u, jitter=%u, loss=%u, loss_burst=%u, reorder=%u, duplicate=%u, rate=%u", dev->name,
+        cfg->delay, cfg->jitter, cfg->loss, cfg->loss_burst, cfg->reorder, cfg->duplicate, cfg->rate);
+    return 0;
+}
+
+int
+impair_get_stats(struct net_device *dev, struct impair_stats *stats)
+{
+    struct impair *impair;
+
+    impair = impair_lookup(dev);
+    if (!impair) {
+        errorf("not attached, dev=%s", dev->name);
+        return -1;
+    }
+    mutex_lock(&impair->mutex);
+    *stats = impair->stats;
+    mutex_unlock(&impair->mutex);
+    return 0;
+}
@@ -0,0 +1,38 @@
+#ifndef IMPAIR_H
+#define IMPAIR_H
+
+#include <stdint.h>
+
+#include "net.h"
+
+#define IMPAIR_PPM 1000000 /* probabilities are given in parts per million */
+
+#define IMPAIR_LIMIT_DEFAULT 1000 /* packets */
+
+struct impair_config {
+    unsigned int delay; /* one-way delay (usec) */
+    unsigned int jitter; /* added to the delay, uniformly distributed in [-jitter, +jitter] (usec) */
+    unsigned int loss; /* probability of loss (ppm) */
+    unsigned int loss_burst; /* probability of loss right after a loss (ppm), 0 means independent losses */
+    unsigned int reorder; /* probability to skip the delay and overtake the queued packets (ppm) */
+    unsigned int duplicate; /* probability of duplication (ppm) */
+    unsigned int rate; /* bandwidth cap (bits per second), 0 means unlimited */
+    unsigned int limit; /* packets held, 0 means IMPAIR_LIMIT_DEFAULT */
+    unsigned int seed; /* the same seed gives the same sequence of decisions */
+};
+
+struct impair_stats {
+    uint64_t packets; /* handed to the device */
+    uint64_t bytes;
+    uint64_t losses;
+    uint64_t duplicates;
+    uint64_t reorders;
+    uint64_t overlimits; /* dropped because the limit was reached */
+};
+
+extern int
+impair_attach(struct net_device *dev, const struct impair_config *cfg);
+extern int
+impair_get_stats(struct net_device *dev, struct impair_stats *stats);
+
+#endif
@@ -9,16 +9,42 @@
 #define LOOPBACK_MTU UINT16_MAX /* maximum size of IP datagram */
 
 static int
-loopback_transmit(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst)
+loopback_transmit(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst, int flags)
 {
     debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, net_protocol_name(type), type, len);
     debugdump(data, len);
-    net_input_handler(type, data, len, dev);
+    if (flags & NET_PACKET_FLAG_CSUM_PARTIAL) {
+        /* never left the host, nothing to verify */
+        flags |= NET_PACKET_FLAG_CSUM_VALID;
+    }
+    if (dev->features & NET_DEVICE_FEATURE_IP_CSUM) {
+        /* the header checksum was left out on the way in */
+        flags |= NET_PACKET_FLAG_IP_CSUM_VALID;
+    }
+    net_input_handler(type, data, len, dev, flags);
+    return 0;
+}
+
+static int
+loopback_transmit_iov(struct net_device *dev, uint16_t type, const struct iovec *iov, int iovcnt, const void *dst, int flags)
+{
+    debugf("dev=%s, type=%s(0x%04x), len=%zu, iovcnt=%d", dev->name, net_protocol_name(type), type, iovec_len(iov, iovcnt), iovcnt);
+    if (flags & NET_PACKET_FLAG_CSUM_PARTIAL) {
+        /* never left the host, nothing to verify */
+        flags |= NET_PACKET_FLAG_CSUM_VALID;
+    }
+    if (dev->features & NET_DEVICE_FEATURE_IP_CSUM) {
+        /* the header checksum was left out on the way in */
+        flags |= NET_PACKET_FLAG_IP_CSUM_VALID;
+    }
+    /* NOTE: the fragments are gathered straight into the input queue entry */
+    net_input_handler_iov(type, iov, iovcnt, dev, flags);
     return 0;
 }
 
 static struct net_device_ops loopback_ops = {
     .transmit = loopback_transmit,
+    .transmit_iov = loopback_transmit_iov,
 };
 
 static void
@@ -29,6 +55,9 @@ loopback_setup(struct net_device *dev)
     dev->hlen = 0; /* non header */
     dev->alen = 0; /* non address */
     dev->flags = NET_DEVICE_FLAG_LOOPBACK;
+    /* NOTE: packets never leave the host, there is nothing to compute or verify */
+    dev->hw_features = (NET_DEVICE_FEATURE_TX_CSUM | NET_DEVICE_FEATURE_TSO | NET_DEVICE_FEATURE_RX_CSUM |
+        NET_DEVICE_FEATURE_SG | NET_DEVICE_FEATURE_IP_CSUM);
     dev->ops = &loopback_ops;
 }
 
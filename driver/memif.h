@@ -0,0 +1,12 @@
+#ifndef MEMIF_H
+#define MEMIF_H
+
+#include "net.h"
+
+#define MEMIF_FLAG_MASTER  0x0001 /* owns the shared memory and listens on the socket */
+#define MEMIF_FLAG_POLLING 0x0002 /* busy-polls the receive ring instead of waiting for the doorbell */
+
+extern struct net_device *
+memif_init(const char *path, int flags, const char *addr);
+
+#endif
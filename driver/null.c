@@ -1,13 +1,134 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "platform.h"
 
 #include "util.h"
 #include "net.h"
+#include "ether.h"
+#include "ip.h"
+
+#include "null.h"
 
 #define NULL_MTU UINT16_MAX /* maximum size of IP datagram */
 
+#define NULL_GEN_STATE_CLOSED      0
+#define NULL_GEN_STATE_SYN_SENT    1
+#define NULL_GEN_STATE_ESTABLISHED 2
+
+#define NULL_GEN_TCP_RTO 200000 /* usec, go back to the last acknowledged byte */
+#define NULL_GEN_TCP_SYN_RTO 1000000 /* usec */
+#define NULL_GEN_TCP_MSS (ETHER_PAYLOAD_SIZE_MAX - 40)
+
+#define NULL_GEN_PORT_MIN 49152
+
+#define NULL_GEN_ARP_HRD_ETHER   0x0001
+#define NULL_GEN_ARP_OP_REQUEST  1
+#define NULL_GEN_ARP_OP_REPLY    2
+#define NULL_GEN_ICMP_TYPE_ECHO  8
+#define NULL_GEN_TCP_OPT_MSS     2
+
+#define NULL_GEN_TCP_FLG_FIN 0x01
+#define NULL_GEN_TCP_FLG_SYN 0x02
+#define NULL_GEN_TCP_FLG_RST 0x04
+#define NULL_GEN_TCP_FLG_PSH 0x08
+#define NULL_GEN_TCP_FLG_ACK 0x10
+
+/* NOTE: the generator keeps its own view of the headers, like each protocol module does */
+struct null_gen_ip_hdr {
+    uint8_t vhl;
+    uint8_t tos;
+    uint16_t total;
+    uint16_t id;
+    uint16_t offset;
+    uint8_t ttl;
+    uint8_t protocol;
+    uint16_t sum;
+    ip_addr_t src;
+    ip_addr_t dst;
+};
+
+struct null_gen_pseudo_hdr {
+    uint32_t src;
+    uint32_t dst;
+    uint8_t zero;
+    uint8_t protocol;
+    uint16_t len;
+};
+
+struct null_gen_udp_hdr {
+    uint16_t src;
+    uint16_t dst;
+    uint16_t len;
+    uint16_t sum;
+};
+
+struct null_gen_tcp_hdr {
+    uint16_t src;
+    uint16_t dst;
+    uint32_t seq;
+    uint32_t ack;
+    uint8_t off;
+    uint8_t flg;
+    uint16_t wnd;
+    uint16_t sum;
+    uint16_t up;
+};
+
+struct null_gen_icmp_hdr {
+    uint8_t type;
+    uint8_t code;
+    uint16_t sum;
+    uint16_t id;
+    uint16_t seq;
+};
+
+struct null_gen_arp {
+    uint16_t hrd;
+    uint16_t pro;
+    uint8_t hln;
+    uint8_t pln;
+    uint16_t op;
+    uint8_t sha[ETHER_ADDR_LEN];
+    uint8_t spa[IP_ADDR_LEN];
+    uint8_t tha[ETHER_ADDR_LEN];
+    uint8_t tpa[IP_ADDR_LEN];
+};
+
+struct null_gen {
+    struct null_gen *next;
+    struct net_device *dev;
+    struct null_gen_config cfg;
+    ip_addr_t local;
+    ip_addr_t peer;
+    mutex_t mutex;
+    struct timeval last; /* last timer tick */
+    uint64_t credit; /* packets * usec, refilled by the rate */
+    unsigned int turn; /* round robin over the patterns */
+    uint16_t id;
+    struct {
+        int state;
+        uint16_t port; /* local port of the peer */
+        uint32_t iss;
+        uint32_t snd_una;
+        uint32_t snd_nxt;
+        uint32_t rcv_nxt;
+        uint16_t wnd;
+        struct timeval last; /* last progress */
+    } tcp;
+    struct null_gen_stats stats;
+};
+
+static const uint8_t NULL_GEN_ADDR[ETHER_ADDR_LEN] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x02};
+static const uint8_t NULL_GEN_PEER_ADDR[ETHER_ADDR_LEN] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+
+/* NOTE: if you want to add/delete the entries after net_run(), you need to protect this list with a mutex. */
+static struct null_gen *gens;
+
 static int
-null_transmit(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst)
+null_transmit(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst, int flags)
 {
     debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, net_protocol_name(type), type, len);
     debugdump(data, len);
@@ -46,3 +167,470 @@ null_init(void)
     debugf("initialized, dev=%s", dev->name);
     return dev;
 }
+
+/*
+ * Traffic Generator
+ *
+ * NOTE: an Ethernet device wired to a synthetic peer. The peer emits traffic
+ *       on a timer and answers what the stack transmits, so the stack can be
+ *       measured without a kernel device.
+ */
+
+/* NOTE: must be called after mutex locked */
+static void
+null_gen_input(struct null_gen *gen, uint16_t type, uint8_t *frame, size_t len)
+{
+    memcpy(frame, NULL_GEN_ADDR, ETHER_ADDR_LEN);
+    if (type == ETHER_TYPE_ARP && ntoh16(((struct null_gen_arp *)(frame + ETHER_HDR_SIZE))->op) == NULL_GEN_ARP_OP_REQUEST) {
+        memcpy(frame, ETHER_ADDR_BROADCAST, ETHER_ADDR_LEN);
+    }
+    memcpy(frame + ETHER_ADDR_LEN, NULL_GEN_PEER_ADDR, ETHER_ADDR_LEN);
+    frame[12] = type >> 8;
+    frame[13] = type & 0xff;
+    len += ETHER_HDR_SIZE;
+    if (len < ETHER_FRAME_SIZE_MIN) {
+        memset(frame + len, 0, ETHER_FRAME_SIZE_MIN - len);
+        len = ETHER_FRAME_SIZE_MIN;
+    }
+    gen->stats.rx_packets++;
+    gen->stats.rx_bytes += len;
+    ether_input_helper(gen->dev, frame, len, 0);
+}
+
+/* NOTE: fills the IP header and returns the L4 header */
+static uint8_t *
+null_gen_ip(struct null_gen *gen, uint8_t *frame, uint8_t protocol, size_t len)
+{
+    struct null_gen_ip_hdr *hdr;
+
+    hdr = (struct null_gen_ip_hdr *)(frame + ETHER_HDR_SIZE);
+    hdr->vhl = (IP_VERSION_IPV4 << 4) | (sizeof(*hdr) >> 2);
+    hdr->tos = 0;
+    hdr->total = hton16(sizeof(*hdr) + len);
+    hdr->id = hton16(gen->id++);
+    hdr->offset = 0;
+    hdr->ttl = 64;
+    hdr->protocol = protocol;
+    hdr->sum = 0;
+    hdr->src = gen->peer;
+    hdr->dst = gen->local;
+    hdr->sum = cksum16((uint16_t *)hdr, sizeof(*hdr), 0);
+    return (uint8_t *)(hdr + 1);
+}
+
+static uint16_t
+null_gen_l4_cksum(struct null_gen *gen, uint8_t protocol, const uint8_t *data, size_t len)
+{
+    struct null_gen_pseudo_hdr pseudo;
+    uint16_t psum;
+
+    pseudo.src = gen->peer;
+    pseudo.dst = gen->local;
+    pseudo.zero = 0;
+    pseudo.protocol = protocol;
+    pseudo.len = hton16(len);
+    psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
+    return cksum16((uint16_t *)data, len, psum);
+}
+
+static int
+null_gen_arp(struct null_gen *gen, uint16_t op, const uint8_t *tha, ip_addr_t tpa)
+{
+    uint8_t frame[ETHER_FRAME_SIZE_MIN];
+    struct null_gen_arp *msg;
+
+    msg = (struct null_gen_arp *)(frame + ETHER_HDR_SIZE);
+    msg->hrd = hton16(NULL_GEN_ARP_HRD_ETHER);
+    msg->pro = hton16(ETHER_TYPE_IP);
+    msg->hln = ETHER_ADDR_LEN;
+    msg->pln = IP_ADDR_LEN;
+    msg->op = hton16(op);
+    memcpy(msg->sha, NULL_GEN_PEER_ADDR, ETHER_ADDR_LEN);
+    memcpy(msg->spa, &gen->peer, IP_ADDR_LEN);
+    memcpy(msg->tha, tha, ETHER_ADDR_LEN);
+    memcpy(msg->tpa, &tpa, IP_ADDR_LEN);
+    null_gen_input(gen, ETHER_TYPE_ARP, frame, sizeof(*msg));
+    return 1;
+}
+
+static int
+null_gen_udp(struct null_gen *gen)
+{
+    uint8_t frame[ETHER_FRAME_SIZE_MAX];
+    struct null_gen_udp_hdr *hdr;
+    size_t len;
+
+    len = sizeof(*hdr) + gen->cfg.size;
+    hdr = (struct null_gen_udp_hdr *)null_gen_ip(gen, frame, IP_PROTOCOL_UDP, len);
+    hdr->src = hton16(NULL_GEN_PORT_MIN);
+    hdr->dst = hton16(gen->cfg.port);
+    hdr->len = hton16(len);
+    hdr->sum = 0;
+    memset(hdr + 1, 0, gen->cfg.size);
+    hdr->sum = null_gen_l4_cksum(gen, IP_PROTOCOL_UDP, (uint8_t *)hdr, len);
+    null_gen_input(gen, ETHER_TYPE_IP, frame, sizeof(struct null_gen_ip_hdr) + len);
+    return 1;
+}
+
+static int
+null_gen_icmp(struct null_gen *gen)
+{
+    uint8_t frame[ETHER_FRAME_SIZE_MAX];
+    struct null_gen_icmp_hdr *hdr;
+    size_t len;
+
+    len = sizeof(*hdr) + gen->cfg.size;
+    hdr = (struct null_gen_icmp_hdr *)null_gen_ip(gen, frame, IP_PROTOCOL_ICMP, len);
+    hdr->type = NULL_GEN_ICMP_TYPE_ECHO;
+    hdr->code = 0;
+    hdr->sum = 0;
+    hdr->id = hton16(NULL_GEN_PORT_MIN);
+    hdr->seq = hton16(gen->id);
+    memset(hdr + 1, 0, gen->cfg.size);
+    hdr->sum = cksum16((uint16_t *)hdr, len, 0);
+    null_gen_input(gen, ETHER_TYPE_IP, frame, sizeof(struct null_gen_ip_hdr) + len);
+    return 1;
+}
+
+/* NOTE: must be called after mutex locked */
+static int
+null_gen_tcp_segment(struct null_gen *gen, uint32_t seq, uint8_t flg, size_t plen)
+{
+    uint8_t frame[ETHER_FRAME_SIZE_MAX];
+    struct null_gen_tcp_hdr *hdr;
+    uint8_t *opt;
+    size_t hlen, len;
+
+    hlen = sizeof(*hdr) + ((flg & NULL_GEN_TCP_FLG_SYN) ? 4 : 0);
+    len = hlen + plen;
+    hdr = (struct null_gen_tcp_hdr *)null_gen_ip(gen, frame, IP_PROTOCOL_TCP, len);
+    hdr->src = hton16(gen->tcp.port);
+    hdr->dst = hton16(gen->cfg.port);
+    hdr->seq = hton32(seq);
+    hdr->ack = (flg & NULL_GEN_TCP_FLG_ACK) ? hton32(gen->tcp.rcv_nxt) : 0;
+    hdr->off = (hlen >> 2) << 4;
+    hdr->flg = flg;
+    hdr->wnd = hton16(UINT16_MAX);
+    hdr->sum = 0;
+    hdr->up = 0;
+    if (flg & NULL_GEN_TCP_FLG_SYN) {
+        opt = (uint8_t *)(hdr + 1);
+        opt[0] = NULL_GEN_TCP_OPT_MSS;
+        opt[1] = 4;
+        opt[2] = NULL_GEN_TCP_MSS >> 8;
+        opt[3] = NULL_GEN_TCP_MSS & 0xff;
+    }
+    memset((uint8_t *)hdr + hlen, 0, plen);
+    hdr->sum = null_gen_l4_cksum(gen, IP_PROTOCOL_TCP, (uint8_t *)hdr, len);
+    null_gen_input(gen, ETHER_TYPE_IP, frame, sizeof(struct null_gen_ip_hdr) + len);
+    return 1;
+}
+
+/* NOTE: must be called after mutex locked, returns 0 when the peer has nothing to send */
+static int
+null_gen_tcp(struct null_gen *gen)
+{
+    struct timeval now, diff;
+    uint32_t inflight;
+    size_t len;
+
+    gettimeofday(&now, NULL);
+    timersub(&now, &gen->tcp.last, &diff);
+    switch (gen->tcp.state) {
+    case NULL_GEN_STATE_CLOSED:
+        gen->tcp.port = NULL_GEN_PORT_MIN + 1 + (gen->stats.tcp_connects + gen->stats.tcp_resets) % (UINT16_MAX - NULL_GEN_PORT_MIN);
+        gen->tcp.iss += 0x10000;
+        gen->tcp.snd_una = gen->tcp.iss;
+        gen->tcp.snd_nxt = gen->tcp.iss + 1;
+        gen->tcp.rcv_nxt = 0;
+        gen->tcp.state = NULL_GEN_STATE_SYN_SENT;
+        gen->tcp.last = now;
+        return null_gen_tcp_segment(gen, gen->tcp.iss, NULL_GEN_TCP_FLG_SYN, 0);
+    case NULL_GEN_STATE_SYN_SENT:
+        if (diff.tv_sec * 1000000 + diff.tv_usec < NULL_GEN_TCP_SYN_RTO) {
+            return 0;
+        }
+        gen->tcp.state = NULL_GEN_STATE_CLOSED;
+        return 0;
+    case NULL_GEN_STATE_ESTABLISHED:
+        inflight = gen->tcp.snd_nxt - gen->tcp.snd_una;
+        if (inflight && diff.tv_sec * 1000000 + diff.tv_usec >= NULL_GEN_TCP_RTO) {
+            /* go back N, also probes a zero window */
+            gen->tcp.snd_nxt = gen->tcp.snd_una;
+            gen->tcp.last = now;
+            len = MAX(1, MIN(gen->cfg.size, gen->tcp.wnd));
+        } else {
+            if (inflight >= gen->tcp.wnd) {
+                return 0;
+            }
+            len = MIN(gen->cfg.size, gen->tcp.wnd - inflight);
+            if (!inflight) {
+                gen->tcp.last = now;
+            }
+        }
+        null_gen_tcp_segment(gen, gen->tcp.snd_nxt, NULL_GEN_TCP_FLG_ACK | NULL_GEN_TCP_FLG_PSH, len);
+        gen->tcp.snd_nxt += len;
+        return 1;
+    }
+    return 0;
+}
+
+/* NOTE: must be called after mutex locked */
+static void
+null_gen_tcp_input(struct null_gen *gen, const uint8_t *data, size_t len)
+{
+    struct null_gen_tcp_hdr *hdr;
+    uint32_t seq, ack;
+    size_t hlen, plen;
+
+    if (len < sizeof(*hdr)) {
+        return;
+    }
+    hdr = (struct null_gen_tcp_hdr *)data;
+    hlen = (hdr->off >> 4) << 2;
+    if (hlen < sizeof(*hdr) || hlen > len) {
+        return;
+    }
+    if (ntoh16(hdr->dst) != gen->tcp.port || ntoh16(hdr->src) != gen->cfg.port || gen->tcp.state == NULL_GEN_STATE_CLOSED) {
+        return;
+    }
+    plen = len - hlen;
+    seq = ntoh32(hdr->seq);
+    ack = ntoh32(hdr->ack);
+    if (hdr->flg & NULL_GEN_TCP_FLG_RST) {
+        gen->tcp.state = NULL_GEN_STATE_CLOSED;
+        gen->stats.tcp_resets++;
+        return;
+    }
+    if (gen->tcp.state == NULL_GEN_STATE_SYN_SENT) {
+        if ((hdr->flg & (NULL_GEN_TCP_FLG_SYN | NULL_GEN_TCP_FLG_ACK)) == (NULL_GEN_TCP_FLG_SYN | NULL_GEN_TCP_FLG_ACK) && ack == gen->tcp.iss + 1) {
+            gen->tcp.rcv_nxt = seq + 1;
+            gen->tcp.snd_una = ack;
+            gen->tcp.wnd = ntoh16(hdr->wnd);
+            gen->tcp.state = NULL_GEN_STATE_ESTABLISHED;
+            gettimeofday(&gen->tcp.last, NULL);
+            gen->stats.tcp_connects++;
+            null_gen_tcp_segment(gen, gen->tcp.snd_nxt, NULL_GEN_TCP_FLG_ACK, 0);
+        }
+        return;
+    }
+    if (hdr->flg & NULL_GEN_TCP_FLG_ACK) {
+        if (ack - gen->tcp.snd_una - 1 < gen->tcp.snd_nxt - gen->tcp.snd_una) {
+            gen->stats.tcp_acked += ack - gen->tcp.snd_una;
+            gen->tcp.snd_una = ack;
+            gettimeofday(&gen->tcp.last, NULL);
+        }
+        gen->tcp.wnd = ntoh16(hdr->wnd);
+    }
+    if (hdr->flg & NULL_GEN_TCP_FLG_FIN) {
+        /* NOTE: the peer never closes by itself, abort and reconnect */
+        null_gen_tcp_segment(gen, gen->tcp.snd_nxt, NULL_GEN_TCP_FLG_RST, 0);
+        gen->tcp.state = NULL_GEN_STATE_CLOSED;
+        gen->stats.tcp_resets++;
+        return;
+    }
+    if (plen) {
+        if (seq == gen->tcp.rcv_nxt) {
+            gen->tcp.rcv_nxt += plen;
+        }
+        null_gen_tcp_segment(gen, gen->tcp.snd_nxt, NULL_GEN_TCP_FLG_ACK, 0);
+    }
+}
+
+static int
+null_gen_transmit(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst, int flags)
+{
+    struct null_gen *gen;
+    struct null_gen_arp *msg;
+    struct null_gen_ip_hdr *hdr;
+    size_t hlen;
+    ip_addr_t tpa;
+
+    gen = (struct null_gen *)dev->priv;
+    debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, net_protocol_name(type), type, len);
+    debugdump(data, len);
+    mutex_lock(&gen->mutex);
+    gen->stats.tx_packets++;
+    gen->stats.tx_bytes += len;
+    switch (type) {
+    case ETHER_TYPE_ARP:
+        gen->stats.tx_arp++;
+        msg = (struct null_gen_arp *)data;
+        if (len >= sizeof(*msg) && ntoh16(msg->op) == NULL_GEN_ARP_OP_REQUEST) {
+            memcpy(&tpa, msg->tpa, IP_ADDR_LEN);
+            if (tpa == gen->peer) {
+                memcpy(&tpa, msg->spa, IP_ADDR_LEN);
+                null_gen_arp(gen, NULL_GEN_ARP_OP_REPLY, msg->sha, tpa);
+            }
+        }
+        break;
+    case ETHER_TYPE_IP:
+        hdr = (struct null_gen_ip_hdr *)data;
+        if (len < sizeof(*hdr)) {
+            break;
+        }
+        hlen = (hdr->vhl & 0x0f) << 2;
+        if (hlen > len) {
+            break;
+        }
+        switch (hdr->protocol) {
+        case IP_PROTOCOL_ICMP:
+            gen->stats.tx_icmp++;
+            break;
+        case IP_PROTOCOL_UDP:
+            gen->stats.tx_udp++;
+            break;
+        case IP_PROTOCOL_TCP:
+            gen->stats.tx_tcp++;
+            null_gen_tcp_input(gen, data + hlen, MIN(len, ntoh16(hdr->total)) - hlen);
+            break;
+        }
+        break;
+    }
+    mutex_unlock(&gen->mutex);
+    return 0;
+}
+
+static struct net_device_ops null_gen_ops = {
+    .transmit = null_gen_transmit,
+};
+
+/* NOTE: must be called after mutex locked, returns 0 when none of the patterns has something to send */
+static int
+null_gen_emit(struct null_gen *gen)
+{
+    int i, bit;
+    static const uint8_t any[ETHER_ADDR_LEN];
+
+    for (i = 0; i < 4; i++) {
+        bit = 1 << (gen->turn++ % 4);
+        if (!(gen->cfg.pattern & bit)) {
+            continue;
+        }
+        switch (bit) {
+        case NULL_GEN_PATTERN_UDP:
+            return null_gen_udp(gen);
+        case NULL_GEN_PATTERN_TCP:
+            if (null_gen_tcp(gen)) {
+                return 1;
+            }
+            break;
+        case NULL_GEN_PATTERN_ICMP:
+            return null_gen_icmp(gen);
+        case NULL_GEN_PATTERN_ARP:
+            return null_gen_arp(gen, NULL_GEN_ARP_OP_REQUEST, any, gen->local);
+        }
+    }
+    return 0;
+}
+
+static void
+null_gen_timer(void)
+{
+    struct null_gen *gen;
+    struct timeval now, diff;
+    uint64_t usec, max;
+    unsigned int n, burst;
+
+    gettimeofday(&now, NULL);
+    for (gen = gens; gen; gen = gen->next) {
+        if (!NET_DEVICE_IS_UP(gen->dev)) {
+            continue;
+        }
+        mutex_lock(&gen->mutex);
+        burst = gen->cfg.burst ? gen->cfg.burst : NULL_GEN_BURST_DEFAULT;
+        if (gen->cfg.rate) {
+            timersub(&now, &gen->last, &diff);
+            usec = diff.tv_sec * 1000000 + diff.tv_usec;
+            max = (uint64_t)burst * 1000000;
+            gen->credit = MIN(gen->credit + usec * gen->cfg.rate, max);
+            n = gen->credit / 1000000;
+            gen->credit -= (uint64_t)n * 1000000;
+        } else {
+            n = burst;
+        }
+        gen->last = now;
+        while (n--) {
+            if (!null_gen_emit(gen)) {
+                break;
+            }
+        }
+        mutex_unlock(&gen->mutex);
+    }
+}
+
+struct net_device *
+null_gen_init(const struct null_gen_config *cfg)
+{
+    static int registered = 0;
+    struct net_device *dev;
+    struct null_gen *gen;
+    struct timeval interval = {0, 0}; /* every tick of the interrupt timer */
+
+    if (!(cfg->pattern & (NULL_GEN_PATTERN_UDP | NULL_GEN_PATTERN_TCP | NULL_GEN_PATTERN_ICMP | NULL_GEN_PATTERN_ARP))) {
+        errorf("no pattern");
+        return NULL;
+    }
+    if (cfg->size > ETHER_PAYLOAD_SIZE_MAX - (sizeof(struct null_gen_ip_hdr) + sizeof(struct null_gen_tcp_hdr))) {
+        errorf("too long, size=%u", cfg->size);
+        return NULL;
+    }
+    gen = memory_alloc(sizeof(*gen));
+    if (!gen) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    gen->cfg = *cfg;
+    if (ip_addr_pton(cfg->local, &gen->local) == -1 || ip_addr_pton(cfg->peer, &gen->peer) == -1) {
+        errorf("invalid address, local=%s, peer=%s", cfg->local, cfg->peer);
+        memory_free(gen);
+        return NULL;
+    }
+    mutex_init(&gen->mutex);
+    gettimeofday(&gen->last, NULL);
+    dev = net_device_alloc(ether_setup_helper);
+    if (!dev) {
+        errorf("net_device_alloc() failure");
+        memory_free(gen);
+        return NULL;
+    }
+    memcpy(dev->addr, NULL_GEN_ADDR, ETHER_ADDR_LEN);
+    /* NOTE: the peer checks nothing and always sends valid checksums */
+    dev->hw_features = NET_DEVICE_FEATURE_TX_CSUM | NET_DEVICE_FEATURE_RX_CSUM | NET_DEVICE_FEATURE_IP_CSUM;
+    dev->ops = &null_gen_ops;
+    dev->priv = gen;
+    gen->dev = dev;
+    if (net_device_register(dev) == -1) {
+        errorf("net_device_register() failure");
+        memory_free(gen);
+        return NULL;
+    }
+    if (!registered) {
+        if (net_timer_register("Generator Timer", interval, null_gen_timer) == -1) {
+            errorf("net_timer_register() failure");
+            return NULL;
+        }
+        registered = 1;
+    }
+    gen->next = gens;
+    gens = gen;
+    debugf("initialized, dev=%s, pattern=0x%04x, rate=%u, local=%s, peer=%s, port=%u, size=%u",
+        dev->name, cfg->pattern, cfg->rate, cfg->local, cfg->peer, cfg->port, cfg->size);
+    return dev;
+}
+
+int
+null_gen_get_stats(struct net_device *dev, struct null_gen_stats *stats)
+{
+    struct null_gen *gen;
+
+    if (dev->ops != &null_gen_ops) {
+        errorf("not a generator, dev=%s", dev->name);
+        return -1;
+    }
+    gen = (struct null_gen *)dev->priv;
+    mutex_lock(&gen->mutex);
+    *stats = gen->stats;
+    mutex_unlock(&gen->mutex);
+    return 0;
+}
@@ -1,9 +1,48 @@
 #ifndef NULL_H
 #define NULL_H
 
+#include <stdint.h>
+
 #include "net.h"
 
+/* NOTE: patterns of the generator, mixed in round robin */
+#define NULL_GEN_PATTERN_UDP  0x0001 /* datagrams to the port */
+#define NULL_GEN_PATTERN_TCP  0x0002 /* a stream against the listening port, driven by the built-in peer */
+#define NULL_GEN_PATTERN_ICMP 0x0004 /* echo requests */
+#define NULL_GEN_PATTERN_ARP  0x0008 /* requests for the local address */
+
+#define NULL_GEN_BURST_DEFAULT 64 /* packets per timer tick */
+
+struct null_gen_config {
+    int pattern;
+    unsigned int rate; /* packets per second, 0 means a full burst every timer tick */
+    unsigned int burst; /* maximum packets per timer tick, 0 means NULL_GEN_BURST_DEFAULT */
+    const char *local; /* address of the stack */
+    const char *peer; /* address of the synthetic peer */
+    uint16_t port; /* destination port of UDP/TCP */
+    uint16_t size; /* payload size of UDP/TCP/ICMP */
+};
+
+struct null_gen_stats {
+    uint64_t rx_packets; /* synthesized and handed to the stack */
+    uint64_t rx_bytes;
+    uint64_t tx_packets; /* transmitted back by the stack */
+    uint64_t tx_bytes;
+    uint64_t tx_arp;
+    uint64_t tx_icmp;
+    uint64_t tx_udp;
+    uint64_t tx_tcp;
+    uint64_t tcp_connects;
+    uint64_t tcp_resets;
+    uint64_t tcp_acked; /* stream bytes acknowledged by the stack */
+};
+
 extern struct net_device *
 null_init(void);
 
+extern struct net_device *
+null_gen_init(const struct null_gen_config *cfg);
+extern int
+null_gen_get_stats(struct net_device *dev, struct null_gen_stats *stats);
+
 #endif
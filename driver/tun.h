@@ -0,0 +1,9 @@
+#ifndef TUN_H
+#define TUN_H
+
+#include "net.h"
+
+extern struct net_device *
+tun_init(const char *name);
+
+#endif
@@ -4,6 +4,8 @@
 #include <string.h>
 #include <sys/types.h>
 
+#include "platform.h"
+
 #include "util.h"
 #include "net.h"
 #include "ether.h"
@@ -17,6 +19,8 @@ struct ether_hdr {
 const uint8_t ETHER_ADDR_ANY[ETHER_ADDR_LEN] = {"\x00\x00\x00\x00\x00\x00"};
 const uint8_t ETHER_ADDR_BROADCAST[ETHER_ADDR_LEN] = {"\xff\xff\xff\xff\xff\xff"};
 
+static mutex_t mcast_mutex = MUTEX_INITIALIZER; /* serializes the updates of the multicast filters */
+
 int
 ether_addr_pton(const char *p, uint8_t *n)
 {
@@ -83,9 +87,9 @@ ether_dump(const uint8_t *frame, size_t flen)
 }
 
 int
-ether_transmit_helper(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst, ssize_t (*callback)(struct net_device *dev, const uint8_t *data, size_t len))
+ether_transmit_helper(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst, int flags, ssize_t (*callback)(struct net_device *dev, const uint8_t *data, size_t len, int flags))
 {
-    uint8_t frame[ETHER_FRAME_SIZE_MAX] = {};
+    uint8_t frame[ETHER_HDR_SIZE + NET_DEVICE_GSO_SIZE_MAX]; /* large enough for TCP super-segment */
     struct ether_hdr *hdr;
     size_t flen, pad = 0;
 
@@ -96,37 +100,168 @@ ether_transmit_helper(struct net_device *dev, uint16_t type, const uint8_t *data
     memcpy(hdr + 1, data, len);
     if (len < ETHER_PAYLOAD_SIZE_MIN) {
         pad = ETHER_PAYLOAD_SIZE_MIN - len;
+        memset((uint8_t *)(hdr + 1) + len, 0, pad);
     }
     flen = sizeof(*hdr) + len + pad;
     debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, ether_type_ntoa(hdr->type), type, flen);
     ether_dump(frame, flen);
-    return callback(dev, frame, flen) == (ssize_t)flen ? 0 : -1;
+    return callback(dev, frame, flen, flags) == (ssize_t)flen ? 0 : -1;
 }
 
+/* NOTE: the frame is passed to the callback as [header, payload fragments..., padding] without copying */
 int
-ether_poll_helper(struct net_device *dev, ssize_t (*callback)(struct net_device *dev, uint8_t *buf, size_t size))
+ether_transmit_helper_iov(struct net_device *dev, uint16_t type, const struct iovec *iov, int iovcnt, const void *dst, int flags, ssize_t (*callback)(struct net_device *dev, const struct iovec *iov, int iovcnt, int flags))
+{
+    static const uint8_t pad[ETHER_PAYLOAD_SIZE_MIN];
+    struct ether_hdr hdr;
+    struct iovec vec[NET_IOV_MAX + 2];
+    size_t len, flen;
+    int i, n = 0;
+
+    if (iovcnt > NET_IOV_MAX) {
+        errorf("too many fragments, dev=%s, iovcnt=%d", dev->name, iovcnt);
+        return -1;
+    }
+    memcpy(hdr.dst, dst, ETHER_ADDR_LEN);
+    memcpy(hdr.src, dev->addr, ETHER_ADDR_LEN);
+    hdr.type = hton16(type);
+    vec[n].iov_base = &hdr;
+    vec[n].iov_len = sizeof(hdr);
+    n++;
+    for (i = 0; i < iovcnt; i++) {
+        vec[n++] = iov[i];
+    }
+    len = iovec_len(iov, iovcnt);
+    if (len < ETHER_PAYLOAD_SIZE_MIN) {
+        vec[n].iov_base = (void *)pad;
+        vec[n].iov_len = ETHER_PAYLOAD_SIZE_MIN - len;
+        len = ETHER_PAYLOAD_SIZE_MIN;
+        n++;
+    }
+    flen = sizeof(hdr) + len;
+    debugf("dev=%s, type=%s(0x%04x), len=%zu, iovcnt=%d", dev->name, ether_type_ntoa(hdr.type), type, flen, n);
+    ether_dump((uint8_t *)&hdr, sizeof(hdr));
+    return callback(dev, vec, n, flags) == (ssize_t)flen ? 0 : -1;
+}
+
+/*
+ * Multicast Filter
+ *
+ * NOTE: the group addresses are hashed into a 64-bit filter by the upper 6 bits of their
+ *       CRC-32, as the hash tables of the NICs do. A foreign group may pass the filter in
+ *       the same bucket, the upper layer checks the membership exactly. The filter is read
+ *       by the input without the mutex.
+ */
+
+static unsigned int
+ether_mcast_hash(const uint8_t *addr)
+{
+    uint32_t crc = 0xffffffff;
+    int i, j;
+
+    for (i = 0; i < ETHER_ADDR_LEN; i++) {
+        crc ^= addr[i];
+        for (j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? 0xedb88320 : 0);
+        }
+    }
+    return ~crc >> 26;
+}
+
+static int
+ether_mcast_match(struct net_device *dev, const uint8_t *addr)
+{
+    return (__atomic_load_n(&dev->mcast_filter, __ATOMIC_ACQUIRE) >> ether_mcast_hash(addr)) & 1;
+}
+
+static int
+ether_mcast_update(struct net_device *dev, const uint8_t *addr, int add)
+{
+    unsigned int hash;
+    int changed = 0;
+    char str[ETHER_ADDR_STR_LEN];
+
+    if (dev->type != NET_DEVICE_TYPE_ETHERNET || !(addr[0] & 0x01)) {
+        errorf("not a multicast address, dev=%s, addr=%s", dev->name, ether_addr_ntop(addr, str, sizeof(str)));
+        return -1;
+    }
+    hash = ether_mcast_hash(addr);
+    mutex_lock(&mcast_mutex);
+    if (add) {
+        if (dev->mcast_refs[hash]++ == 0) {
+            __atomic_or_fetch(&dev->mcast_filter, (uint64_t)1 << hash, __ATOMIC_RELEASE);
+            changed = 1;
+        }
+    } else {
+        if (!dev->mcast_refs[hash]) {
+            mutex_unlock(&mcast_mutex);
+            errorf("not found, dev=%s, addr=%s", dev->name, ether_addr_ntop(addr, str, sizeof(str)));
+            return -1;
+        }
+        if (--dev->mcast_refs[hash] == 0) {
+            __atomic_and_fetch(&dev->mcast_filter, ~((uint64_t)1 << hash), __ATOMIC_RELEASE);
+            changed = 1;
+        }
+    }
+    mutex_unlock(&mcast_mutex);
+    debugf("dev=%s, addr=%s, hash=%u, %s", dev->name, ether_addr_ntop(addr, str, sizeof(str)), hash, add ? "added" : "deleted");
+    if (changed && NET_DEVICE_IS_UP(dev) && dev->ops->set_filter) {
+        if (dev->ops->set_filter(dev) == -1) {
+            warnf("set_filter() failure, dev=%s", dev->name);
+        }
+    }
+    return 0;
+}
+
+/* NOTE: counted, an address added N times passes the filter until it is deleted N times */
+int
+ether_mcast_add(struct net_device *dev, const uint8_t *addr)
+{
+    return ether_mcast_update(dev, addr, 1);
+}
+
+int
+ether_mcast_del(struct net_device *dev, const uint8_t *addr)
+{
+    return ether_mcast_update(dev, addr, 0);
+}
+
+int
+ether_input_helper(struct net_device *dev, const uint8_t *frame, size_t flen, int flags)
 {
-    uint8_t frame[ETHER_FRAME_SIZE_MAX];
-    ssize_t flen;
     struct ether_hdr *hdr;
     uint16_t type;
 
-    flen = callback(dev, frame, sizeof(frame));
-    if (flen < (ssize_t)sizeof(*hdr)) {
+    if (flen < sizeof(*hdr)) {
         errorf("input data is too short");
         return -1;
     }
     hdr = (struct ether_hdr *)frame;
     if (memcmp(dev->addr, hdr->dst, ETHER_ADDR_LEN) != 0) {
         if (memcmp(ETHER_ADDR_BROADCAST, hdr->dst, ETHER_ADDR_LEN) != 0) {
-            /* for other host */
-            return -1;
+            if (!(hdr->dst[0] & 0x01) || !ether_mcast_match(dev, hdr->dst)) {
+                /* for other host, or a group we have not joined */
+                return -1;
+            }
         }
     }
     type = ntoh16(hdr->type);
     debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, ether_type_ntoa(hdr->type), type, flen);
     ether_dump(frame, flen);
-    return net_input_handler(type, (uint8_t *)(hdr + 1), flen - sizeof(*hdr), dev);
+    return net_input_handler(type, (uint8_t *)(hdr + 1), flen - sizeof(*hdr), dev, flags);
+}
+
+int
+ether_poll_helper(struct net_device *dev, ssize_t (*callback)(struct net_device *dev, uint8_t *buf, size_t size))
+{
+    uint8_t frame[ETHER_FRAME_SIZE_JUMBO];
+    ssize_t flen;
+
+    flen = callback(dev, frame, sizeof(frame));
+    if (flen < 0) {
+        return -1;
+    }
+    return ether_input_helper(dev, frame, flen, 0);
 }
 
 void
@@ -5,6 +5,7 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include "net.h"
 
@@ -16,6 +17,8 @@
 #define ETHER_FRAME_SIZE_MAX 1514 /* without FCS */
 #define ETHER_PAYLOAD_SIZE_MIN (ETHER_FRAME_SIZE_MIN - ETHER_HDR_SIZE)
 #define ETHER_PAYLOAD_SIZE_MAX (ETHER_FRAME_SIZE_MAX - ETHER_HDR_SIZE)
+#define ETHER_PAYLOAD_SIZE_JUMBO 9000
+#define ETHER_FRAME_SIZE_JUMBO (ETHER_HDR_SIZE + ETHER_PAYLOAD_SIZE_JUMBO) /* without FCS */
 
 /* see https://www.iana.org/assignments/ieee-802-numbers/ieee-802-numbers.txt */
 #define ETHER_TYPE_IP   0x0800
@@ -31,7 +34,16 @@ extern char *
 ether_addr_ntop(const uint8_t *n, char *p, size_t size);
 
 extern int
-ether_transmit_helper(struct net_device *dev, uint16_t type, const uint8_t *payload, size_t plen, const void *dst, ssize_t (*callback)(struct net_device *dev, const uint8_t *buf, size_t len));
+ether_mcast_add(struct net_device *dev, const uint8_t *addr);
+extern int
+ether_mcast_del(struct net_device *dev, const uint8_t *addr);
+
+extern int
+ether_transmit_helper(struct net_device *dev, uint16_t type, const uint8_t *payload, size_t plen, const void *dst, int flags, ssize_t (*callback)(struct net_device *dev, const uint8_t *buf, size_t len, int flags));
+extern int
+ether_transmit_helper_iov(struct net_device *dev, uint16_t type, const struct iovec *iov, int iovcnt, const void *dst, int flags, ssize_t (*callback)(struct net_device *dev, const struct iovec *iov, int iovcnt, int flags));
+extern int
+ether_input_helper(struct net_device *dev, const uint8_t *frame, size_t flen, int flags);
 extern int
 ether_poll_helper(struct net_device *dev, ssize_t (*callback)(struct net_device *dev, uint8_t *buf, size_t size));
 extern void
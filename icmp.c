@@ -1,6 +1,9 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/time.h>
+
+#include "platform.h"
 
 #include "util.h"
 #include "ip.h"
@@ -8,6 +11,9 @@
 
 #define ICMP_BUFSIZ IP_PAYLOAD_SIZE_MAX
 
+#define ICMP_ERROR_RATE  1000 /* error messages per second */
+#define ICMP_ERROR_BURST 50
+
 struct icmp_hdr {
     uint8_t type;
     uint8_t code;
@@ -80,8 +86,36 @@ icmp_dump(const uint8_t *data, size_t len)
     funlockfile(stderr);
 }
 
+/* NOTE: rfc1191, the quoted header tells the destination, the message tells the MTU of the next hop */
+static void
+icmp_fragment_needed(const struct icmp_hdr *hdr, size_t len)
+{
+    const uint8_t *quote;
+    ip_addr_t src, dst;
+    uint16_t total, mtu;
+
+    if (len < sizeof(*hdr) + IP_HDR_SIZE_MIN) {
+        return;
+    }
+    quote = (const uint8_t *)(hdr + 1);
+    memcpy(&src, quote + 12, sizeof(src));
+    memcpy(&dst, quote + 16, sizeof(dst));
+    if (!ip_iface_select(src)) {
+        /* not sent by us */
+        return;
+    }
+    memcpy(&total, quote + 2, sizeof(total));
+    total = ntoh16(total);
+    mtu = ntoh32(hdr->values) & 0xffff;
+    if (!mtu || mtu >= total) {
+        /* NOTE: an old router which does not report it, guess from the size of the original */
+        mtu = ip_pmtu_plateau(total);
+    }
+    ip_pmtu_update(dst, mtu);
+}
+
 static void
-icmp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
+icmp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface, int flags)
 {
     struct icmp_hdr *hdr;
     char addr1[IP_ADDR_STR_LEN];
@@ -93,7 +127,7 @@ icmp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
         return;
     }
     hdr = (struct icmp_hdr *)data;
-    if (cksum16((uint16_t *)data, len, 0) != 0) {
+    if (!(flags & NET_PACKET_FLAG_CSUM_VALID) && cksum16((uint16_t *)data, len, 0) != 0) {
         errorf("checksum error, sum=0x%04x, verify=0x%04x", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)data, len, -hdr->sum)));
         return;
     }
@@ -112,6 +146,11 @@ icmp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
         }
         icmp_output(ICMP_TYPE_ECHOREPLY, hdr->code, hdr->values, (uint8_t *)(hdr + 1), len - sizeof(*hdr), dst, src);
         break;
+    case ICMP_TYPE_DEST_UNREACH:
+        if (hdr->code == ICMP_CODE_FRAGMENT_NEEDED) {
+            icmp_fragment_needed(hdr, len);
+        }
+        break;
     default:
         /* ignore */
         break;
@@ -140,7 +179,97 @@ icmp_output(uint8_t type, uint8_t code, uint32_t values, const uint8_t *data, si
         ip_addr_ntop(dst, addr2, sizeof(addr2)),
         icmp_type_ntoa(hdr->type), hdr->type, msg_len);
     icmp_dump((uint8_t *)hdr, msg_len);
-    return ip_output(IP_PROTOCOL_ICMP, (uint8_t *)hdr, msg_len, src, dst);
+    return ip_output(IP_PROTOCOL_ICMP, (uint8_t *)hdr, msg_len, src, dst, 0);
+}
+
+static int
+icmp_is_error(uint8_t type)
+{
+    switch (type) {
+    case ICMP_TYPE_DEST_UNREACH:
+    case ICMP_TYPE_SOURCE_QUENCH:
+    case ICMP_TYPE_REDIRECT:
+    case ICMP_TYPE_TIME_EXCEEDED:
+    case ICMP_TYPE_PARAM_PROBLEM:
+        return 1;
+    }
+    return 0;
+}
+
+/* NOTE: token bucket, refilled by the elapsed time */
+static int
+icmp_error_allowed(void)
+{
+    static mutex_t mutex = MUTEX_INITIALIZER;
+    static struct timeval last;
+    static long tokens = ICMP_ERROR_BURST;
+    struct timeval now, diff;
+    long usec;
+    int ret = 0;
+
+    gettimeofday(&now, NULL);
+    mutex_lock(&mutex);
+    timersub(&now, &last, &diff);
+    usec = diff.tv_sec * 1000000 + diff.tv_usec;
+    if (usec >= 1000000 / ICMP_ERROR_RATE) {
+        tokens += usec / (1000000 / ICMP_ERROR_RATE);
+        if (tokens > ICMP_ERROR_BURST) {
+            tokens = ICMP_ERROR_BURST;
+        }
+        last = now;
+    }
+    if (tokens > 0) {
+        tokens--;
+        ret = 1;
+    }
+    mutex_unlock(&mutex);
+    return ret;
+}
+
+/*
+ * NOTE: reports the offending datagram back to its source, quoting the IP header and
+ *       the first 8 bytes of the payload (rfc792). Nothing is sent about an ICMP error,
+ *       a non-first fragment, or a datagram whose source is not a unique host (rfc1812).
+ */
+int
+icmp_error(uint8_t type, uint8_t code, uint32_t values, const uint8_t *data, size_t len)
+{
+    uint16_t hlen, offset;
+    ip_addr_t src, dst;
+    const uint8_t *payload;
+
+    if (len < IP_HDR_SIZE_MIN) {
+        return -1;
+    }
+    hlen = (data[0] & 0x0f) << 2;
+    if (len < hlen) {
+        return -1;
+    }
+    memcpy(&offset, data + 6, sizeof(offset));
+    if (ntoh16(offset) & 0x1fff) {
+        return 0;
+    }
+    memcpy(&src, data + 12, sizeof(src));
+    memcpy(&dst, data + 16, sizeof(dst));
+    if (src == IP_ADDR_ANY || src == IP_ADDR_BROADCAST || (ntoh32(src) & 0xf0000000) == 0xe0000000 ||
+        (ntoh32(src) & 0xff000000) == 0x7f000000) {
+        return 0;
+    }
+    if (dst == IP_ADDR_BROADCAST || (ntoh32(dst) & 0xf0000000) == 0xe0000000) {
+        return 0;
+    }
+    payload = data + hlen;
+    if (data[9] == IP_PROTOCOL_ICMP && len > hlen && icmp_is_error(payload[0])) {
+        return 0;
+    }
+    if (!icmp_error_allowed()) {
+        return 0;
+    }
+    if (len > (size_t)hlen + 8) {
+        len = hlen + 8;
+    }
+    /* NOTE: the source address is picked by the route back to the sender */
+    return icmp_output(type, code, values, data, len, IP_ADDR_ANY, src);
 }
 
 int
@@ -0,0 +1,625 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "ether.h"
+#include "arp.h"
+#include "ip.h"
+#include "igmp.h"
+
+#define IGMP_TYPE_QUERY     0x11
+#define IGMP_TYPE_V1_REPORT 0x12
+#define IGMP_TYPE_V2_REPORT 0x16
+#define IGMP_TYPE_V2_LEAVE  0x17
+#define IGMP_TYPE_V3_REPORT 0x22
+
+/* types of the group record, see rfc3376 4.2.12 */
+#define IGMP_RECORD_MODE_IS_EXCLUDE   2
+#define IGMP_RECORD_CHANGE_TO_INCLUDE 3
+#define IGMP_RECORD_CHANGE_TO_EXCLUDE 4
+
+#define IGMP_GROUP_TABLE_SIZE 64 /* must be a power of 2 */
+
+/* default values of rfc3376 8 */
+#define IGMP_ROBUSTNESS 2
+#define IGMP_QUERY_INTERVAL 125 /* seconds */
+#define IGMP_QUERY_RESPONSE_INTERVAL 100 /* 1/10 seconds, also for IGMPv1 queries which do not carry it */
+#define IGMP_UNSOLICITED_INTERVAL_V2 10000 /* msec, rfc2236 */
+#define IGMP_UNSOLICITED_INTERVAL_V3 1000 /* msec */
+#define IGMP_OLDER_QUERIER_TIMEOUT (IGMP_ROBUSTNESS * IGMP_QUERY_INTERVAL + IGMP_QUERY_RESPONSE_INTERVAL / 10) /* seconds */
+
+#define IGMP_V3_RECORDS_MAX 64 /* per report, fits in the minimum MTU */
+
+struct igmp_hdr {
+    uint8_t type;
+    uint8_t code; /* max resp time (v2) or code (v3) */
+    uint16_t sum;
+    ip_addr_t group;
+};
+
+struct igmp_v3_query {
+    struct igmp_hdr hdr;
+    uint8_t flags; /* resv, S, QRV */
+    uint8_t qqic;
+    uint16_t nsrcs;
+    /* sources follow */
+};
+
+struct igmp_v3_report {
+    uint8_t type;
+    uint8_t reserved1;
+    uint16_t sum;
+    uint16_t reserved2;
+    uint16_t nrecs;
+};
+
+struct igmp_v3_record {
+    uint8_t type;
+    uint8_t auxlen;
+    uint16_t nsrcs;
+    ip_addr_t group;
+};
+
+/* NOTE: rfc3376 7.2.1, the host falls back to the oldest version of the queriers heard on the link */
+struct igmp_iface {
+    struct igmp_iface *next;
+    struct ip_iface *iface;
+    struct timeval v1_until; /* IGMPv1 Querier Present */
+    struct timeval v2_until; /* IGMPv2 Querier Present */
+    struct timeval general; /* IGMPv3 report of all the groups is due, zero means none */
+};
+
+struct igmp_group {
+    struct igmp_group *next;
+    struct ip_iface *iface;
+    ip_addr_t group;
+    unsigned int refs; /* joins, zero while the leave is retransmitted */
+    int changes; /* state-change reports left to retransmit */
+    int last_reporter; /* IGMPv2: the last report was ours, a leave is sent */
+    struct timeval timer; /* when the next report is due, zero means none */
+};
+
+/* NOTE: rfc2236/rfc3376, every message is sent with the Router Alert option */
+static const uint8_t igmp_router_alert[] = {IP_OPTION_ROUTER_ALERT, 4, 0x00, 0x00};
+
+static mutex_t mutex = MUTEX_INITIALIZER;
+static struct igmp_iface *ifaces;
+static struct igmp_group *groups[IGMP_GROUP_TABLE_SIZE];
+
+static char *
+igmp_type_ntoa(uint8_t type)
+{
+    switch (type) {
+    case IGMP_TYPE_QUERY:
+        return "Query";
+    case IGMP_TYPE_V1_REPORT:
+        return "V1Report";
+    case IGMP_TYPE_V2_REPORT:
+        return "V2Report";
+    case IGMP_TYPE_V2_LEAVE:
+        return "V2Leave";
+    case IGMP_TYPE_V3_REPORT:
+        return "V3Report";
+    }
+    return "Unknown";
+}
+
+static void
+igmp_dump(const uint8_t *data, size_t len)
+{
+    struct igmp_hdr *hdr;
+    struct igmp_v3_report *report;
+    char addr[IP_ADDR_STR_LEN];
+
+    flockfile(stderr);
+    hdr = (struct igmp_hdr *)data;
+    fprintf(stderr, "       type: 0x%02x (%s)\n", hdr->type, igmp_type_ntoa(hdr->type));
+    fprintf(stderr, "       code: %u\n", hdr->code);
+    fprintf(stderr, "        sum: 0x%04x (0x%04x)\n", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)data, len, -hdr->sum)));
+    if (hdr->type == IGMP_TYPE_V3_REPORT) {
+        report = (struct igmp_v3_report *)data;
+        fprintf(stderr, "       nrecs: %u\n", ntoh16(report->nrecs));
+    } else {
+        fprintf(stderr, "      group: %s\n", ip_addr_ntop(hdr->group, addr, sizeof(addr)));
+    }
+#ifdef HEXDUMP
+    hexdump(stderr, data, len);
+#endif
+    funlockfile(stderr);
+}
+
+/*
+ * IGMP Group Table
+ *
+ * NOTE: IGMP group table functions must be called after mutex locked
+ */
+
+static struct igmp_group **
+igmp_group_bucket(ip_addr_t group)
+{
+    return &groups[ntoh32(group) & (IGMP_GROUP_TABLE_SIZE - 1)];
+}
+
+static struct igmp_group *
+igmp_group_lookup(struct ip_iface *iface, ip_addr_t group)
+{
+    struct igmp_group *entry;
+
+    for (entry = *igmp_group_bucket(group); entry; entry = entry->next) {
+        if (entry->iface == iface && entry->group == group) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static struct igmp_iface *
+igmp_iface_get(struct ip_iface *iface)
+{
+    struct igmp_iface *entry;
+
+    for (entry = ifaces; entry; entry = entry->next) {
+        if (entry->iface == iface) {
+            return entry;
+        }
+    }
+    entry = memory_alloc(sizeof(*entry));
+    if (!entry) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    entry->iface = iface;
+    entry->next = ifaces;
+    ifaces = entry;
+    return entry;
+}
+
+static int
+igmp_version(struct igmp_iface *entry, struct timeval *now)
+{
+    if (timercmp(now, &entry->v1_until, <)) {
+        return 1;
+    }
+    if (timercmp(now, &entry->v2_until, <)) {
+        return 2;
+    }
+    return 3;
+}
+
+/* NOTE: keeps the timer if it is already due earlier, rfc3376 5.2 */
+static void
+igmp_schedule(struct timeval *timer, struct timeval *now, unsigned int msec)
+{
+    struct timeval due;
+    long usec;
+
+    due = *now;
+    usec = msec ? (long)(random() % msec) * 1000 : 0;
+    timeval_add_usec(&due, usec);
+    if (timerisset(timer) && timercmp(timer, &due, <)) {
+        return;
+    }
+    *timer = due;
+}
+
+/* NOTE: the group addresses of the device which passes them to ether_input_helper() */
+static void
+igmp_filter(struct ip_iface *iface, ip_addr_t group, int add)
+{
+    struct net_device *dev;
+    uint8_t ha[ETHER_ADDR_LEN];
+
+    dev = NET_IFACE(iface)->dev;
+    if (dev->type != NET_DEVICE_TYPE_ETHERNET) {
+        /* no link address to filter */
+        return;
+    }
+    arp_resolve_mcast(group, ha);
+    if (add) {
+        ether_mcast_add(dev, ha);
+    } else {
+        ether_mcast_del(dev, ha);
+    }
+}
+
+static int
+igmp_output(struct ip_iface *iface, ip_addr_t dst, uint8_t *data, size_t len)
+{
+    struct igmp_hdr *hdr;
+    char addr1[IP_ADDR_STR_LEN];
+    char addr2[IP_ADDR_STR_LEN];
+
+    hdr = (struct igmp_hdr *)data;
+    hdr->sum = 0;
+    hdr->sum = cksum16((uint16_t *)data, len, 0);
+    debugf("%s => %s, len=%zu",
+        ip_addr_ntop(iface->unicast, addr1, sizeof(addr1)), ip_addr_ntop(dst, addr2, sizeof(addr2)), len);
+    igmp_dump(data, len);
+    if (ip_output_iface(iface, IP_PROTOCOL_IGMP, IP_TOS_INTERNETWORK_CONTROL, igmp_router_alert, sizeof(igmp_router_alert), data, len, dst, 0) == -1) {
+        errorf("ip_output_iface() failure");
+        return -1;
+    }
+    return 0;
+}
+
+static int
+igmp_output_v3(struct ip_iface *iface, struct igmp_v3_record *records, int num)
+{
+    uint8_t buf[sizeof(struct igmp_v3_report) + sizeof(struct igmp_v3_record) * IGMP_V3_RECORDS_MAX];
+    struct igmp_v3_report *report;
+
+    report = (struct igmp_v3_report *)buf;
+    report->type = IGMP_TYPE_V3_REPORT;
+    report->reserved1 = 0;
+    report->reserved2 = 0;
+    report->nrecs = hton16(num);
+    memcpy(report + 1, records, sizeof(*records) * num);
+    return igmp_output(iface, IGMP_ADDR_V3_ROUTERS, buf, sizeof(*report) + sizeof(*records) * num);
+}
+
+/* NOTE: any-source membership only, every group is in EXCLUDE mode with no sources */
+static int
+igmp_report(struct igmp_iface *entry, struct igmp_group *group, struct timeval *now)
+{
+    struct igmp_hdr hdr;
+    struct igmp_v3_record record;
+    int version;
+
+    version = igmp_version(entry, now);
+    if (version < 3) {
+        if (!group->refs) {
+            /* fell back while the IGMPv3 leave was retransmitted */
+            return 0;
+        }
+        hdr.type = version == 1 ? IGMP_TYPE_V1_REPORT : IGMP_TYPE_V2_REPORT;
+        hdr.code = 0;
+        hdr.group = group->group;
+        group->last_reporter = 1;
+        return igmp_output(group->iface, group->group, (uint8_t *)&hdr, sizeof(hdr));
+    }
+    if (!group->refs) {
+        record.type = IGMP_RECORD_CHANGE_TO_INCLUDE;
+    } else if (group->changes) {
+        record.type = IGMP_RECORD_CHANGE_TO_EXCLUDE;
+    } else {
+        record.type = IGMP_RECORD_MODE_IS_EXCLUDE;
+    }
+    record.auxlen = 0;
+    record.nsrcs = 0;
+    record.group = group->group;
+    return igmp_output_v3(group->iface, &record, 1);
+}
+
+/* NOTE: rfc3376 5.2, a single report answers a general query with the records of all the groups */
+static void
+igmp_report_all(struct igmp_iface *entry)
+{
+    struct igmp_v3_record records[IGMP_V3_RECORDS_MAX];
+    struct igmp_group *group;
+    int i, num = 0;
+
+    for (i = 0; i < IGMP_GROUP_TABLE_SIZE; i++) {
+        for (group = groups[i]; group; group = group->next) {
+            if (group->iface != entry->iface || !group->refs || group->group == IGMP_ADDR_ALL_HOSTS) {
+                continue;
+            }
+            records[num].type = IGMP_RECORD_MODE_IS_EXCLUDE;
+            records[num].auxlen = 0;
+            records[num].nsrcs = 0;
+            records[num].group = group->group;
+            if (++num == IGMP_V3_RECORDS_MAX) {
+                igmp_output_v3(entry->iface, records, num);
+                num = 0;
+            }
+        }
+    }
+    if (num) {
+        igmp_output_v3(entry->iface, records, num);
+    }
+}
+
+/* NOTE: rfc3376 4.1.1, the code of 128 or more is a floating point value */
+static unsigned int
+igmp_max_resp(uint8_t code)
+{
+    if (code < 128) {
+        return code;
+    }
+    return ((code & 0x0f) | 0x10) << (((code >> 4) & 0x07) + 3);
+}
+
+static void
+igmp_query(struct igmp_iface *entry, const struct igmp_hdr *hdr, size_t len, struct timeval *now)
+{
+    struct timeval *until = NULL;
+    unsigned int max;
+    struct igmp_group *group;
+    int i;
+
+    if (len == sizeof(struct igmp_hdr)) {
+        if (!hdr->code) {
+            until = &entry->v1_until;
+            max = IGMP_QUERY_RESPONSE_INTERVAL;
+        } else {
+            until = &entry->v2_until;
+            max = hdr->code;
+        }
+        *until = *now;
+        until->tv_sec += IGMP_OLDER_QUERIER_TIMEOUT;
+    } else if (len >= sizeof(struct igmp_v3_query)) {
+        max = igmp_max_resp(hdr->code);
+    } else {
+        errorf("too short, len=%zu", len);
+        return;
+    }
+    max *= 100; /* msec */
+    if (hdr->group == IP_ADDR_ANY) {
+        if (igmp_version(entry, now) == 3) {
+            igmp_schedule(&entry->general, now, max);
+            return;
+        }
+        for (i = 0; i < IGMP_GROUP_TABLE_SIZE; i++) {
+            for (group = groups[i]; group; group = group->next) {
+                if (group->iface == entry->iface && group->refs && group->group != IGMP_ADDR_ALL_HOSTS) {
+                    igmp_schedule(&group->timer, now, max);
+                }
+            }
+        }
+        return;
+    }
+    /* NOTE: group-and-source specific queries are answered as group specific, we have no source filters */
+    group = igmp_group_lookup(entry->iface, hdr->group);
+    if (group && group->refs && group->group != IGMP_ADDR_ALL_HOSTS) {
+        igmp_schedule(&group->timer, now, max);
+    }
+}
+
+static void
+igmp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface, int flags)
+{
+    struct igmp_hdr *hdr;
+    char addr1[IP_ADDR_STR_LEN];
+    char addr2[IP_ADDR_STR_LEN];
+    struct igmp_iface *entry;
+    struct igmp_group *group;
+    struct timeval now;
+
+    if (len < sizeof(*hdr)) {
+        errorf("too short");
+        return;
+    }
+    hdr = (struct igmp_hdr *)data;
+    if (cksum16((uint16_t *)data, len, 0) != 0) {
+        errorf("checksum error: sum=0x%04x, verify=0x%04x", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)data, len, -hdr->sum)));
+        return;
+    }
+    debugf("%s => %s, len=%zu",
+        ip_addr_ntop(src, addr1, sizeof(addr1)), ip_addr_ntop(dst, addr2, sizeof(addr2)), len);
+    igmp_dump(data, len);
+    gettimeofday(&now, NULL);
+    mutex_lock(&mutex);
+    entry = igmp_iface_get(iface);
+    if (!entry) {
+        mutex_unlock(&mutex);
+        return;
+    }
+    switch (hdr->type) {
+    case IGMP_TYPE_QUERY:
+        igmp_query(entry, hdr, len, &now);
+        break;
+    case IGMP_TYPE_V1_REPORT:
+    case IGMP_TYPE_V2_REPORT:
+        /* NOTE: rfc2236 3, another member has answered, suppress ours (IGMPv3 does not) */
+        group = igmp_group_lookup(iface, hdr->group);
+        if (group && group->refs && !group->changes && igmp_version(entry, &now) < 3) {
+            timerclear(&group->timer);
+            group->last_reporter = 0;
+        }
+        break;
+    default:
+        /* reports of IGMPv3 and leaves are for the routers */
+        break;
+    }
+    mutex_unlock(&mutex);
+}
+
+static void
+igmp_timer(void)
+{
+    struct timeval now;
+    struct igmp_iface *entry;
+    struct igmp_group **prev, *group;
+    int i;
+
+    gettimeofday(&now, NULL);
+    mutex_lock(&mutex);
+    for (entry = ifaces; entry; entry = entry->next) {
+        if (timerisset(&entry->general) && !timercmp(&now, &entry->general, <)) {
+            timerclear(&entry->general);
+            if (igmp_version(entry, &now) == 3) {
+                igmp_report_all(entry);
+            }
+        }
+    }
+    for (i = 0; i < IGMP_GROUP_TABLE_SIZE; i++) {
+        prev = &groups[i];
+        while ((group = *prev) != NULL) {
+            if (timerisset(&group->timer) && !timercmp(&now, &group->timer, <)) {
+                timerclear(&group->timer);
+                entry = igmp_iface_get(group->iface);
+                if (entry) {
+                    igmp_report(entry, group, &now);
+                    if (group->changes && --group->changes) {
+                        igmp_schedule(&group->timer, &now, igmp_version(entry, &now) == 3 ? IGMP_UNSOLICITED_INTERVAL_V3 : IGMP_UNSOLICITED_INTERVAL_V2);
+                    }
+                }
+            }
+            if (!group->refs && !timerisset(&group->timer)) {
+                /* the leave has been retransmitted */
+                *prev = group->next;
+                memory_free(group);
+                continue;
+            }
+            prev = &group->next;
+        }
+    }
+    mutex_unlock(&mutex);
+}
+
+int
+igmp_member(struct ip_iface *iface, ip_addr_t group)
+{
+    struct igmp_group *entry;
+    int ret;
+
+    mutex_lock(&mutex);
+    entry = igmp_group_lookup(iface, group);
+    ret = entry && entry->refs;
+    mutex_unlock(&mutex);
+    return ret;
+}
+
+int
+igmp_join(struct ip_iface *iface, ip_addr_t group)
+{
+    struct igmp_iface *entry;
+    struct igmp_group *g, **bucket;
+    struct timeval now;
+    char addr1[IP_ADDR_STR_LEN];
+    char addr2[IP_ADDR_STR_LEN];
+
+    if (!IP_ADDR_IS_MULTICAST(group)) {
+        errorf("not a multicast address, group=%s", ip_addr_ntop(group, addr1, sizeof(addr1)));
+        return -1;
+    }
+    mutex_lock(&mutex);
+    entry = igmp_iface_get(iface);
+    if (!entry) {
+        mutex_unlock(&mutex);
+        return -1;
+    }
+    g = igmp_group_lookup(iface, group);
+    if (g && g->refs) {
+        g->refs++;
+        mutex_unlock(&mutex);
+        return 0;
+    }
+    if (!g) {
+        g = memory_alloc(sizeof(*g));
+        if (!g) {
+            mutex_unlock(&mutex);
+            errorf("memory_alloc() failure");
+            return -1;
+        }
+        g->iface = iface;
+        g->group = group;
+        bucket = igmp_group_bucket(group);
+        g->next = *bucket;
+        *bucket = g;
+    }
+    g->refs = 1;
+    igmp_filter(iface, group, 1);
+    infof("joined, iface=%s, group=%s",
+        ip_addr_ntop(iface->unicast, addr1, sizeof(addr1)), ip_addr_ntop(group, addr2, sizeof(addr2)));
+    if (group == IGMP_ADDR_ALL_HOSTS) {
+        /* rfc2236 6, never reported */
+        mutex_unlock(&mutex);
+        return 0;
+    }
+    /* NOTE: rfc3376 5.1, the unsolicited report goes out now and is repeated in case it is lost */
+    gettimeofday(&now, NULL);
+    timerclear(&g->timer);
+    g->changes = IGMP_ROBUSTNESS;
+    igmp_report(entry, g, &now);
+    if (--g->changes) {
+        igmp_schedule(&g->timer, &now, igmp_version(entry, &now) == 3 ? IGMP_UNSOLICITED_INTERVAL_V3 : IGMP_UNSOLICITED_INTERVAL_V2);
+    }
+    mutex_unlock(&mutex);
+    return 0;
+}
+
+int
+igmp_leave(struct ip_iface *iface, ip_addr_t group)
+{
+    struct igmp_iface *entry;
+    struct igmp_group *g, **prev;
+    struct igmp_hdr hdr;
+    struct timeval now;
+    char addr1[IP_ADDR_STR_LEN];
+    char addr2[IP_ADDR_STR_LEN];
+
+    mutex_lock(&mutex);
+    g = igmp_group_lookup(iface, group);
+    if (!g || !g->refs) {
+        mutex_unlock(&mutex);
+        errorf("not joined, group=%s", ip_addr_ntop(group, addr1, sizeof(addr1)));
+        return -1;
+    }
+    if (--g->refs) {
+        mutex_unlock(&mutex);
+        return 0;
+    }
+    igmp_filter(iface, group, 0);
+    infof("left, iface=%s, group=%s",
+        ip_addr_ntop(iface->unicast, addr1, sizeof(addr1)), ip_addr_ntop(group, addr2, sizeof(addr2)));
+    entry = igmp_iface_get(iface);
+    gettimeofday(&now, NULL);
+    timerclear(&g->timer);
+    g->changes = 0;
+    if (entry && group != IGMP_ADDR_ALL_HOSTS) {
+        switch (igmp_version(entry, &now)) {
+        case 1:
+            /* IGMPv1 has no leave, the membership just times out on the router */
+            break;
+        case 2:
+            if (g->last_reporter) {
+                hdr.type = IGMP_TYPE_V2_LEAVE;
+                hdr.code = 0;
+                hdr.group = group;
+                igmp_output(iface, IGMP_ADDR_ALL_ROUTERS, (uint8_t *)&hdr, sizeof(hdr));
+            }
+            break;
+        default:
+            /* NOTE: the record is kept until the leave is retransmitted by the timer */
+            g->changes = IGMP_ROBUSTNESS;
+            igmp_report(entry, g, &now);
+            if (--g->changes) {
+                igmp_schedule(&g->timer, &now, IGMP_UNSOLICITED_INTERVAL_V3);
+                mutex_unlock(&mutex);
+                return 0;
+            }
+            break;
+        }
+    }
+    for (prev = igmp_group_bucket(group); *prev; prev = &(*prev)->next) {
+        if (*prev == g) {
+            *prev = g->next;
+            break;
+        }
+    }
+    memory_free(g);
+    mutex_unlock(&mutex);
+    return 0;
+}
+
+int
+igmp_init(void)
+{
+    struct timeval interval = {0, 100000}; /* 100ms */
+
+    if (ip_protocol_register("IGMP", IP_PROTOCOL_IGMP, igmp_input) == -1) {
+        errorf("ip_protocol_register() failure");
+        return -1;
+    }
+    if (net_timer_register("IGMP Timer", interval, igmp_timer) == -1) {
+        errorf("net_timer_register() failure");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef IGMP_H
+#define IGMP_H
+
+#include <stdint.h>
+
+#include "ip.h"
+
+/* NOTE: in network byte order */
+#define IGMP_ADDR_ALL_HOSTS   hton32(0xe0000001) /* 224.0.0.1, joined by every iface, never reported */
+#define IGMP_ADDR_ALL_ROUTERS hton32(0xe0000002) /* 224.0.0.2, destination of IGMPv2 Leave */
+#define IGMP_ADDR_V3_ROUTERS  hton32(0xe0000016) /* 224.0.0.22, destination of IGMPv3 Report */
+
+extern int
+igmp_member(struct ip_iface *iface, ip_addr_t group);
+extern int
+igmp_join(struct ip_iface *iface, ip_addr_t group);
+extern int
+igmp_leave(struct ip_iface *iface, ip_addr_t group);
+
+extern int
+igmp_init(void);
+
+#endif
@@ -2,6 +2,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
 
 #include "platform.h"
 
@@ -9,20 +10,108 @@
 #include "net.h"
 #include "arp.h"
 #include "ip.h"
+#include "icmp.h"
+#include "igmp.h"
+#include "acl.h"
 
 struct ip_protocol {
-    struct ip_protocol *next;
     char name[16];
     uint8_t type;
-    void (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface);
+    void (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface, int flags);
+};
+
+#define IP_FLOW_CACHE_SIZE 256 /* must be a power of 2 */
+
+/* NOTE: the addresses and ports are seen from the received packet (src is the foreign end) */
+struct ip_flow {
+    int used;
+    uint8_t protocol;
+    ip_addr_t src;
+    ip_addr_t dst;
+    uint16_t sport;
+    uint16_t dport;
+    struct ip_iface *iface;
+    void (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface, int flags, void *arg);
+    void *arg;
+};
+
+#define IP_FORWARD_CACHE_SIZE 256 /* must be a power of 2 */
+
+#define IP_PMTU_CACHE_SIZE 256 /* must be a power of 2 */
+#define IP_PMTU_TIMEOUT 600 /* seconds, rfc1191 */
+#define IP_PMTU_MIN 552 /* floor, a forged message can not shrink the path below it */
+
+struct ip_pmtu {
+    ip_addr_t dst;
+    uint16_t mtu; /* 0 means unused */
+    struct timeval timestamp;
+};
+
+#define IP_REASM_TABLE_SIZE 64 /* must be a power of 2 */
+#define IP_REASM_TIMEOUT 30 /* seconds */
+#define IP_REASM_MEMORY_MAX (4 * 1024 * 1024) /* bytes held by all the datagrams in reassembly */
+#define IP_REASM_FRAGS_MAX 128 /* per datagram */
+
+/* NOTE: the data follows immediately after the structure */
+struct ip_reasm_frag {
+    struct ip_reasm_frag *next;
+    uint16_t offset; /* in bytes */
+    uint16_t len;
+};
+
+struct ip_reasm {
+    struct ip_reasm *next;
+    ip_addr_t src;
+    ip_addr_t dst;
+    uint16_t id;
+    uint8_t protocol;
+    uint8_t hdr[IP_HDR_SIZE_MAX]; /* taken from the first fragment */
+    uint16_t hlen; /* 0 until the first fragment arrives */
+    size_t total; /* length of the payload, 0 until the last fragment arrives */
+    size_t received;
+    size_t mem; /* charged to reasm_mem */
+    int num;
+    struct timeval timestamp; /* arrival of the first one */
+    struct ip_reasm_frag *frags; /* interval list sorted by the offset, no overlaps */
+};
+
+#define IP_ROUTE_STRIDE 8 /* bits consumed at each level of the trie */
+#define IP_ROUTE_LEVELS (32 / IP_ROUTE_STRIDE)
+#define IP_ROUTE_FANOUT (1 << IP_ROUTE_STRIDE)
+
+#define IP_ROUTE_PATHS_MAX 8 /* members of an equal-cost multipath route */
+
+struct ip_route_path {
+    ip_addr_t nexthop;
+    struct ip_iface *iface;
+};
+
+/* NOTE: replaced as a whole when a path is added, a reader sees either the old or the new one */
+struct ip_route_paths {
+    int num;
+    struct ip_route_path path[IP_ROUTE_PATHS_MAX];
 };
 
 struct ip_route {
     struct ip_route *next;
     ip_addr_t network;
     ip_addr_t netmask;
-    ip_addr_t nexthop;
-    struct ip_iface *iface;
+    struct ip_route_paths *paths;
+    int plen; /* prefix length */
+};
+
+/*
+ * NOTE: a slot holds the longest route whose prefix ends at this level and covers the slot
+ *       (controlled prefix expansion). The routes of the shorter prefixes are remembered
+ *       on the way down, so a lookup takes at most IP_ROUTE_LEVELS steps.
+ */
+struct ip_route_slot {
+    struct ip_route *route;
+    struct ip_route_node *child;
+};
+
+struct ip_route_node {
+    struct ip_route_slot slots[IP_ROUTE_FANOUT];
 };
 
 struct ip_hdr {
@@ -44,8 +133,32 @@ const ip_addr_t IP_ADDR_BROADCAST = 0xffffffff; /* 255.255.255.255 */
 
 /* NOTE: if you want to add/delete the entries after net_run(), you need to protect these lists with a mutex. */
 static struct ip_iface *ifaces;
-static struct ip_protocol *protocols;
-static struct ip_route *routes;
+static struct ip_protocol *protocols[UINT8_MAX+1]; /* dispatch table indexed by the protocol number */
+
+/* NOTE: the readers walk the trie without locks, the writers copy the nodes they change (RCU) */
+static mutex_t route_mutex = MUTEX_INITIALIZER; /* serializes the writers */
+static struct rcu route_rcu = RCU_INITIALIZER;
+static struct ip_route *routes; /* all the routes, used by the writers only */
+static struct ip_route_node *route_root;
+static unsigned int route_gen = 1; /* bumped on every change, invalidates struct ip_dst_cache */
+
+static mutex_t flow_mutex = MUTEX_INITIALIZER;
+static struct ip_flow flows[IP_FLOW_CACHE_SIZE]; /* direct mapped, a new flow evicts the old one */
+
+static int forwarding;
+/* NOTE: touched by the input thread only, no lock is needed */
+static struct ip_dst_cache forward_cache[IP_FORWARD_CACHE_SIZE]; /* direct mapped by the flow hash */
+static struct ip_forward_stats forward_stats;
+
+static int pmtu_discovery = 1;
+static mutex_t pmtu_mutex = MUTEX_INITIALIZER;
+static struct ip_pmtu pmtus[IP_PMTU_CACHE_SIZE]; /* direct mapped by the destination */
+static unsigned int pmtu_gen = 1; /* bumped on every change, invalidates the MTU in struct ip_dst_cache */
+
+static mutex_t reasm_mutex = MUTEX_INITIALIZER;
+static struct ip_reasm *reasms[IP_REASM_TABLE_SIZE];
+static size_t reasm_mem;
+static struct ip_reasm_stats reasm_stats;
 
 int
 ip_addr_pton(const char *p, ip_addr_t *n)
@@ -147,53 +260,379 @@ ip_dump(const uint8_t *data, size_t len)
     funlockfile(stderr);
 }
 
-/* NOTE: must not be call after net_run() */
+/*
+ * IP Routing
+ */
+
+static int
+ip_route_plen(ip_addr_t netmask)
+{
+    uint32_t mask;
+    int plen = 0;
+
+    mask = ntoh32(netmask);
+    while (mask & 0x80000000) {
+        mask <<= 1;
+        plen++;
+    }
+    if (mask) {
+        /* not contiguous */
+        return -1;
+    }
+    return plen;
+}
+
+static int
+ip_route_level(int plen)
+{
+    return plen ? (plen - 1) / IP_ROUTE_STRIDE : 0;
+}
+
+static int
+ip_route_index(ip_addr_t addr, int level)
+{
+    return (ntoh32(addr) >> (32 - IP_ROUTE_STRIDE * (level + 1))) & (IP_ROUTE_FANOUT - 1);
+}
+
+/* NOTE: the range of the slots covered by the route at its level */
+static void
+ip_route_span(struct ip_route *route, int *first, int *num)
+{
+    int level, bits;
+
+    level = ip_route_level(route->plen);
+    bits = IP_ROUTE_STRIDE * (level + 1) - route->plen;
+    *num = 1 << bits;
+    *first = ip_route_index(route->network, level) & ~(*num - 1);
+}
+
+/* NOTE: puts the route into the slots in [first, first+num) where it is the longest one */
+static void
+ip_route_expand(struct ip_route_node *node, struct ip_route *route, int first, int num)
+{
+    int rfirst, rnum, i;
+
+    ip_route_span(route, &rfirst, &rnum);
+    if (rfirst + rnum <= first || first + num <= rfirst) {
+        return;
+    }
+    for (i = MAX(first, rfirst); i < MIN(first + num, rfirst + rnum); i++) {
+        if (!node->slots[i].route || node->slots[i].route->plen <= route->plen) {
+            node->slots[i].route = route;
+        }
+    }
+}
+
+/* NOTE: the both routes go through the same nodes down to the level */
+static int
+ip_route_same_path(struct ip_route *a, struct ip_route *b, int level)
+{
+    int l;
+
+    for (l = 0; l < level; l++) {
+        if (ip_route_index(a->network, l) != ip_route_index(b->network, l)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int
+ip_route_node_empty(struct ip_route_node *node)
+{
+    struct ip_route_slot *slot;
+
+    for (slot = node->slots; slot < tailof(node->slots); slot++) {
+        if (slot->route || slot->child) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* NOTE: must be called after route_mutex locked, route is already linked to (or unlinked from) the list */
+static int
+ip_route_update(struct ip_route *route, int add)
+{
+    struct ip_route_node *old[IP_ROUTE_LEVELS] = {}, *new[IP_ROUTE_LEVELS] = {};
+    struct ip_route *entry;
+    int level, l, first, num, i;
+
+    level = ip_route_level(route->plen);
+    /* copy the path from the root to the level of the route */
+    for (l = 0; l <= level; l++) {
+        old[l] = l ? (old[l-1] ? old[l-1]->slots[ip_route_index(route->network, l-1)].child : NULL) : route_root;
+        new[l] = memory_alloc(sizeof(*new[l]));
+        if (!new[l]) {
+            errorf("memory_alloc() failure");
+            while (l--) {
+                memory_free(new[l]);
+            }
+            return -1;
+        }
+        if (old[l]) {
+            memcpy(new[l], old[l], sizeof(*new[l]));
+        }
+        if (l) {
+            new[l-1]->slots[ip_route_index(route->network, l-1)].child = new[l];
+        }
+    }
+    ip_route_span(route, &first, &num);
+    if (add) {
+        ip_route_expand(new[level], route, first, num);
+    } else {
+        /* recompute the slots from the remaining routes of the same level and the same path */
+        for (i = first; i < first + num; i++) {
+            new[level]->slots[i].route = NULL;
+        }
+        for (entry = routes; entry; entry = entry->next) {
+            if (ip_route_level(entry->plen) != level || !ip_route_same_path(entry, route, level)) {
+                continue;
+            }
+            ip_route_expand(new[level], entry, first, num);
+        }
+        /* prune the nodes left empty */
+        for (l = level; l > 0 && ip_route_node_empty(new[l]); l--) {
+            new[l-1]->slots[ip_route_index(route->network, l-1)].child = NULL;
+            memory_free(new[l]);
+            new[l] = NULL;
+        }
+    }
+    __atomic_store_n(&route_root, new[0], __ATOMIC_RELEASE);
+    __atomic_add_fetch(&route_gen, 1, __ATOMIC_RELEASE);
+    rcu_synchronize(&route_rcu);
+    for (l = 0; l <= level; l++) {
+        memory_free(old[l]);
+    }
+    return 0;
+}
+
+/* NOTE: must be called after route_mutex locked */
+static int
+ip_route_add_path(struct ip_route *route, ip_addr_t nexthop, struct ip_iface *iface)
+{
+    struct ip_route_paths *old, *new;
+    int i;
+    char addr1[IP_ADDR_STR_LEN];
+    char addr2[IP_ADDR_STR_LEN];
+    char addr3[IP_ADDR_STR_LEN];
+    char addr4[IP_ADDR_STR_LEN];
+
+    old = route->paths;
+    for (i = 0; i < old->num; i++) {
+        if (old->path[i].nexthop == nexthop && old->path[i].iface == iface) {
+            errorf("already exists, network=%s, netmask=%s, nexthop=%s",
+                ip_addr_ntop(route->network, addr1, sizeof(addr1)),
+                ip_addr_ntop(route->netmask, addr2, sizeof(addr2)),
+                ip_addr_ntop(nexthop, addr3, sizeof(addr3)));
+            return -1;
+        }
+    }
+    if (old->num == IP_ROUTE_PATHS_MAX) {
+        errorf("too many paths, network=%s, netmask=%s",
+            ip_addr_ntop(route->network, addr1, sizeof(addr1)), ip_addr_ntop(route->netmask, addr2, sizeof(addr2)));
+        return -1;
+    }
+    new = memory_alloc(sizeof(*new));
+    if (!new) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    memcpy(new, old, sizeof(*new));
+    new->path[new->num].nexthop = nexthop;
+    new->path[new->num].iface = iface;
+    new->num++;
+    __atomic_store_n(&route->paths, new, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&route_gen, 1, __ATOMIC_RELEASE);
+    rcu_synchronize(&route_rcu);
+    memory_free(old);
+    infof("network=%s, netmask=%s, nexthop=%s, iface=%s dev=%s, paths=%d",
+        ip_addr_ntop(route->network, addr1, sizeof(addr1)),
+        ip_addr_ntop(route->netmask, addr2, sizeof(addr2)),
+        ip_addr_ntop(nexthop, addr3, sizeof(addr3)),
+        ip_addr_ntop(iface->unicast, addr4, sizeof(addr4)),
+        NET_IFACE(iface)->dev->name, new->num);
+    return 0;
+}
+
 static struct ip_route *
 ip_route_add(ip_addr_t network, ip_addr_t netmask, ip_addr_t nexthop, struct ip_iface *iface)
 {
     struct ip_route *route;
+    int plen;
     char addr1[IP_ADDR_STR_LEN];
     char addr2[IP_ADDR_STR_LEN];
     char addr3[IP_ADDR_STR_LEN];
     char addr4[IP_ADDR_STR_LEN];
 
+    plen = ip_route_plen(netmask);
+    if (plen == -1) {
+        errorf("invalid netmask, netmask=%s", ip_addr_ntop(netmask, addr2, sizeof(addr2)));
+        return NULL;
+    }
+    if (network & ~netmask) {
+        errorf("host bits are set, network=%s, netmask=%s",
+            ip_addr_ntop(network, addr1, sizeof(addr1)), ip_addr_ntop(netmask, addr2, sizeof(addr2)));
+        return NULL;
+    }
+    mutex_lock(&route_mutex);
+    for (route = routes; route; route = route->next) {
+        if (route->network == network && route->netmask == netmask) {
+            /* the same prefix again, another path of the multipath route */
+            if (ip_route_add_path(route, nexthop, iface) == -1) {
+                mutex_unlock(&route_mutex);
+                errorf("ip_route_add_path() failure");
+                return NULL;
+            }
+            mutex_unlock(&route_mutex);
+            return route;
+        }
+    }
     route = memory_alloc(sizeof(*route));
     if (!route) {
+        mutex_unlock(&route_mutex);
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    route->paths = memory_alloc(sizeof(*route->paths));
+    if (!route->paths) {
+        mutex_unlock(&route_mutex);
         errorf("memory_alloc() failure");
+        memory_free(route);
         return NULL;
     }
     route->network = network;
     route->netmask = netmask;
-    route->nexthop = nexthop;
-    route->iface = iface;
+    route->paths->path[0].nexthop = nexthop;
+    route->paths->path[0].iface = iface;
+    route->paths->num = 1;
+    route->plen = plen;
     route->next = routes;
     routes = route;
+    if (ip_route_update(route, 1) == -1) {
+        routes = route->next;
+        mutex_unlock(&route_mutex);
+        errorf("ip_route_update() failure");
+        memory_free(route->paths);
+        memory_free(route);
+        return NULL;
+    }
+    mutex_unlock(&route_mutex);
     infof("network=%s, netmask=%s, nexthop=%s, iface=%s dev=%s",
         ip_addr_ntop(route->network, addr1, sizeof(addr1)),
         ip_addr_ntop(route->netmask, addr2, sizeof(addr2)),
-        ip_addr_ntop(route->nexthop, addr3, sizeof(addr3)),
-        ip_addr_ntop(route->iface->unicast, addr4, sizeof(addr4)),
+        ip_addr_ntop(nexthop, addr3, sizeof(addr3)),
+        ip_addr_ntop(iface->unicast, addr4, sizeof(addr4)),
         NET_IFACE(iface)->dev->name
     );
     return route;
 }
 
-static struct ip_route *
-ip_route_lookup(ip_addr_t dst)
+static int
+ip_route_del(ip_addr_t network, ip_addr_t netmask)
 {
-    struct ip_route *route, *candidate = NULL;
+    struct ip_route *route, *prev = NULL;
+    char addr1[IP_ADDR_STR_LEN];
+    char addr2[IP_ADDR_STR_LEN];
 
-    for (route = routes; route; route = route->next) {
-        if ((dst & route->netmask) == route->network) {
-            if (!candidate || ntoh32(candidate->netmask) < ntoh32(route->netmask)) {
-                candidate = route;
+    mutex_lock(&route_mutex);
+    for (route = routes; route; prev = route, route = route->next) {
+        if (route->network == network && route->netmask == netmask) {
+            break;
+        }
+    }
+    if (!route) {
+        mutex_unlock(&route_mutex);
+        errorf("not found, network=%s, netmask=%s",
+            ip_addr_ntop(network, addr1, sizeof(addr1)), ip_addr_ntop(netmask, addr2, sizeof(addr2)));
+        return -1;
+    }
+    if (prev) {
+        prev->next = route->next;
+    } else {
+        routes = route->next;
+    }
+    if (ip_route_update(route, 0) == -1) {
+        route->next = prev ? prev->next : routes;
+        if (prev) {
+            prev->next = route;
+        } else {
+            routes = route;
+        }
+        mutex_unlock(&route_mutex);
+        errorf("ip_route_update() failure");
+        return -1;
+    }
+    mutex_unlock(&route_mutex);
+    infof("network=%s, netmask=%s",
+        ip_addr_ntop(network, addr1, sizeof(addr1)), ip_addr_ntop(netmask, addr2, sizeof(addr2)));
+    /* NOTE: no reader can see it after ip_route_update() */
+    memory_free(route->paths);
+    memory_free(route);
+    return 0;
+}
+
+/*
+ * NOTE: picks one of the equal-cost paths by the flow hash, so a flow sticks to a path.
+ *       A source address pins the flow to the paths out of the iface that owns it.
+ */
+static const struct ip_route_path *
+ip_route_select(const struct ip_route_paths *paths, uint32_t hash, ip_addr_t src)
+{
+    int num = 0, i, n;
+
+    if (paths->num == 1) {
+        return &paths->path[0];
+    }
+    if (src != IP_ADDR_ANY) {
+        for (i = 0; i < paths->num; i++) {
+            if (paths->path[i].iface->unicast == src) {
+                num++;
             }
         }
     }
-    return candidate;
+    if (!num) {
+        src = IP_ADDR_ANY;
+        num = paths->num;
+    }
+    /* NOTE: maps the hash onto [0, num) by the upper bits, no division */
+    n = ((uint64_t)hash * num) >> 32;
+    for (i = 0; i < paths->num; i++) {
+        if (src != IP_ADDR_ANY && paths->path[i].iface->unicast != src) {
+            continue;
+        }
+        if (!n--) {
+            break;
+        }
+    }
+    return &paths->path[i];
+}
+
+/* NOTE: copies the selected path out, the route may be deleted once the read-side section ends */
+static int
+ip_route_lookup(ip_addr_t dst, uint32_t hash, ip_addr_t src, struct ip_route_path *ret)
+{
+    struct ip_route_node *node;
+    struct ip_route *route = NULL;
+    struct ip_route_slot *slot;
+    int idx, level;
+
+    idx = rcu_read_lock(&route_rcu);
+    node = __atomic_load_n(&route_root, __ATOMIC_ACQUIRE);
+    for (level = 0; node && level < IP_ROUTE_LEVELS; level++) {
+        slot = &node->slots[ip_route_index(dst, level)];
+        if (slot->route) {
+            route = slot->route;
+        }
+        node = slot->child;
+    }
+    if (route) {
+        *ret = *ip_route_select(__atomic_load_n(&route->paths, __ATOMIC_ACQUIRE), hash, src);
+    }
+    rcu_read_unlock(&route_rcu, idx);
+    return route ? 0 : -1;
 }
 
-/* NOTE: must not be call after net_run() */
 int
 ip_route_set_default_gateway(struct ip_iface *iface, const char *gateway)
 {
@@ -210,16 +649,75 @@ ip_route_set_default_gateway(struct ip_iface *iface, const char *gateway)
     return 0;
 }
 
+/* NOTE: nexthop may be NULL for a directly connected network, iface may be NULL to follow the nexthop */
+int
+ip_route_register(const char *network, const char *netmask, const char *nexthop, struct ip_iface *iface)
+{
+    ip_addr_t n, m, h = IP_ADDR_ANY;
+
+    if (ip_addr_pton(network, &n) == -1 || ip_addr_pton(netmask, &m) == -1) {
+        errorf("ip_addr_pton() failure, network=%s, netmask=%s", network, netmask);
+        return -1;
+    }
+    if (nexthop && ip_addr_pton(nexthop, &h) == -1) {
+        errorf("ip_addr_pton() failure, nexthop=%s", nexthop);
+        return -1;
+    }
+    if (!iface) {
+        if (h == IP_ADDR_ANY) {
+            errorf("iface or nexthop is required");
+            return -1;
+        }
+        iface = ip_route_get_iface(h);
+        if (!iface) {
+            errorf("nexthop is unreachable, nexthop=%s", nexthop);
+            return -1;
+        }
+    }
+    if (!ip_route_add(n, m, h, iface)) {
+        errorf("ip_route_add() failure");
+        return -1;
+    }
+    return 0;
+}
+
+int
+ip_route_unregister(const char *network, const char *netmask)
+{
+    ip_addr_t n, m;
+
+    if (ip_addr_pton(network, &n) == -1 || ip_addr_pton(netmask, &m) == -1) {
+        errorf("ip_addr_pton() failure, network=%s, netmask=%s", network, netmask);
+        return -1;
+    }
+    return ip_route_del(n, m);
+}
+
+/* NOTE: the hash of the 5-tuple, which keeps a flow on one path of a multipath route */
+uint32_t
+ip_route_hash(uint8_t protocol, ip_addr_t src, ip_addr_t dst, uint16_t sport, uint16_t dport)
+{
+    uint32_t h;
+
+    h = src ^ (dst * 0x9e3779b1) ^ (((uint32_t)sport << 16) | dport) ^ protocol;
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+/* NOTE: the first path of a multipath route, use struct ip_dst_cache to follow the flow */
 struct ip_iface *
 ip_route_get_iface(ip_addr_t dst)
 {
-    struct ip_route *route;
+    struct ip_route_path path;
 
-    route = ip_route_lookup(dst);
-    if (!route) {
+    if (ip_route_lookup(dst, 0, IP_ADDR_ANY, &path) == -1) {
         return NULL;
     }
-    return route->iface;
+    return path.iface;
 }
 
 struct ip_iface *
@@ -265,6 +763,10 @@ ip_iface_register(struct net_device *dev, struct ip_iface *iface)
     }
     iface->next = ifaces;
     ifaces = iface;
+    if (igmp_join(iface, IGMP_ADDR_ALL_HOSTS) == -1) {
+        /* NOTE: not fatal, only the queries of the routers are missed */
+        warnf("igmp_join() failure");
+    }
     infof("registered: dev=%s, unicast=%s, netmask=%s, broadcast=%s",
         dev->name,
         ip_addr_ntop(iface->unicast, addr1, sizeof(addr1)),
@@ -286,77 +788,227 @@ ip_iface_select(ip_addr_t addr)
     return entry;
 }
 
-static void
-ip_input(const uint8_t *data, size_t len, struct net_device *dev)
+/*
+ * IP Flow Cache
+ *
+ * NOTE: maps the 5-tuple of an established flow to the handler and PCB of the upper layer,
+ *       so that ip_input() can hand the packet over with a single probe (early demux).
+ *       The owner must validate the PCB in the handler, it may have been released since.
+ */
+
+static uint32_t
+ip_flow_hash(uint8_t protocol, ip_addr_t src, ip_addr_t dst, uint16_t sport, uint16_t dport)
+{
+    return ip_route_hash(protocol, src, dst, sport, dport) & (IP_FLOW_CACHE_SIZE - 1);
+}
+
+int
+ip_flow_insert(uint8_t protocol, const struct ip_endpoint *local, const struct ip_endpoint *foreign,
+    void (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface, int flags, void *arg), void *arg)
 {
-    struct ip_hdr *hdr;
-    uint8_t v;
-    uint16_t hlen, total, offset;
     struct ip_iface *iface;
-    char addr[IP_ADDR_STR_LEN];
-    struct ip_protocol *proto;
+    struct ip_flow *flow;
 
-    if (len < IP_HDR_SIZE_MIN) {
-        errorf("too short");
-        return;
+    iface = ip_iface_select(local->addr);
+    if (!iface) {
+        /* not a unicast address of ours */
+        return -1;
     }
-    hdr = (struct ip_hdr *)data;
-    v = hdr->vhl >> 4;
-    if (v != IP_VERSION_IPV4) {
-        errorf("ip version error: v=%u", v);
-        return;
+    flow = &flows[ip_flow_hash(protocol, foreign->addr, local->addr, foreign->port, local->port)];
+    mutex_lock(&flow_mutex);
+    flow->used = 1;
+    flow->protocol = protocol;
+    flow->src = foreign->addr;
+    flow->dst = local->addr;
+    flow->sport = foreign->port;
+    flow->dport = local->port;
+    flow->iface = iface;
+    flow->handler = handler;
+    flow->arg = arg;
+    mutex_unlock(&flow_mutex);
+    return 0;
+}
+
+/* NOTE: removes all the flows owned by the PCB */
+void
+ip_flow_remove(void *arg)
+{
+    struct ip_flow *flow;
+
+    mutex_lock(&flow_mutex);
+    for (flow = flows; flow < tailof(flows); flow++) {
+        if (flow->used && flow->arg == arg) {
+            flow->used = 0;
+        }
     }
-    hlen = (hdr->vhl & 0x0f) << 2;
-    if (len < hlen) {
-        errorf("header length error: hlen=%u, len=%zu", hlen, len);
-        return;
+    mutex_unlock(&flow_mutex);
+}
+
+static int
+ip_flow_lookup(const struct ip_hdr *hdr, const uint8_t *payload, struct net_device *dev, struct ip_flow *ret)
+{
+    uint16_t sport, dport;
+    struct ip_flow *flow;
+    int hit = 0;
+
+    /* NOTE: the ports are at the same place in TCP and UDP */
+    memcpy(&sport, payload, sizeof(sport));
+    memcpy(&dport, payload + 2, sizeof(dport));
+    flow = &flows[ip_flow_hash(hdr->protocol, hdr->src, hdr->dst, sport, dport)];
+    mutex_lock(&flow_mutex);
+    if (flow->used && flow->protocol == hdr->protocol && flow->src == hdr->src && flow->dst == hdr->dst &&
+        flow->sport == sport && flow->dport == dport && NET_IFACE(flow->iface)->dev == dev) {
+        *ret = *flow;
+        hit = 1;
+    }
+    mutex_unlock(&flow_mutex);
+    return hit;
+}
+
+/*
+ * NOTE: picks the input band, the packet is not validated yet. The segments of a connection
+ *       must stay in order, the TCP input has no reassembly queue. Only an opening SYN,
+ *       which has nothing before it in the flow, is raised.
+ */
+static int
+ip_classify(const uint8_t *data, size_t len)
+{
+    const struct ip_hdr *hdr;
+    uint16_t hlen, total;
+    const uint8_t *tcp;
+
+    if (len < IP_HDR_SIZE_MIN) {
+        return NET_INPUT_BAND_DATA;
     }
+    hdr = (const struct ip_hdr *)data;
+    hlen = (hdr->vhl & 0x0f) << 2;
     total = ntoh16(hdr->total);
-    if (len < total) {
-        errorf("total length error: total=%u, len=%zu", total, len);
-        return;
+    if (hdr->protocol != IP_PROTOCOL_TCP || ntoh16(hdr->offset) & 0x1fff) {
+        return NET_INPUT_BAND_DATA;
     }
-    if (cksum16((uint16_t *)hdr, hlen, 0) != 0) {
-        errorf("checksum error: sum=0x%04x, verify=0x%04x", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)hdr, hlen, -hdr->sum)));
-        return;
+    if (len < (size_t)hlen + 20 || total < hlen + 20) {
+        return NET_INPUT_BAND_DATA;
     }
-    offset = ntoh16(hdr->offset);
-    if (offset & 0x2000 || offset & 0x1fff) {
-        errorf("fragments does not support");
-        return;
+    tcp = data + hlen;
+    if ((tcp[13] & 0x12) == 0x02) {
+        /* SYN without ACK */
+        return NET_INPUT_BAND_CONTROL;
     }
-    iface = (struct ip_iface *)net_device_get_iface(dev, NET_IFACE_FAMILY_IP);
-    if (!iface) {
-        /* iface is not registered to the device */
-        return;
+    return NET_INPUT_BAND_DATA;
+}
+
+/*
+ * Path MTU
+ *
+ * NOTE: rfc1191, the MTU learned from the "fragmentation needed" messages (or lowered by
+ *       the packetization layer, rfc4821) is kept per destination. It is forgotten after
+ *       IP_PMTU_TIMEOUT, so the path is probed with the MTU of the device again.
+ */
+
+static struct ip_pmtu *
+ip_pmtu_slot(ip_addr_t dst)
+{
+    return &pmtus[ip_route_hash(0, IP_ADDR_ANY, dst, 0, 0) & (IP_PMTU_CACHE_SIZE - 1)];
+}
+
+/* NOTE: returns the smaller one of the MTU of the device and the one learned for the path */
+uint16_t
+ip_pmtu_get(ip_addr_t dst, uint16_t mtu)
+{
+    struct ip_pmtu *entry;
+
+    entry = ip_pmtu_slot(dst);
+    mutex_lock(&pmtu_mutex);
+    if (entry->mtu && entry->dst == dst && entry->mtu < mtu) {
+        mtu = entry->mtu;
     }
-    if (hdr->dst != iface->unicast) {
-        if (hdr->dst != iface->broadcast && hdr->dst != IP_ADDR_BROADCAST) {
-            /* for other host */
-            return;
+    mutex_unlock(&pmtu_mutex);
+    return mtu;
+}
+
+/* NOTE: only lowers the estimate, it is raised by the timeout */
+int
+ip_pmtu_update(ip_addr_t dst, uint16_t mtu)
+{
+    struct ip_pmtu *entry;
+    char addr[IP_ADDR_STR_LEN];
+
+    if (mtu < IP_PMTU_MIN) {
+        mtu = IP_PMTU_MIN;
+    }
+    entry = ip_pmtu_slot(dst);
+    mutex_lock(&pmtu_mutex);
+    if (entry->mtu && entry->dst == dst && entry->mtu <= mtu) {
+        mutex_unlock(&pmtu_mutex);
+        return 0;
+    }
+    entry->dst = dst;
+    entry->mtu = mtu;
+    gettimeofday(&entry->timestamp, NULL);
+    __atomic_add_fetch(&pmtu_gen, 1, __ATOMIC_RELEASE);
+    mutex_unlock(&pmtu_mutex);
+    infof("dst=%s, mtu=%u", ip_addr_ntop(dst, addr, sizeof(addr)), mtu);
+    return 0;
+}
+
+/* NOTE: rfc1191, the next plateau below mtu, for the routers which do not report the MTU */
+uint16_t
+ip_pmtu_plateau(uint16_t mtu)
+{
+    static const uint16_t plateaus[] = {32000, 17914, 8166, 4352, 2002, 1492, 1006, 508, 296, 68};
+    int i;
+
+    for (i = 0; i < (int)countof(plateaus); i++) {
+        if (plateaus[i] < mtu) {
+            return plateaus[i];
         }
     }
-    debugf("dev=%s, iface=%s, protocol=%s(0x%02x), len=%u",
-        dev->name, ip_addr_ntop(iface->unicast, addr, sizeof(addr)), ip_protocol_name(hdr->protocol), hdr->protocol, total);
-    ip_dump(data, total);
-    for (proto = protocols; proto; proto = proto->next) {
-        if (proto->type == hdr->protocol) {
-            proto->handler((uint8_t *)hdr + hlen, total - hlen, hdr->src, hdr->dst, iface);
-            return;
+    return 68;
+}
+
+static void
+ip_pmtu_timer(void)
+{
+    struct ip_pmtu *entry;
+    struct timeval now, diff;
+
+    gettimeofday(&now, NULL);
+    mutex_lock(&pmtu_mutex);
+    for (entry = pmtus; entry < tailof(pmtus); entry++) {
+        if (!entry->mtu) {
+            continue;
+        }
+        timersub(&now, &entry->timestamp, &diff);
+        if (diff.tv_sec >= IP_PMTU_TIMEOUT) {
+            entry->mtu = 0;
+            __atomic_add_fetch(&pmtu_gen, 1, __ATOMIC_RELEASE);
         }
     }
-    /* unsupported protocol */
+    mutex_unlock(&pmtu_mutex);
 }
 
+/* NOTE: must not be call after net_run() */
+void
+ip_set_pmtu_discovery(int enable)
+{
+    pmtu_discovery = enable;
+}
+
+/* NOTE: resolves the link address of dst unless hwaddr is given */
 static int
-ip_output_device(struct ip_iface *iface, const uint8_t *data, size_t len, ip_addr_t dst)
+ip_output_device(struct ip_iface *iface, const struct iovec *iov, int iovcnt, ip_addr_t dst, const uint8_t *resolved, int flags)
 {
     uint8_t hwaddr[NET_DEVICE_ADDR_LEN] = {};
     int ret;
 
+    if (resolved) {
+        return net_device_output_iov(NET_IFACE(iface)->dev, NET_PROTOCOL_TYPE_IP, iov, iovcnt, resolved, flags);
+    }
     if (NET_IFACE(iface)->dev->flags & NET_DEVICE_FLAG_NEED_ARP) {
         if (dst == iface->broadcast || dst == IP_ADDR_BROADCAST) {
             memcpy(hwaddr, NET_IFACE(iface)->dev->broadcast, NET_IFACE(iface)->dev->alen);
+        } else if (IP_ADDR_IS_MULTICAST(dst)) {
+            arp_resolve_mcast(dst, hwaddr);
         } else {
             ret = arp_resolve(NET_IFACE(iface), dst, hwaddr);
             if (ret != ARP_RESOLVE_FOUND) {
@@ -364,36 +1016,96 @@ ip_output_device(struct ip_iface *iface, const uint8_t *data, size_t len, ip_add
             }
         }
     }
-    return net_device_output(NET_IFACE(iface)->dev, NET_PROTOCOL_TYPE_IP, data, len, hwaddr);
+    return net_device_output_iov(NET_IFACE(iface)->dev, NET_PROTOCOL_TYPE_IP, iov, iovcnt, hwaddr, flags);
+}
+
+/* offset of the checksum field in the TCP/UDP header */
+static int
+ip_csum_offset(uint8_t protocol)
+{
+    switch (protocol) {
+    case IP_PROTOCOL_TCP:
+        return 16;
+    case IP_PROTOCOL_UDP:
+        return 6;
+    }
+    return -1;
+}
+
+/* NOTE: the checksum field holds the sum of the pseudo header, fold the segment into it */
+static void
+ip_csum_complete(uint8_t protocol, uint8_t *data, size_t len, int csum_offset)
+{
+    uint16_t *sum;
+
+    sum = (uint16_t *)(data + csum_offset);
+    *sum = cksum16((uint16_t *)data, len, 0);
+    if (protocol == IP_PROTOCOL_UDP && !*sum) {
+        *sum = 0xffff; /* rfc768: zero means no checksum */
+    }
 }
 
 static ssize_t
-ip_output_core(struct ip_iface *iface, uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, ip_addr_t nexthop, uint16_t id, uint16_t offset)
+ip_output_core(struct ip_iface *iface, uint8_t protocol, uint8_t tos, const uint8_t *options, size_t optlen, const struct iovec *iov, int iovcnt, size_t len, ip_addr_t src, ip_addr_t dst, ip_addr_t nexthop, const uint8_t *hwaddr, uint16_t id, uint16_t offset, int flags)
 {
     uint8_t buf[IP_TOTAL_SIZE_MAX];
     struct ip_hdr *hdr;
+    struct iovec vec[NET_IOV_MAX];
     uint16_t hlen, total;
+    int csum_offset, i, n = 0;
     char addr[IP_ADDR_STR_LEN];
 
+    if (iovcnt >= NET_IOV_MAX) {
+        errorf("too many fragments, iovcnt=%d", iovcnt);
+        return -1;
+    }
+    if (optlen & 3 || sizeof(*hdr) + optlen > IP_HDR_SIZE_MAX) {
+        errorf("invalid options, optlen=%zu", optlen);
+        return -1;
+    }
     hdr = (struct ip_hdr *)buf;
-    hlen = sizeof(*hdr);
+    hlen = sizeof(*hdr) + optlen;
     hdr->vhl = (IP_VERSION_IPV4 << 4) | (hlen >> 2);
-    hdr->tos = 0;
+    hdr->tos = tos;
     total = hlen + len;
     hdr->total = hton16(total);
     hdr->id = hton16(id);
     hdr->offset = hton16(offset);
-    hdr->ttl = 0xff;
+    hdr->ttl = IP_ADDR_IS_MULTICAST(dst) ? 1 : 0xff; /* NOTE: rfc1112, multicast stays on the link by default */
     hdr->protocol = protocol;
     hdr->sum = 0;
     hdr->src = src;
     hdr->dst = dst;
-    hdr->sum = cksum16((uint16_t *)hdr, hlen, 0); /* don't convert byteorder */
-    memcpy(hdr+1, data, len);
+    if (optlen) {
+        memcpy(hdr->options, options, optlen);
+    }
+    if (!(NET_IFACE(iface)->dev->features & NET_DEVICE_FEATURE_IP_CSUM)) {
+        hdr->sum = cksum16((uint16_t *)hdr, hlen, 0); /* don't convert byteorder */
+    }
+    if ((flags & NET_PACKET_FLAG_CSUM_PARTIAL) && !(NET_IFACE(iface)->dev->features & NET_DEVICE_FEATURE_TX_CSUM)) {
+        /* the device can not fill in the checksum, gather the payload and complete it here */
+        iovec_copy(buf + hlen, len, iov, iovcnt);
+        csum_offset = ip_csum_offset(protocol);
+        if (csum_offset != -1) {
+            ip_csum_complete(protocol, buf + hlen, len, csum_offset);
+        }
+        flags &= ~NET_PACKET_FLAG_CSUM_PARTIAL;
+        vec[n].iov_base = buf;
+        vec[n].iov_len = total;
+        n++;
+    } else {
+        /* NOTE: the payload is passed down as is, the device gathers it if it can */
+        vec[n].iov_base = hdr;
+        vec[n].iov_len = hlen;
+        n++;
+        for (i = 0; i < iovcnt; i++) {
+            vec[n++] = iov[i];
+        }
+    }
     debugf("dev=%s, iface=%s, protocol=%s(0x%02x), len=%u",
         NET_IFACE(iface)->dev->name, ip_addr_ntop(iface->unicast, addr, sizeof(addr)), ip_protocol_name(protocol), protocol, total);
-    ip_dump(buf, total);
-    return ip_output_device(iface, buf, total, nexthop);
+    ip_dump((uint8_t *)hdr, hlen);
+    return ip_output_device(iface, vec, n, nexthop, hwaddr, flags);
 }
 
 static uint16_t
@@ -410,53 +1122,988 @@ ip_generate_id(void)
 }
 
 ssize_t
-ip_output(uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst)
+ip_output(uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, int flags)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *)data;
+    iov.iov_len = len;
+    return ip_output_iov(protocol, &iov, 1, src, dst, flags);
+}
+
+/*
+ * NOTE: the payload is gathered and the checksum is completed beforehand, neither the
+ *       device nor the receiver can handle them per fragment. The fragments go out
+ *       as a burst with NET_PACKET_FLAG_MORE.
+ */
+static int
+ip_output_fragment(struct ip_iface *iface, uint16_t mtu, uint8_t protocol, const struct iovec *iov, int iovcnt, size_t len, ip_addr_t dst, ip_addr_t nexthop, const uint8_t *hwaddr, uint16_t id, int flags)
+{
+    uint8_t buf[IP_PAYLOAD_SIZE_MAX];
+    struct iovec vec;
+    size_t size, off;
+    int csum_offset, more, last;
+
+    iovec_copy(buf, sizeof(buf), iov, iovcnt);
+    if (flags & NET_PACKET_FLAG_CSUM_PARTIAL) {
+        csum_offset = ip_csum_offset(protocol);
+        if (csum_offset != -1 && len >= (size_t)csum_offset + 2) {
+            ip_csum_complete(protocol, buf, len, csum_offset);
+        }
+    }
+    more = flags & NET_PACKET_FLAG_MORE;
+    flags &= ~(NET_PACKET_FLAG_CSUM_PARTIAL | NET_PACKET_FLAG_GSO | NET_PACKET_FLAG_MORE);
+    size = (mtu - IP_HDR_SIZE_MIN) & ~7;
+    for (off = 0; off < len; off += size) {
+        vec.iov_base = buf + off;
+        vec.iov_len = MIN(size, len - off);
+        last = (off + vec.iov_len == len);
+        if (ip_output_core(iface, protocol, 0, NULL, 0, &vec, 1, vec.iov_len, iface->unicast, dst, nexthop, hwaddr, id,
+            (last ? 0 : 0x2000) | (off >> 3), flags | (last ? more : NET_PACKET_FLAG_MORE)) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* NOTE: mtu is the one of the path, it may be smaller than the one of the device */
+static ssize_t
+ip_output_route(struct ip_iface *iface, uint16_t mtu, ip_addr_t nexthop, const uint8_t *hwaddr, uint8_t protocol, const struct iovec *iov, int iovcnt, ip_addr_t src, ip_addr_t dst, int flags)
+{
+    char addr[IP_ADDR_STR_LEN];
+    uint16_t id, offset = 0;
+    size_t len;
+
+    if (src != IP_ADDR_ANY && src != iface->unicast) {
+        errorf("unable to output with specified source address, addr=%s", ip_addr_ntop(src, addr, sizeof(addr)));
+        return -1;
+    }
+    len = iovec_len(iov, iovcnt);
+    if (IP_HDR_SIZE_MIN + len > IP_TOTAL_SIZE_MAX) {
+        errorf("too long, total=%zu", IP_HDR_SIZE_MIN + len);
+        return -1;
+    }
+    id = ip_generate_id();
+    if (mtu < IP_HDR_SIZE_MIN + len &&
+        !((flags & NET_PACKET_FLAG_GSO) && (NET_IFACE(iface)->dev->features & NET_DEVICE_FEATURE_TSO))) {
+        if (ip_output_fragment(iface, mtu, protocol, iov, iovcnt, len, dst, nexthop, hwaddr, id, flags) == -1) {
+            errorf("ip_output_fragment() failure");
+            return -1;
+        }
+        return len;
+    }
+    if (pmtu_discovery && (protocol == IP_PROTOCOL_TCP || protocol == IP_PROTOCOL_UDP) &&
+        dst != iface->broadcast && dst != IP_ADDR_BROADCAST) {
+        /* NOTE: rfc1191, let the routers report the MTU of the path instead of fragmenting */
+        offset = 0x4000;
+    }
+    if (ip_output_core(iface, protocol, 0, NULL, 0, iov, iovcnt, len, iface->unicast, dst, nexthop, hwaddr, id, offset, flags) == -1) {
+        errorf("ip_output_core() failure");
+        return -1;
+    }
+    return len;
+}
+
+/*
+ * NOTE: sends out of the iface regardless of the routes, for the protocols bound to the link like IGMP.
+ *       They carry their own TOS and options (e.g. Router Alert), and are never fragmented.
+ */
+ssize_t
+ip_output_iface(struct ip_iface *iface, uint8_t protocol, uint8_t tos, const uint8_t *options, size_t optlen, const uint8_t *data, size_t len, ip_addr_t dst, int flags)
+{
+    struct iovec iov;
+
+    if (IP_HDR_SIZE_MIN + optlen + len > NET_IFACE(iface)->dev->mtu) {
+        errorf("too long, total=%zu, mtu=%u", IP_HDR_SIZE_MIN + optlen + len, NET_IFACE(iface)->dev->mtu);
+        return -1;
+    }
+    iov.iov_base = (void *)data;
+    iov.iov_len = len;
+    if (ip_output_core(iface, protocol, tos, options, optlen, &iov, 1, len, iface->unicast, dst, dst, NULL, ip_generate_id(), 0, flags) == -1) {
+        errorf("ip_output_core() failure");
+        return -1;
+    }
+    return len;
+}
+
+/* NOTE: the ports are at the same place in TCP and UDP, the other protocols hash on the addresses */
+static uint32_t
+ip_output_hash(uint8_t protocol, const struct iovec *iov, int iovcnt, ip_addr_t src, ip_addr_t dst)
+{
+    uint16_t ports[2] = {};
+
+    if (protocol == IP_PROTOCOL_TCP || protocol == IP_PROTOCOL_UDP) {
+        iovec_copy((uint8_t *)ports, sizeof(ports), iov, iovcnt);
+    }
+    return ip_route_hash(protocol, src, dst, ports[0], ports[1]);
+}
+
+ssize_t
+ip_output_iov(uint8_t protocol, const struct iovec *iov, int iovcnt, ip_addr_t src, ip_addr_t dst, int flags)
+{
+    struct ip_route_path path;
+    char addr[IP_ADDR_STR_LEN];
+
+    if (src == IP_ADDR_ANY && dst == IP_ADDR_BROADCAST) {
+        errorf("source address is required for broadcast addresses");
+        return -1;
+    }
+    if (ip_route_lookup(dst, ip_output_hash(protocol, iov, iovcnt, src, dst), src, &path) == -1) {
+        errorf("no route to host, addr=%s", ip_addr_ntop(dst, addr, sizeof(addr)));
+        return -1;
+    }
+    return ip_output_route(path.iface, ip_pmtu_get(dst, NET_IFACE(path.iface)->dev->mtu),
+        (path.nexthop != IP_ADDR_ANY) ? path.nexthop : dst, NULL, protocol, iov, iovcnt, src, dst, flags);
+}
+
+static void
+ip_dst_cache_set(struct ip_dst_cache *cache, uint32_t hash, ip_addr_t src)
+{
+    if (cache->hash != hash || cache->src != src) {
+        cache->hash = hash;
+        cache->src = src;
+        cache->iface = NULL;
+    }
+}
+
+/* NOTE: tells the flow of the owner, it picks the path of a multipath route */
+void
+ip_dst_cache_set_flow(struct ip_dst_cache *cache, uint8_t protocol, const struct ip_endpoint *local, const struct ip_endpoint *foreign)
+{
+    ip_dst_cache_set(cache, ip_route_hash(protocol, local->addr, foreign->addr, local->port, foreign->port), local->addr);
+}
+
+/* NOTE: returns the output iface for dst, refreshes the cache if the routes have changed */
+struct ip_iface *
+ip_dst_cache_check(struct ip_dst_cache *cache, ip_addr_t dst)
+{
+    struct ip_route_path path;
+    unsigned int gen;
+
+    gen = __atomic_load_n(&route_gen, __ATOMIC_ACQUIRE);
+    if (cache->iface && cache->route_gen == gen && cache->dst == dst) {
+        return cache->iface;
+    }
+    /* NOTE: the generation is taken before the lookup, a change in between makes it stale at once */
+    if (ip_route_lookup(dst, cache->hash, cache->src, &path) == -1) {
+        cache->iface = NULL;
+        return NULL;
+    }
+    cache->route_gen = gen;
+    cache->pmtu_gen = 0;
+    cache->dst = dst;
+    cache->iface = path.iface;
+    cache->nexthop = (path.nexthop != IP_ADDR_ANY) ? path.nexthop : dst;
+    cache->resolved = 0;
+    return cache->iface;
+}
+
+/* NOTE: the MTU of the path to the destination of a valid cache */
+uint16_t
+ip_dst_cache_mtu(struct ip_dst_cache *cache)
+{
+    unsigned int gen;
+    uint16_t mtu;
+
+    gen = __atomic_load_n(&pmtu_gen, __ATOMIC_ACQUIRE);
+    mtu = __atomic_load_n(&NET_IFACE(cache->iface)->dev->mtu, __ATOMIC_RELAXED);
+    /* NOTE: the MTU of the device may be changed at runtime (net_device_set_mtu()) */
+    if (cache->pmtu_gen != gen || cache->dev_mtu != mtu) {
+        cache->mtu = ip_pmtu_get(cache->dst, mtu);
+        cache->pmtu_gen = gen;
+        cache->dev_mtu = mtu;
+    }
+    return cache->mtu;
+}
+
+/* NOTE: fills in the link address of the nexthop unless the ARP cache has changed since */
+static int
+ip_dst_cache_resolve(struct ip_dst_cache *cache, struct ip_iface *iface)
+{
+    struct net_device *dev;
+    unsigned int gen;
+    int ret;
+
+    dev = NET_IFACE(iface)->dev;
+    gen = arp_generation();
+    if (cache->resolved && cache->neigh_gen == gen) {
+        return ARP_RESOLVE_FOUND;
+    }
+    cache->resolved = 0;
+    memset(cache->hwaddr, 0, sizeof(cache->hwaddr));
+    if (dev->flags & NET_DEVICE_FLAG_NEED_ARP) {
+        if (cache->nexthop == iface->broadcast || cache->nexthop == IP_ADDR_BROADCAST) {
+            memcpy(cache->hwaddr, dev->broadcast, dev->alen);
+        } else if (IP_ADDR_IS_MULTICAST(cache->nexthop)) {
+            arp_resolve_mcast(cache->nexthop, cache->hwaddr);
+        } else {
+            ret = arp_resolve(NET_IFACE(iface), cache->nexthop, cache->hwaddr);
+            if (ret != ARP_RESOLVE_FOUND) {
+                return ret;
+            }
+        }
+    }
+    cache->neigh_gen = gen;
+    cache->resolved = 1;
+    return ARP_RESOLVE_FOUND;
+}
+
+/* NOTE: same as ip_output_iov() but skips the route lookup and the address resolution while the cache is valid */
+ssize_t
+ip_output_cache(struct ip_dst_cache *cache, uint8_t protocol, const struct iovec *iov, int iovcnt, ip_addr_t src, ip_addr_t dst, int flags)
 {
-    struct ip_route *route;
     struct ip_iface *iface;
     char addr[IP_ADDR_STR_LEN];
-    ip_addr_t nexthop;
-    uint16_t id;
+    int ret;
 
     if (src == IP_ADDR_ANY && dst == IP_ADDR_BROADCAST) {
         errorf("source address is required for broadcast addresses");
         return -1;
     }
-    route = ip_route_lookup(dst);
-    if (!route) {
+    iface = ip_dst_cache_check(cache, dst);
+    if (!iface) {
         errorf("no route to host, addr=%s", ip_addr_ntop(dst, addr, sizeof(addr)));
         return -1;
     }
-    iface = route->iface;
-    if (src != IP_ADDR_ANY && src != iface->unicast) {
-        errorf("unable to output with specified source address, addr=%s", ip_addr_ntop(src, addr, sizeof(addr)));
+    ret = ip_dst_cache_resolve(cache, iface);
+    if (ret == ARP_RESOLVE_ERROR) {
+        errorf("arp_resolve() failure");
         return -1;
     }
-    nexthop = (route->nexthop != IP_ADDR_ANY) ? route->nexthop : dst;
-    if (NET_IFACE(iface)->dev->mtu < IP_HDR_SIZE_MIN + len) {
-        errorf("too long, dev=%s, mtu=%u, tatal=%zu",
-            NET_IFACE(iface)->dev->name, NET_IFACE(iface)->dev->mtu, IP_HDR_SIZE_MIN + len);
+    if (ret == ARP_RESOLVE_INCOMPLETE) {
+        /* NOTE: same as ip_output_iov(), the packet is lost while the resolution is in progress */
+        return iovec_len(iov, iovcnt);
+    }
+    return ip_output_route(iface, ip_dst_cache_mtu(cache), cache->nexthop, cache->hwaddr, protocol, iov, iovcnt, src, dst, flags);
+}
+
+/*
+ * NOTE: pushes out what the device holds from ip_output_cache() with NET_PACKET_FLAG_MORE.
+ *       The device is the one the cache has sent them to, it may be any path of a multipath route.
+ */
+int
+ip_dst_cache_flush(struct ip_dst_cache *cache)
+{
+    if (!cache->iface) {
+        /* nothing has been sent through it */
+        return 0;
+    }
+    return net_device_flush(NET_IFACE(cache->iface)->dev);
+}
+
+/*
+ * IP Forwarding
+ *
+ * NOTE: runs in the input thread. The route lookup and the address resolution of the
+ *       nexthop are kept in a small cache indexed by the flow hash, the same one the
+ *       PCBs use. The packets are handed to the device with NET_PACKET_FLAG_MORE, and
+ *       the devices are flushed after each input batch, so a burst to the same device
+ *       goes out together.
+ */
+
+/* NOTE: rfc1624, HC' = ~(~HC + ~m + m'), all the values in network byte order */
+static uint16_t
+ip_csum_update16(uint16_t sum, uint16_t from, uint16_t to)
+{
+    uint32_t s;
+
+    s = (uint16_t)~sum + (uint16_t)~from + to;
+    s = (s & 0xffff) + (s >> 16);
+    s = (s & 0xffff) + (s >> 16);
+    return ~s;
+}
+
+/* NOTE: fragments hash on the addresses only, the ports are in the first one alone */
+static uint32_t
+ip_forward_hash(const struct ip_hdr *hdr, uint16_t hlen, uint16_t total)
+{
+    uint16_t ports[2] = {};
+
+    if ((hdr->protocol == IP_PROTOCOL_TCP || hdr->protocol == IP_PROTOCOL_UDP) &&
+        !(ntoh16(hdr->offset) & 0x3fff) && total >= hlen + sizeof(ports)) {
+        memcpy(ports, (uint8_t *)hdr + hlen, sizeof(ports));
+    }
+    return ip_route_hash(hdr->protocol, hdr->src, hdr->dst, ports[0], ports[1]);
+}
+
+/* NOTE: rfc791, the later fragments take only the options with the copied flag */
+static uint16_t
+ip_fragment_options(uint8_t *dst, const uint8_t *hdr, uint16_t hlen)
+{
+    uint16_t i = IP_HDR_SIZE_MIN, n = IP_HDR_SIZE_MIN;
+    uint8_t olen;
+
+    memcpy(dst, hdr, IP_HDR_SIZE_MIN);
+    while (i < hlen && hdr[i] != 0) { /* end of option list */
+        if (hdr[i] == 1) {
+            /* no operation */
+            i++;
+            continue;
+        }
+        olen = (i + 1 < hlen) ? hdr[i+1] : 0;
+        if (olen < 2 || i + olen > hlen) {
+            break;
+        }
+        if (hdr[i] & 0x80) {
+            memcpy(dst + n, hdr + i, olen);
+            n += olen;
+        }
+        i += olen;
+    }
+    while (n & 3) {
+        dst[n++] = 0;
+    }
+    return n;
+}
+
+/* NOTE: hdr is the header to be forwarded, the offset and MF of the original are kept */
+static int
+ip_forward_fragment(struct ip_iface *iface, uint8_t *hdr, uint16_t hlen, const uint8_t *payload, size_t len, ip_addr_t nexthop, const uint8_t *hwaddr)
+{
+    uint8_t rest[IP_HDR_SIZE_MAX];
+    struct ip_hdr *frag;
+    struct iovec iov[2];
+    uint16_t offset, fhlen, size, off, n;
+
+    offset = ntoh16(((struct ip_hdr *)hdr)->offset);
+    fhlen = ip_fragment_options(rest, hdr, hlen);
+    for (off = 0; off < len; off += n) {
+        frag = (struct ip_hdr *)(off ? rest : hdr);
+        if (off) {
+            hlen = fhlen;
+        }
+        size = (NET_IFACE(iface)->dev->mtu - hlen) & ~7;
+        if (!size) {
+            return -1;
+        }
+        n = MIN(size, len - off);
+        frag->vhl = (IP_VERSION_IPV4 << 4) | (hlen >> 2);
+        frag->total = hton16(hlen + n);
+        frag->offset = hton16(((off + n < len) ? 0x2000 : (offset & 0x2000)) | ((offset & 0x1fff) + (off >> 3)));
+        frag->sum = 0;
+        if (!(NET_IFACE(iface)->dev->features & NET_DEVICE_FEATURE_IP_CSUM)) {
+            frag->sum = cksum16((uint16_t *)frag, hlen, 0);
+        }
+        iov[0].iov_base = frag;
+        iov[0].iov_len = hlen;
+        iov[1].iov_base = (uint8_t *)payload + off;
+        iov[1].iov_len = n;
+        if (ip_output_device(iface, iov, 2, nexthop, hwaddr, NET_PACKET_FLAG_MORE) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * NOTE: software GSO, a TCP super-segment received from a device with GSO (e.g. tap) is split
+ *       into MSS sized segments for a device without TSO. Each segment gets its own IP ID and
+ *       sequence number, FIN/PSH go to the last one and CWR to the first. The checksum of the
+ *       super-segment may hold only the pseudo header sum, the segments are summed in full.
+ */
+static int
+ip_forward_segment(struct ip_iface *iface, uint8_t *hdr, uint16_t hlen, const uint8_t *payload, size_t len, ip_addr_t nexthop, const uint8_t *hwaddr)
+{
+    uint8_t head[IP_HDR_SIZE_MAX + 60]; /* IP and TCP headers of a segment */
+    struct ip_hdr *ip;
+    uint8_t *tcp, flg;
+    uint32_t pseudo[3], seq, v;
+    uint16_t thlen, mss, id, n, sum;
+    struct iovec iov[2];
+    size_t off;
+
+    if (len < 20) {
         return -1;
     }
-    id = ip_generate_id();
-    if (ip_output_core(iface, protocol, data, len, iface->unicast, dst, nexthop, id, 0) == -1) {
-        errorf("ip_output_core() failure");
+    thlen = (payload[12] >> 4) << 2;
+    if (thlen < 20 || thlen > len || NET_IFACE(iface)->dev->mtu <= hlen + thlen) {
         return -1;
     }
-    return len;
+    mss = NET_IFACE(iface)->dev->mtu - (hlen + thlen);
+    memcpy(head, hdr, hlen);
+    memcpy(head + hlen, payload, thlen);
+    ip = (struct ip_hdr *)head;
+    tcp = head + hlen;
+    memcpy(&v, tcp + 4, sizeof(v));
+    seq = ntoh32(v);
+    flg = tcp[13];
+    id = ntoh16(ip->id);
+    for (off = thlen; off < len; off += n) {
+        n = MIN(mss, len - off);
+        ip->total = hton16(hlen + thlen + n);
+        ip->id = hton16(id++);
+        ip->sum = 0;
+        if (!(NET_IFACE(iface)->dev->features & NET_DEVICE_FEATURE_IP_CSUM)) {
+            ip->sum = cksum16((uint16_t *)ip, hlen, 0);
+        }
+        v = hton32(seq + (off - thlen));
+        memcpy(tcp + 4, &v, sizeof(v));
+        tcp[13] = flg;
+        if (off + n < len) {
+            tcp[13] &= ~0x09; /* FIN, PSH */
+        }
+        if (off != thlen) {
+            tcp[13] &= ~0x80; /* CWR */
+        }
+        pseudo[0] = ip->src;
+        pseudo[1] = ip->dst;
+        pseudo[2] = hton32((IP_PROTOCOL_TCP << 16) | (thlen + n));
+        memset(tcp + 16, 0, sizeof(sum));
+        sum = ~cksum16((uint16_t *)pseudo, sizeof(pseudo), 0);
+        sum = ~cksum16((uint16_t *)tcp, thlen, sum);
+        sum = cksum16((uint16_t *)(payload + off), n, sum);
+        memcpy(tcp + 16, &sum, sizeof(sum));
+        iov[0].iov_base = head;
+        iov[0].iov_len = hlen + thlen;
+        iov[1].iov_base = (uint8_t *)payload + off;
+        iov[1].iov_len = n;
+        if (ip_output_device(iface, iov, 2, nexthop, hwaddr, NET_PACKET_FLAG_MORE) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void
+ip_forward(const uint8_t *data, uint16_t hlen, uint16_t total, struct ip_iface *in, int flags)
+{
+    uint8_t buf[IP_TOTAL_SIZE_MAX];
+    struct ip_hdr *hdr;
+    struct ip_dst_cache *cache;
+    struct ip_iface *iface;
+    struct net_device *dev;
+    struct iovec iov[2];
+    uint16_t from, to, mtu;
+    uint32_t hash;
+    int csum_offset, ret, fragment = 0, segment = 0;
+    char addr1[IP_ADDR_STR_LEN];
+    char addr2[IP_ADDR_STR_LEN];
+    char addr3[IP_ADDR_STR_LEN];
+
+    hdr = (struct ip_hdr *)data;
+    if (hdr->src == IP_ADDR_ANY || hdr->src == IP_ADDR_BROADCAST || hdr->src == in->broadcast ||
+        (ntoh32(hdr->src) & 0xf0000000) == 0xe0000000 || (ntoh32(hdr->dst) & 0xf0000000) == 0xe0000000) {
+        /* martian source, or multicast which is not routed */
+        forward_stats.dropped++;
+        return;
+    }
+    if (hdr->ttl <= 1) {
+        forward_stats.ttl_exceeded++;
+        icmp_error(ICMP_TYPE_TIME_EXCEEDED, ICMP_CODE_EXCEEDED_TTL, 0, data, total);
+        return;
+    }
+    hash = ip_forward_hash(hdr, hlen, total);
+    cache = &forward_cache[hash & (IP_FORWARD_CACHE_SIZE - 1)];
+    ip_dst_cache_set(cache, hash, IP_ADDR_ANY);
+    iface = ip_dst_cache_check(cache, hdr->dst);
+    if (!iface) {
+        forward_stats.no_route++;
+        icmp_error(ICMP_TYPE_DEST_UNREACH, ICMP_CODE_NET_UNREACH, 0, data, total);
+        return;
+    }
+    if (hdr->dst == iface->broadcast) {
+        /* NOTE: directed broadcasts are not forwarded (rfc2644) */
+        forward_stats.dropped++;
+        return;
+    }
+    dev = NET_IFACE(iface)->dev;
+    if (total > dev->mtu && !((flags & NET_PACKET_FLAG_GSO) && (dev->features & NET_DEVICE_FEATURE_TSO))) {
+        if ((flags & NET_PACKET_FLAG_GSO) && hdr->protocol == IP_PROTOCOL_TCP) {
+            /* NOTE: the sender made it for a device with TSO, it is split here instead */
+            segment = 1;
+        } else if (ntoh16(hdr->offset) & 0x4000) {
+            forward_stats.too_big++;
+            /* NOTE: rfc1191, the MTU of the next hop is in the lower 16 bits */
+            mtu = dev->mtu;
+            icmp_error(ICMP_TYPE_DEST_UNREACH, ICMP_CODE_FRAGMENT_NEEDED, hton32(mtu), data, total);
+            return;
+        } else {
+            fragment = 1;
+        }
+    }
+    ret = ip_dst_cache_resolve(cache, iface);
+    if (ret != ARP_RESOLVE_FOUND) {
+        if (ret == ARP_RESOLVE_ERROR) {
+            forward_stats.no_route++;
+            icmp_error(ICMP_TYPE_DEST_UNREACH, ICMP_CODE_HOST_UNREACH, 0, data, total);
+        } else {
+            /* NOTE: lost while the resolution is in progress, same as ip_output() */
+            forward_stats.dropped++;
+        }
+        return;
+    }
+    flags &= (NET_PACKET_FLAG_CSUM_PARTIAL | NET_PACKET_FLAG_GSO);
+    if ((flags & NET_PACKET_FLAG_CSUM_PARTIAL) && !segment && (fragment || !(dev->features & NET_DEVICE_FEATURE_TX_CSUM))) {
+        /* the device can not fill in the checksum left by the sender, complete it here */
+        memcpy(buf, data, total);
+        csum_offset = ip_csum_offset(hdr->protocol);
+        if (csum_offset != -1 && total >= hlen + csum_offset + 2) {
+            ip_csum_complete(hdr->protocol, buf + hlen, total - hlen, csum_offset);
+        }
+        flags &= ~NET_PACKET_FLAG_CSUM_PARTIAL;
+        data = buf;
+    } else {
+        /* NOTE: only the header is rewritten, the payload is passed down as is */
+        memcpy(buf, data, hlen);
+    }
+    hdr = (struct ip_hdr *)buf;
+    memcpy(&from, &hdr->ttl, sizeof(from)); /* TTL and protocol share a 16-bit word */
+    hdr->ttl--;
+    memcpy(&to, &hdr->ttl, sizeof(to));
+    hdr->sum = ip_csum_update16(hdr->sum, from, to);
+    iov[0].iov_base = buf;
+    iov[0].iov_len = hlen;
+    iov[1].iov_base = (uint8_t *)data + hlen;
+    iov[1].iov_len = total - hlen;
+    debugf("%s => %s, dev=%s, nexthop=%s, len=%u",
+        ip_addr_ntop(hdr->src, addr1, sizeof(addr1)), ip_addr_ntop(hdr->dst, addr2, sizeof(addr2)),
+        dev->name, ip_addr_ntop(cache->nexthop, addr3, sizeof(addr3)), total);
+    if (segment) {
+        if (ip_forward_segment(iface, buf, hlen, (uint8_t *)data + hlen, total - hlen, cache->nexthop, cache->hwaddr) == -1) {
+            forward_stats.dropped++;
+            return;
+        }
+        forward_stats.segmented++;
+        forward_stats.forwarded++;
+        return;
+    }
+    if (fragment) {
+        if (ip_forward_fragment(iface, buf, hlen, (uint8_t *)data + hlen, total - hlen, cache->nexthop, cache->hwaddr) == -1) {
+            forward_stats.dropped++;
+            return;
+        }
+        forward_stats.fragmented++;
+        forward_stats.forwarded++;
+        return;
+    }
+    if (ip_output_device(iface, iov, 2, cache->nexthop, cache->hwaddr, flags | NET_PACKET_FLAG_MORE) == -1) {
+        forward_stats.dropped++;
+        return;
+    }
+    forward_stats.forwarded++;
+}
+
+/* NOTE: must not be call after net_run(), the devices set up their filters on open */
+void
+ip_set_forwarding(int enable)
+{
+    forwarding = enable;
+    infof("forwarding %s", enable ? "enabled" : "disabled");
 }
 
-/* NOTE: must not be call after net_run() */
 int
-ip_protocol_register(const char *name, uint8_t type, void (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface))
+ip_get_forwarding(void)
 {
-    struct ip_protocol *entry;
+    return forwarding;
+}
+
+/* NOTE: the counters are updated by the input thread only, the snapshot may be a little torn */
+void
+ip_forward_get_stats(struct ip_forward_stats *stats)
+{
+    *stats = forward_stats;
+}
+
+/*
+ * IP Reassembly
+ *
+ * NOTE: the fragments are kept per (src, dst, id, protocol) in a hash table, as an interval
+ *       list sorted by the offset. A duplicate is ignored, a partial overlap discards the
+ *       whole datagram. A datagram which is not completed in IP_REASM_TIMEOUT is dropped,
+ *       and the oldest ones are dropped to keep the total under IP_REASM_MEMORY_MAX.
+ */
+
+static uint32_t
+ip_reasm_hash(ip_addr_t src, ip_addr_t dst, uint16_t id, uint8_t protocol)
+{
+    return ip_route_hash(protocol, src, dst, id, 0) & (IP_REASM_TABLE_SIZE - 1);
+}
+
+/* NOTE: must be called after reasm_mutex locked */
+static void
+ip_reasm_unlink(struct ip_reasm *entry)
+{
+    struct ip_reasm **p;
 
-    for (entry = protocols; entry; entry = entry->next) {
-        if (entry->type == type) {
-            errorf("already exists, type=%s(0x%02x), exist=%s(0x%02x)", name, type, entry->name, entry->type);
+    for (p = &reasms[ip_reasm_hash(entry->src, entry->dst, entry->id, entry->protocol)]; *p; p = &(*p)->next) {
+        if (*p == entry) {
+            *p = entry->next;
+            break;
+        }
+    }
+    reasm_mem -= entry->mem;
+}
+
+static void
+ip_reasm_free(struct ip_reasm *entry)
+{
+    struct ip_reasm_frag *frag;
+
+    while ((frag = entry->frags) != NULL) {
+        entry->frags = frag->next;
+        memory_free(frag);
+    }
+    memory_free(entry);
+}
+
+/* NOTE: must be called after reasm_mutex locked, keep is not evicted */
+static void
+ip_reasm_evict(size_t need, struct ip_reasm *keep)
+{
+    struct ip_reasm *entry, *oldest;
+    int i;
+
+    while (reasm_mem + need > IP_REASM_MEMORY_MAX) {
+        oldest = NULL;
+        for (i = 0; i < IP_REASM_TABLE_SIZE; i++) {
+            for (entry = reasms[i]; entry; entry = entry->next) {
+                if (entry != keep && (!oldest || timercmp(&oldest->timestamp, &entry->timestamp, >))) {
+                    oldest = entry;
+                }
+            }
+        }
+        if (!oldest) {
+            break;
+        }
+        ip_reasm_unlink(oldest);
+        ip_reasm_free(oldest);
+        reasm_stats.evicted++;
+    }
+}
+
+/* NOTE: must be called after reasm_mutex locked */
+static struct ip_reasm *
+ip_reasm_get(const struct ip_hdr *hdr)
+{
+    struct ip_reasm **head, *entry;
+    uint16_t id;
+
+    id = ntoh16(hdr->id);
+    head = &reasms[ip_reasm_hash(hdr->src, hdr->dst, id, hdr->protocol)];
+    for (entry = *head; entry; entry = entry->next) {
+        if (entry->src == hdr->src && entry->dst == hdr->dst && entry->id == id && entry->protocol == hdr->protocol) {
+            return entry;
+        }
+    }
+    ip_reasm_evict(sizeof(*entry), NULL);
+    if (reasm_mem + sizeof(*entry) > IP_REASM_MEMORY_MAX) {
+        return NULL;
+    }
+    entry = memory_alloc(sizeof(*entry));
+    if (!entry) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    entry->src = hdr->src;
+    entry->dst = hdr->dst;
+    entry->id = id;
+    entry->protocol = hdr->protocol;
+    entry->mem = sizeof(*entry);
+    gettimeofday(&entry->timestamp, NULL);
+    reasm_mem += entry->mem;
+    entry->next = *head;
+    *head = entry;
+    return entry;
+}
+
+/* NOTE: must be called after reasm_mutex locked, returns 1 when the fragment is taken in, 0 for a duplicate, -1 for a bad one */
+static int
+ip_reasm_insert(struct ip_reasm *entry, const uint8_t *data, uint16_t hlen, uint16_t off, uint16_t len, int more)
+{
+    struct ip_reasm_frag *prev = NULL, *next, *frag;
+
+    if (off + len > IP_TOTAL_SIZE_MAX - IP_HDR_SIZE_MIN || (more && (!len || len & 7))) {
+        return -1;
+    }
+    if (more ? (entry->total && off + len > entry->total) : (entry->total && entry->total != (size_t)off + len)) {
+        return -1;
+    }
+    for (next = entry->frags; next && next->offset < off; prev = next, next = next->next);
+    if (!more) {
+        for (frag = next; frag && frag->next; frag = frag->next);
+        if ((frag && frag->offset + frag->len > off + len) || (!frag && prev && prev->offset + prev->len > off + len)) {
             return -1;
         }
+        entry->total = off + len;
+    }
+    if (!len) {
+        return 1;
+    }
+    if (prev && prev->offset + prev->len > off) {
+        if (prev->offset + prev->len >= off + len) {
+            return 0;
+        }
+        return -1;
+    }
+    if (next && off + len > next->offset) {
+        if (next->offset == off && next->len >= len) {
+            return 0;
+        }
+        return -1;
+    }
+    if (entry->num == IP_REASM_FRAGS_MAX) {
+        return -1;
+    }
+    ip_reasm_evict(sizeof(*frag) + len, entry);
+    if (reasm_mem + sizeof(*frag) + len > IP_REASM_MEMORY_MAX) {
+        return 0;
+    }
+    frag = memory_alloc(sizeof(*frag) + len);
+    if (!frag) {
+        errorf("memory_alloc() failure");
+        return 0;
+    }
+    frag->offset = off;
+    frag->len = len;
+    memcpy(frag + 1, data + hlen, len);
+    frag->next = next;
+    if (prev) {
+        prev->next = frag;
+    } else {
+        entry->frags = frag;
+    }
+    if (!off) {
+        memcpy(entry->hdr, data, hlen);
+        entry->hlen = hlen;
+    }
+    entry->num++;
+    entry->received += len;
+    entry->mem += sizeof(*frag) + len;
+    reasm_mem += sizeof(*frag) + len;
+    return 1;
+}
+
+/* NOTE: returns the whole datagram when the fragment completes it, the caller must free it */
+static uint8_t *
+ip_reasm_input(const uint8_t *data, uint16_t hlen, uint16_t total, size_t *size)
+{
+    const struct ip_hdr *hdr;
+    struct ip_reasm *entry;
+    struct ip_reasm_frag *frag;
+    struct ip_hdr *whole;
+    uint8_t *buf;
+    uint16_t offset;
+    char addr1[IP_ADDR_STR_LEN];
+    char addr2[IP_ADDR_STR_LEN];
+
+    hdr = (const struct ip_hdr *)data;
+    offset = ntoh16(hdr->offset);
+    mutex_lock(&reasm_mutex);
+    reasm_stats.fragments++;
+    entry = ip_reasm_get(hdr);
+    if (!entry) {
+        mutex_unlock(&reasm_mutex);
+        return NULL;
+    }
+    if (ip_reasm_insert(entry, data, hlen, (offset & 0x1fff) << 3, total - hlen, offset & 0x2000) == -1) {
+        errorf("bad fragment, %s => %s, id=%u, offset=%u, len=%u",
+            ip_addr_ntop(hdr->src, addr1, sizeof(addr1)), ip_addr_ntop(hdr->dst, addr2, sizeof(addr2)),
+            entry->id, (offset & 0x1fff) << 3, total - hlen);
+        ip_reasm_unlink(entry);
+        ip_reasm_free(entry);
+        reasm_stats.malformed++;
+        mutex_unlock(&reasm_mutex);
+        return NULL;
+    }
+    if (!entry->hlen || !entry->total || entry->received != entry->total) {
+        mutex_unlock(&reasm_mutex);
+        return NULL;
+    }
+    ip_reasm_unlink(entry);
+    reasm_stats.reassembled++;
+    mutex_unlock(&reasm_mutex);
+    *size = entry->hlen + entry->total;
+    buf = (*size <= IP_TOTAL_SIZE_MAX) ? memory_alloc(*size) : NULL;
+    if (!buf) {
+        errorf("unable to reassemble, len=%zu", *size);
+        ip_reasm_free(entry);
+        return NULL;
+    }
+    memcpy(buf, entry->hdr, entry->hlen);
+    for (frag = entry->frags; frag; frag = frag->next) {
+        memcpy(buf + entry->hlen + frag->offset, frag + 1, frag->len);
+    }
+    whole = (struct ip_hdr *)buf;
+    whole->total = hton16(*size);
+    whole->offset = 0;
+    whole->sum = 0;
+    whole->sum = cksum16((uint16_t *)whole, entry->hlen, 0);
+    debugf("reassembled, id=%u, frags=%d, len=%zu", entry->id, entry->num, *size);
+    ip_reasm_free(entry);
+    return buf;
+}
+
+static void
+ip_reasm_timer(void)
+{
+    struct ip_reasm *entry, *next, *expired = NULL;
+    struct timeval now, diff;
+    uint8_t buf[IP_HDR_SIZE_MAX + 8];
+    int i;
+
+    gettimeofday(&now, NULL);
+    mutex_lock(&reasm_mutex);
+    for (i = 0; i < IP_REASM_TABLE_SIZE; i++) {
+        for (entry = reasms[i]; entry; entry = next) {
+            next = entry->next;
+            timersub(&now, &entry->timestamp, &diff);
+            if (diff.tv_sec >= IP_REASM_TIMEOUT) {
+                ip_reasm_unlink(entry);
+                entry->next = expired;
+                expired = entry;
+                reasm_stats.timeouts++;
+            }
+        }
+    }
+    mutex_unlock(&reasm_mutex);
+    while ((entry = expired) != NULL) {
+        expired = entry->next;
+        if (entry->hlen) {
+            /* NOTE: rfc792, reported only when the first fragment has arrived */
+            memcpy(buf, entry->hdr, entry->hlen);
+            memcpy(buf + entry->hlen, entry->frags + 1, MIN(entry->frags->len, 8));
+            icmp_error(ICMP_TYPE_TIME_EXCEEDED, ICMP_CODE_EXCEEDED_FRAGMENT, 0, buf, entry->hlen + MIN(entry->frags->len, 8));
+        }
+        ip_reasm_free(entry);
+    }
+}
+
+void
+ip_reasm_get_stats(struct ip_reasm_stats *stats)
+{
+    mutex_lock(&reasm_mutex);
+    *stats = reasm_stats;
+    mutex_unlock(&reasm_mutex);
+}
+
+/* NOTE: the ports are known only in the first fragment, the later ones follow its verdict */
+static int
+ip_acl_check(const struct ip_hdr *hdr, uint16_t hlen, uint16_t total)
+{
+    uint16_t ports[2] = {}, offset;
+    int known = 0;
+
+    offset = ntoh16(hdr->offset);
+    if ((hdr->protocol == IP_PROTOCOL_TCP || hdr->protocol == IP_PROTOCOL_UDP) &&
+        !(offset & 0x1fff) && total >= hlen + sizeof(ports)) {
+        memcpy(ports, (uint8_t *)hdr + hlen, sizeof(ports));
+        known = 1;
+    }
+    if (offset & 0x2000 || offset & 0x1fff) {
+        return acl_classify_fragment(hdr->protocol, hdr->src, hdr->dst, ntoh16(hdr->id), ntoh16(ports[0]), ntoh16(ports[1]), known, total);
+    }
+    return acl_classify(hdr->protocol, hdr->src, hdr->dst, ntoh16(ports[0]), ntoh16(ports[1]), known, total);
+}
+
+static void
+ip_input(const uint8_t *data, size_t len, struct net_device *dev, int flags)
+{
+    struct ip_hdr *hdr;
+    uint8_t v;
+    uint16_t hlen, total, offset;
+    struct ip_iface *iface;
+    char addr[IP_ADDR_STR_LEN];
+    struct ip_protocol *proto;
+    struct ip_flow flow;
+    uint8_t *whole;
+    size_t size;
+
+    if (len < IP_HDR_SIZE_MIN) {
+        errorf("too short");
+        return;
+    }
+    hdr = (struct ip_hdr *)data;
+    v = hdr->vhl >> 4;
+    if (v != IP_VERSION_IPV4) {
+        errorf("ip version error: v=%u", v);
+        return;
+    }
+    hlen = (hdr->vhl & 0x0f) << 2;
+    if (len < hlen) {
+        errorf("header length error: hlen=%u, len=%zu", hlen, len);
+        return;
+    }
+    total = ntoh16(hdr->total);
+    if (len < total) {
+        errorf("total length error: total=%u, len=%zu", total, len);
+        return;
+    }
+    if (!(flags & NET_PACKET_FLAG_IP_CSUM_VALID) && cksum16((uint16_t *)hdr, hlen, 0) != 0) {
+        errorf("checksum error: sum=0x%04x, verify=0x%04x", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)hdr, hlen, -hdr->sum)));
+        return;
+    }
+    offset = ntoh16(hdr->offset);
+    if (!(offset & 0x2000 || offset & 0x1fff) && ip_acl_check(hdr, hlen, total) == ACL_ACTION_DROP) {
+        /* NOTE: a fragment is classified after the reassembly, or before it is forwarded */
+        debugf("dropped by acl, protocol=%u, len=%u", hdr->protocol, total);
+        return;
+    }
+    if (!(offset & 0x2000 || offset & 0x1fff) &&
+        (hdr->protocol == IP_PROTOCOL_TCP || hdr->protocol == IP_PROTOCOL_UDP) && total - hlen >= 4) {
+        if (ip_flow_lookup(hdr, (uint8_t *)hdr + hlen, dev, &flow)) {
+            /* early demux: skip the lookup of the iface and the protocol, the owner already knows the PCB */
+            flow.handler((uint8_t *)hdr + hlen, total - hlen, hdr->src, hdr->dst, flow.iface, flags, flow.arg);
+            return;
+        }
+    }
+    iface = (struct ip_iface *)net_device_get_iface(dev, NET_IFACE_FAMILY_IP);
+    if (!iface) {
+        /* iface is not registered to the device */
+        return;
+    }
+    if (hdr->dst != iface->unicast) {
+        if (IP_ADDR_IS_MULTICAST(hdr->dst)) {
+            if (!igmp_member(iface, hdr->dst)) {
+                /* NOTE: passed the hash filter of the device, but the group is not joined */
+                return;
+            }
+        } else if (hdr->dst != iface->broadcast && hdr->dst != IP_ADDR_BROADCAST) {
+            if (!forwarding) {
+                /* for other host */
+                return;
+            }
+            if (!ip_iface_select(hdr->dst)) {
+                if ((offset & 0x2000 || offset & 0x1fff) && ip_acl_check(hdr, hlen, total) == ACL_ACTION_DROP) {
+                    debugf("dropped by acl, protocol=%u, len=%u", hdr->protocol, total);
+                    return;
+                }
+                /* NOTE: fragments are forwarded as they are */
+                ip_forward(data, hlen, total, iface, flags);
+                return;
+            }
+            /* NOTE: addressed to another iface of ours, accepted as in the weak host model */
+        }
+    }
+    if (offset & 0x2000 || offset & 0x1fff) {
+        whole = ip_reasm_input(data, hlen, total, &size);
+        if (whole) {
+            /* NOTE: the datagram goes through the input again, as if it came in one piece */
+            ip_input(whole, size, dev, 0);
+            memory_free(whole);
+        }
+        return;
+    }
+    debugf("dev=%s, iface=%s, protocol=%s(0x%02x), len=%u",
+        dev->name, ip_addr_ntop(iface->unicast, addr, sizeof(addr)), ip_protocol_name(hdr->protocol), hdr->protocol, total);
+    ip_dump(data, total);
+    proto = protocols[hdr->protocol];
+    if (!proto) {
+        /* unsupported protocol */
+        return;
+    }
+    proto->handler((uint8_t *)hdr + hlen, total - hlen, hdr->src, hdr->dst, iface, flags);
+}
+
+/* NOTE: must not be call after net_run() */
+int
+ip_protocol_register(const char *name, uint8_t type, void (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface, int flags))
+{
+    struct ip_protocol *entry;
+
+    entry = protocols[type];
+    if (entry) {
+        errorf("already exists, type=%s(0x%02x), exist=%s(0x%02x)", name, type, entry->name, entry->type);
+        return -1;
     }
     entry = memory_alloc(sizeof(*entry));
     if (!entry) {
@@ -466,8 +2113,7 @@ ip_protocol_register(const char *name, uint8_t type, void (*handler)(const uint8
     strncpy(entry->name, name, sizeof(entry->name)-1);
     entry->type = type;
     entry->handler = handler;
-    entry->next = protocols;
-    protocols = entry;
+    protocols[type] = entry;
     infof("registered, type=%s(0x%02x)", entry->name, entry->type);
     return 0;
 }
@@ -477,20 +2123,30 @@ ip_protocol_name(uint8_t type)
 {
     struct ip_protocol *entry;
 
-    for (entry = protocols; entry; entry = entry->next) {
-        if (entry->type == type) {
-            return entry->name;
-        }
+    entry = protocols[type];
+    if (!entry) {
+        return "UNKNOWN";
     }
-    return "UNKNOWN";
+    return entry->name;
 }
 
 int
 ip_init(void)
 {
+    struct timeval interval = {1, 0};
+
     if (net_protocol_register("IP", NET_PROTOCOL_TYPE_IP, ip_input) == -1) {
         errorf("net_protocol_register() failure");
         return -1;
     }
+    net_protocol_set_classifier(NET_PROTOCOL_TYPE_IP, ip_classify);
+    if (net_timer_register("IP Reassembly Timer", interval, ip_reasm_timer) == -1) {
+        errorf("net_timer_register() failure");
+        return -1;
+    }
+    if (net_timer_register("IP PMTU Timer", interval, ip_pmtu_timer) == -1) {
+        errorf("net_timer_register() failure");
+        return -1;
+    }
     return 0;
 }
@@ -22,11 +22,18 @@
 
 /* see https://www.iana.org/assignments/protocol-numbers/protocol-numbers.txt */
 #define IP_PROTOCOL_ICMP 0x01
+#define IP_PROTOCOL_IGMP 0x02
 #define IP_PROTOCOL_TCP  0x06
 #define IP_PROTOCOL_UDP  0x11
 
+#define IP_OPTION_ROUTER_ALERT 0x94 /* rfc2113, copied flag set */
+
+#define IP_TOS_INTERNETWORK_CONTROL 0xc0 /* rfc791, precedence 6 */
+
 typedef uint32_t ip_addr_t;
 
+#define IP_ADDR_IS_MULTICAST(x) ((ntoh32(x) & 0xf0000000) == 0xe0000000) /* 224.0.0.0/4 */
+
 struct ip_endpoint {
     ip_addr_t addr;
     uint16_t port;
@@ -40,6 +47,44 @@ struct ip_iface {
     ip_addr_t broadcast;
 };
 
+/*
+ * NOTE: the result of the route lookup and the address resolution for the last destination,
+ *       kept by the PCB. It is checked against the generations of the routes and the ARP
+ *       cache, a zero-filled one is invalid.
+ */
+struct ip_dst_cache {
+    unsigned int route_gen;
+    unsigned int neigh_gen;
+    uint32_t hash; /* flow hash, picks the path of a multipath route */
+    ip_addr_t src;
+    ip_addr_t dst;
+    struct ip_iface *iface;
+    ip_addr_t nexthop;
+    int resolved; /* hwaddr holds the link address of the nexthop */
+    unsigned int pmtu_gen;
+    uint16_t mtu; /* of the path, see ip_dst_cache_mtu() */
+    uint16_t dev_mtu; /* of the device when the mtu was taken */
+    uint8_t hwaddr[NET_DEVICE_ADDR_LEN];
+};
+
+struct ip_forward_stats {
+    uint64_t forwarded;
+    uint64_t ttl_exceeded;
+    uint64_t no_route;
+    uint64_t fragmented; /* forwarded in fragments */
+    uint64_t segmented; /* TCP super-segment forwarded in MSS sized segments */
+    uint64_t too_big; /* larger than the MTU of the output device with DF set */
+    uint64_t dropped; /* martian, directed broadcast, unresolved nexthop or device failure */
+};
+
+struct ip_reasm_stats {
+    uint64_t fragments; /* received for reassembly */
+    uint64_t reassembled;
+    uint64_t timeouts;
+    uint64_t evicted; /* dropped to stay under the memory limit */
+    uint64_t malformed; /* overlapping or inconsistent */
+};
+
 extern const ip_addr_t IP_ADDR_ANY;
 extern const ip_addr_t IP_ADDR_BROADCAST;
 
@@ -54,6 +99,12 @@ ip_endpoint_ntop(const struct ip_endpoint *n, char *p, size_t size);
 
 extern int
 ip_route_set_default_gateway(struct ip_iface *iface, const char *gateway);
+extern int
+ip_route_register(const char *network, const char *netmask, const char *nexthop, struct ip_iface *iface);
+extern int
+ip_route_unregister(const char *network, const char *netmask);
+extern uint32_t
+ip_route_hash(uint8_t protocol, ip_addr_t src, ip_addr_t dst, uint16_t sport, uint16_t dport);
 extern struct ip_iface *
 ip_route_get_iface(ip_addr_t dst);
 
@@ -65,10 +116,49 @@ extern struct ip_iface *
 ip_iface_select(ip_addr_t addr);
 
 extern ssize_t
-ip_output(uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst);
+ip_output(uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, int flags);
+extern ssize_t
+ip_output_iov(uint8_t protocol, const struct iovec *iov, int iovcnt, ip_addr_t src, ip_addr_t dst, int flags);
+extern ssize_t
+ip_output_iface(struct ip_iface *iface, uint8_t protocol, uint8_t tos, const uint8_t *options, size_t optlen, const uint8_t *data, size_t len, ip_addr_t dst, int flags);
+extern void
+ip_dst_cache_set_flow(struct ip_dst_cache *cache, uint8_t protocol, const struct ip_endpoint *local, const struct ip_endpoint *foreign);
+extern struct ip_iface *
+ip_dst_cache_check(struct ip_dst_cache *cache, ip_addr_t dst);
+extern uint16_t
+ip_dst_cache_mtu(struct ip_dst_cache *cache);
+extern ssize_t
+ip_output_cache(struct ip_dst_cache *cache, uint8_t protocol, const struct iovec *iov, int iovcnt, ip_addr_t src, ip_addr_t dst, int flags);
+extern int
+ip_dst_cache_flush(struct ip_dst_cache *cache);
+
+extern void
+ip_set_forwarding(int enable);
+extern int
+ip_get_forwarding(void);
+extern void
+ip_forward_get_stats(struct ip_forward_stats *stats);
+
+extern uint16_t
+ip_pmtu_get(ip_addr_t dst, uint16_t mtu);
+extern int
+ip_pmtu_update(ip_addr_t dst, uint16_t mtu);
+extern uint16_t
+ip_pmtu_plateau(uint16_t mtu);
+extern void
+ip_set_pmtu_discovery(int enable);
+
+extern void
+ip_reasm_get_stats(struct ip_reasm_stats *stats);
+
+extern int
+ip_flow_insert(uint8_t protocol, const struct ip_endpoint *local, const struct ip_endpoint *foreign,
+    void (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface, int flags, void *arg), void *arg);
+extern void
+ip_flow_remove(void *arg);
 
 extern int
-ip_protocol_register(const char *name, uint8_t type, void (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface));
+ip_protocol_register(const char *name, uint8_t type, void (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface, int flags));
 extern char *
 ip_protocol_name(uint8_t type);
 
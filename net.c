@@ -4,24 +4,61 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/time.h>
 
 #include "platform.h"
 
 #include "util.h"
 #include "net.h"
+#include "qdisc.h"
+
+#define NET_PROTOCOL_HASH_SIZE 16 /* must be a power of 2 */
+#define NET_PROTOCOL_BATCH_SIZE 32 /* packets dispatched per lock of the input queue */
+
+#define NET_PROTOCOL_HASH(x) (((x) ^ ((x) >> 8)) & (NET_PROTOCOL_HASH_SIZE - 1))
+
+#define NET_INPUT_RED_WEIGHT 9 /* the average follows the queue length with the weight of 1/2^9 */
+#define NET_INPUT_RED_MAX_P 100000 /* drop probability at the max threshold (ppm) */
+
+#define NET_INPUT_CODEL_TARGET   5000000 /* 5ms (nsec) */
+#define NET_INPUT_CODEL_INTERVAL 100000000 /* 100ms (nsec) */
+
+#define NET_INPUT_BAND_BUDGET 8 /* batches of the higher bands before a waiting lower band gets one */
 
 struct net_protocol {
     struct net_protocol *next;
+    struct net_protocol *hnext; /* next entry in the same bucket of the dispatch table */
     char name[16];
     uint16_t type;
-    struct queue_head queue; /* input queue */
-    void (*handler)(const uint8_t *data, size_t len, struct net_device *dev);
+    mutex_t mutex; /* protects the input queue, drivers may push from their own threads */
+    struct queue_head queue[NET_INPUT_BANDS]; /* input queue of each priority band */
+    unsigned int num; /* packets in all the bands */
+    int (*classifier)(const uint8_t *data, size_t len);
+    int aqm;
+    unsigned int limit; /* packets */
+    struct net_input_stats stats;
+    union {
+        struct {
+            uint32_t avg; /* average queue length, scaled by 2^NET_INPUT_RED_WEIGHT */
+            uint32_t count; /* packets admitted since the last drop */
+        } red;
+        struct {
+            uint64_t first_above_time;
+            uint64_t drop_next;
+            uint32_t count;
+            uint32_t lastcount;
+            int dropping;
+        } codel; /* NOTE: applied to the data band only */
+    };
+    void (*handler)(const uint8_t *data, size_t len, struct net_device *dev, int flags);
 };
 
 /* NOTE: the data follows immediately after the structure */
 struct net_protocol_queue_entry {
     struct net_device *dev;
+    int flags;
+    uint64_t tstamp; /* enqueued time (nsec) */
     size_t len;
 };
 
@@ -42,9 +79,24 @@ struct net_event {
 /* NOTE: if you want to add/delete the entries after net_run(), you need to protect these lists with a mutex. */
 static struct net_device *devices;
 static struct net_protocol *protocols;
+static struct net_protocol *protocol_table[NET_PROTOCOL_HASH_SIZE]; /* dispatch table hashed by the type */
+static unsigned int pending[NET_INPUT_BANDS]; /* packets in each band of all the protocols */
 static struct net_timer *timers;
 static struct net_event *events;
 
+static struct net_protocol *
+net_protocol_lookup(uint16_t type)
+{
+    struct net_protocol *proto;
+
+    for (proto = protocol_table[NET_PROTOCOL_HASH(type)]; proto; proto = proto->hnext) {
+        if (proto->type == type) {
+            return proto;
+        }
+    }
+    return NULL;
+}
+
 struct net_device *
 net_device_alloc(void (*setup)(struct net_device *dev))
 {
@@ -69,6 +121,7 @@ net_device_register(struct net_device *dev)
 
     dev->index = index++;
     snprintf(dev->name, sizeof(dev->name), "net%d", dev->index);
+    dev->features = dev->hw_features; /* enable all offloads by default */
     dev->next = devices;
     devices = dev;
     infof("registered, dev=%s, type=0x%04x", dev->name, dev->type);
@@ -126,6 +179,11 @@ net_device_add_iface(struct net_device *dev, struct net_iface *iface)
     iface->next = dev->ifaces;
     iface->dev = dev;
     dev->ifaces = iface;
+    if (NET_DEVICE_IS_UP(dev) && dev->ops->set_filter) {
+        if (dev->ops->set_filter(dev) == -1) {
+            warnf("set_filter() failure, dev=%s", dev->name);
+        }
+    }
     return 0;
 }
 
@@ -143,19 +201,131 @@ net_device_get_iface(struct net_device *dev, int family)
 }
 
 int
-net_device_output(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst)
+net_device_set_mtu(struct net_device *dev, uint16_t mtu)
 {
+    if (!dev->ops->set_mtu) {
+        errorf("not supported, dev=%s", dev->name);
+        return -1;
+    }
+    if (dev->ops->set_mtu(dev, mtu) == -1) {
+        errorf("failure, dev=%s, mtu=%u", dev->name, mtu);
+        return -1;
+    }
+    infof("dev=%s, mtu=%u => %u", dev->name, dev->mtu, mtu);
+    __atomic_store_n(&dev->mtu, mtu, __ATOMIC_RELAXED); /* NOTE: read by ip_dst_cache_mtu() without a lock */
+    return 0;
+}
+
+int
+net_device_set_features(struct net_device *dev, uint16_t features)
+{
+    if (features & ~dev->hw_features) {
+        errorf("not supported, dev=%s, features=0x%04x, hw_features=0x%04x", dev->name, features, dev->hw_features);
+        return -1;
+    }
+    if ((features & NET_DEVICE_FEATURE_TSO) && !(features & NET_DEVICE_FEATURE_TX_CSUM)) {
+        errorf("TSO requires TX_CSUM, dev=%s", dev->name);
+        return -1;
+    }
+    if (dev->ops->set_features) {
+        if (dev->ops->set_features(dev, features) == -1) {
+            errorf("failure, dev=%s, features=0x%04x", dev->name, features);
+            return -1;
+        }
+    }
+    infof("dev=%s, features=0x%04x => 0x%04x", dev->name, dev->features, features);
+    dev->features = features;
+    return 0;
+}
+
+/* NOTE: bounds the packets of the device waiting in the input queues, 0 means unlimited */
+int
+net_device_set_input_limit(struct net_device *dev, unsigned int limit)
+{
+    infof("dev=%s, input_limit=%u => %u", dev->name, dev->input_limit, limit);
+    dev->input_limit = limit;
+    return 0;
+}
+
+int
+net_device_output(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst, int flags)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *)data;
+    iov.iov_len = len;
+    return net_device_output_iov(dev, type, &iov, 1, dst, flags);
+}
+
+int
+net_device_output_iov(struct net_device *dev, uint16_t type, const struct iovec *iov, int iovcnt, const void *dst, int flags)
+{
+    size_t len;
+    int i;
+
     if (!NET_DEVICE_IS_UP(dev)) {
         errorf("not opened, dev=%s", dev->name);
         return -1;
     }
-    if (len > dev->mtu) {
+    len = iovec_len(iov, iovcnt);
+    if (len > dev->mtu && !((flags & NET_PACKET_FLAG_GSO) && (dev->features & NET_DEVICE_FEATURE_TSO))) {
         errorf("too long, dev=%s, mtu=%u, len=%zu", dev->name, dev->mtu, len);
         return -1;
     }
-    debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, net_protocol_name(type), type, len);
-    debugdump(data, len);
-    if (dev->ops->transmit(dev, type, data, len, dst) == -1) {
+    debugf("dev=%s, type=%s(0x%04x), len=%zu, iovcnt=%d", dev->name, net_protocol_name(type), type, len, iovcnt);
+    for (i = 0; i < iovcnt; i++) {
+        debugdump(iov[i].iov_base, iov[i].iov_len);
+    }
+    if (dev->qdisc) {
+        if (qdisc_enqueue(dev, type, iov, iovcnt, dst, flags) == -1) {
+            errorf("qdisc_enqueue() failure, dev=%s, len=%zu", dev->name, len);
+            return -1;
+        }
+        return 0;
+    }
+    return net_device_transmit(dev, type, iov, iovcnt, dst, flags);
+}
+
+int
+net_device_flush(struct net_device *dev)
+{
+    if (!NET_DEVICE_IS_UP(dev)) {
+        errorf("not opened, dev=%s", dev->name);
+        return -1;
+    }
+    if (!dev->ops->flush) {
+        return 0;
+    }
+    if (dev->ops->flush(dev) == -1) {
+        errorf("device flush failure, dev=%s", dev->name);
+        return -1;
+    }
+    return 0;
+}
+
+/* NOTE: hands the packet to the driver, bypassing the qdisc */
+int
+net_device_transmit(struct net_device *dev, uint16_t type, const struct iovec *iov, int iovcnt, const void *dst, int flags)
+{
+    uint8_t buf[NET_DEVICE_GSO_SIZE_MAX];
+    size_t len;
+    int ret;
+
+    len = iovec_len(iov, iovcnt);
+    if (dev->ops->transmit_iov && (dev->features & NET_DEVICE_FEATURE_SG)) {
+        ret = dev->ops->transmit_iov(dev, type, iov, iovcnt, dst, flags);
+    } else if (iovcnt == 1) {
+        ret = dev->ops->transmit(dev, type, iov[0].iov_base, len, dst, flags);
+    } else {
+        /* the device takes only a contiguous buffer */
+        if (len > sizeof(buf)) {
+            errorf("too long, dev=%s, len=%zu", dev->name, len);
+            return -1;
+        }
+        iovec_copy(buf, sizeof(buf), iov, iovcnt);
+        ret = dev->ops->transmit(dev, type, buf, len, dst, flags);
+    }
+    if (ret == -1) {
         errorf("device transmit failure, dev=%s, len=%zu", dev->name, len);
         return -1;
     }
@@ -163,47 +333,263 @@ net_device_output(struct net_device *dev, uint16_t type, const uint8_t *data, si
 }
 
 int
-net_input_handler(uint16_t type, const uint8_t *data, size_t len, struct net_device *dev)
+net_input_handler(uint16_t type, const uint8_t *data, size_t len, struct net_device *dev, int flags)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *)data;
+    iov.iov_len = len;
+    return net_input_handler_iov(type, &iov, 1, dev, flags);
+}
+
+/*
+ * Input Queue Management
+ *
+ * NOTE: the input queue of each protocol is bounded. Tail-drop and RED decide on the
+ *       arrival, CoDel decides on the departure by the time spent in the queue. The device
+ *       can also limit the packets it has in the queues of all the protocols.
+ * NOTE: these functions must be called after proto->mutex locked
+ */
+
+static uint64_t
+net_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* NOTE: returns 1 to admit the arrival, 0 to drop it */
+static int
+net_input_admit(struct net_protocol *proto, int band)
+{
+    unsigned int num, min_th, max_th, avg;
+    uint64_t pb, pa;
+
+    num = proto->num;
+    if (num >= proto->limit) {
+        proto->stats.drops_limit++;
+        return 0;
+    }
+    if (proto->aqm != NET_INPUT_AQM_RED || band != NET_INPUT_BAND_DATA) {
+        /* NOTE: the control traffic is small, dropping it early gains nothing */
+        return 1;
+    }
+    proto->red.avg += num - (proto->red.avg >> NET_INPUT_RED_WEIGHT);
+    avg = proto->red.avg >> NET_INPUT_RED_WEIGHT;
+    min_th = proto->limit / 4;
+    max_th = proto->limit * 3 / 4;
+    if (avg < min_th) {
+        proto->red.count = 0;
+        return 1;
+    }
+    if (avg >= max_th) {
+        proto->red.count = 0;
+        proto->stats.drops_aqm++;
+        return 0;
+    }
+    /* spread the drops evenly, pa = pb / (1 - count * pb) */
+    pb = (uint64_t)NET_INPUT_RED_MAX_P * (avg - min_th) / (max_th - min_th);
+    if (pb * proto->red.count < 1000000) {
+        pa = pb * 1000000 / (1000000 - pb * proto->red.count);
+        if ((uint64_t)(random() % 1000000) >= pa) {
+            proto->red.count++;
+            return 1;
+        }
+    }
+    proto->red.count = 0;
+    proto->stats.drops_aqm++;
+    return 0;
+}
+
+static uint64_t
+net_input_isqrt(uint64_t x)
+{
+    uint64_t r, prev;
+
+    if (x < 2) {
+        return x;
+    }
+    r = x;
+    do {
+        prev = r;
+        r = (r + x / r) / 2;
+    } while (r < prev);
+    return prev;
+}
+
+static uint64_t
+net_input_codel_control_law(uint64_t t, uint32_t count)
+{
+    /* t + interval / sqrt(count), scaled by 2^8 to keep the precision */
+    return t + ((uint64_t)NET_INPUT_CODEL_INTERVAL << 8) / net_input_isqrt((uint64_t)count << 16);
+}
+
+static void
+net_input_drop(struct net_protocol *proto, struct net_protocol_queue_entry *entry)
+{
+    proto->stats.drops_aqm++;
+    __atomic_sub_fetch(&entry->dev->input_backlog, 1, __ATOMIC_RELAXED);
+    memory_free(entry);
+}
+
+static struct net_protocol_queue_entry *
+net_input_pop(struct net_protocol *proto, int band, uint64_t now, int *ok_to_drop)
 {
-    struct net_protocol *proto;
     struct net_protocol_queue_entry *entry;
+    uint64_t sojourn;
+
+    *ok_to_drop = 0;
+    entry = queue_pop(&proto->queue[band]);
+    if (!entry) {
+        if (proto->aqm == NET_INPUT_AQM_CODEL && band == NET_INPUT_BAND_DATA) {
+            /* NOTE: the state shares the storage with the one of RED */
+            proto->codel.first_above_time = 0;
+        }
+        return NULL;
+    }
+    proto->num--;
+    __atomic_sub_fetch(&pending[band], 1, __ATOMIC_RELAXED);
+    sojourn = now - entry->tstamp;
+    if (proto->aqm != NET_INPUT_AQM_CODEL || band != NET_INPUT_BAND_DATA) {
+        return entry;
+    }
+    if (sojourn < NET_INPUT_CODEL_TARGET || !proto->queue[band].num) {
+        proto->codel.first_above_time = 0;
+    } else if (!proto->codel.first_above_time) {
+        proto->codel.first_above_time = now + NET_INPUT_CODEL_INTERVAL;
+    } else if (now >= proto->codel.first_above_time) {
+        *ok_to_drop = 1;
+    }
+    return entry;
+}
 
-    for (proto = protocols; proto; proto = proto->next) {
-        if (proto->type == type) {
-            entry = memory_alloc(sizeof(*entry) + len);
+/* NOTE: RFC 8289, only drops since the packets are already on this host */
+static struct net_protocol_queue_entry *
+net_input_dequeue(struct net_protocol *proto, int band, uint64_t now)
+{
+    struct net_protocol_queue_entry *entry;
+    uint32_t delta;
+    int drop;
+
+    entry = net_input_pop(proto, band, now, &drop);
+    if (!entry || proto->aqm != NET_INPUT_AQM_CODEL || band != NET_INPUT_BAND_DATA) {
+        return entry;
+    }
+    if (proto->codel.dropping) {
+        if (!drop) {
+            proto->codel.dropping = 0;
+            return entry;
+        }
+        while (proto->codel.dropping && now >= proto->codel.drop_next) {
+            proto->codel.count++;
+            net_input_drop(proto, entry);
+            entry = net_input_pop(proto, band, now, &drop);
             if (!entry) {
-                errorf("memory_alloc() failure");
-                return -1;
+                proto->codel.dropping = 0;
+                return NULL;
             }
-            entry->dev = dev;
-            entry->len = len;
-            memcpy(entry+1, data, len);
-            if (!queue_push(&proto->queue, entry)) {
-                errorf("queue_push() failure");
-                memory_free(entry);
-                return -1;
+            if (!drop) {
+                proto->codel.dropping = 0;
+            } else {
+                proto->codel.drop_next = net_input_codel_control_law(proto->codel.drop_next, proto->codel.count);
             }
-            debugf("queue pushed (num:%u), dev=%s, type=%s(0x%04x), len=%zd", proto->queue.num, dev->name, proto->name, type, len);
-            debugdump(data, len);
-            raise_softirq();
-            return 0;
         }
+    } else if (drop) {
+        net_input_drop(proto, entry);
+        entry = net_input_pop(proto, band, now, &drop);
+        proto->codel.dropping = 1;
+        delta = proto->codel.count - proto->codel.lastcount;
+        if (delta > 1 && now - proto->codel.drop_next < 16 * (uint64_t)NET_INPUT_CODEL_INTERVAL) {
+            proto->codel.count = delta;
+        } else {
+            proto->codel.count = 1;
+        }
+        proto->codel.drop_next = net_input_codel_control_law(now, proto->codel.count);
+        proto->codel.lastcount = proto->codel.count;
+    }
+    return entry;
+}
+
+int
+net_input_handler_iov(uint16_t type, const struct iovec *iov, int iovcnt, struct net_device *dev, int flags)
+{
+    struct net_protocol *proto;
+    struct net_protocol_queue_entry *entry;
+    size_t len;
+    unsigned int num;
+    int band = NET_INPUT_BAND_DATA, admit, i;
+
+    if (dev->features & NET_DEVICE_FEATURE_RX_CSUM) {
+        flags |= (NET_PACKET_FLAG_CSUM_VALID | NET_PACKET_FLAG_IP_CSUM_VALID);
+    }
+    proto = net_protocol_lookup(type);
+    if (!proto) {
+        /* unsupported protocol */
+        return 0;
+    }
+    if (dev->input_limit && __atomic_load_n(&dev->input_backlog, __ATOMIC_RELAXED) >= dev->input_limit) {
+        __atomic_add_fetch(&dev->input_drops, 1, __ATOMIC_RELAXED);
+        debugf("dropped by the device limit, dev=%s, type=%s(0x%04x)", dev->name, proto->name, type);
+        return 0;
+    }
+    if (proto->classifier) {
+        /* NOTE: only looks at the first fragment, a header split over fragments is treated as data */
+        band = proto->classifier(iov[0].iov_base, iov[0].iov_len);
+        if (band < 0 || band >= NET_INPUT_BANDS) {
+            band = NET_INPUT_BAND_DATA;
+        }
+    }
+    /* NOTE: decide before the copy, a dropped packet should cost as little as possible */
+    mutex_lock(&proto->mutex);
+    admit = net_input_admit(proto, band);
+    mutex_unlock(&proto->mutex);
+    if (!admit) {
+        debugf("dropped, dev=%s, type=%s(0x%04x)", dev->name, proto->name, type);
+        return 0;
+    }
+    len = iovec_len(iov, iovcnt);
+    entry = memory_alloc(sizeof(*entry) + len);
+    if (!entry) {
+        errorf("memory_alloc() failure");
+        return -1;
     }
-    /* unsupported protocol */
+    entry->dev = dev;
+    entry->flags = flags;
+    entry->tstamp = net_now();
+    entry->len = len;
+    iovec_copy((uint8_t *)(entry+1), len, iov, iovcnt);
+    mutex_lock(&proto->mutex);
+    if (!queue_push(&proto->queue[band], entry)) {
+        mutex_unlock(&proto->mutex);
+        errorf("queue_push() failure");
+        memory_free(entry);
+        return -1;
+    }
+    num = ++proto->num;
+    proto->stats.enqueued++;
+    mutex_unlock(&proto->mutex);
+    __atomic_add_fetch(&dev->input_backlog, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pending[band], 1, __ATOMIC_RELAXED);
+    debugf("queue pushed (num:%u), dev=%s, type=%s(0x%04x), band=%d, len=%zd", num, dev->name, proto->name, type, band, len);
+    for (i = 0; i < iovcnt; i++) {
+        debugdump(iov[i].iov_base, iov[i].iov_len);
+    }
+    raise_softirq();
     return 0;
 }
 
 /* NOTE: must not be call after net_run() */
 int
-net_protocol_register(const char *name, uint16_t type, void (*handler)(const uint8_t *data, size_t len, struct net_device *dev))
+net_protocol_register(const char *name, uint16_t type, void (*handler)(const uint8_t *data, size_t len, struct net_device *dev, int flags))
 {
     struct net_protocol *proto;
 
-    for (proto = protocols; proto; proto = proto->next) {
-        if (type == proto->type) {
-            errorf("already registered, type=%s(0x%04x), exist=%s(0x%04x)", name, type, proto->name, proto->type);
-            return -1;
-        }
+    proto = net_protocol_lookup(type);
+    if (proto) {
+        errorf("already registered, type=%s(0x%04x), exist=%s(0x%04x)", name, type, proto->name, proto->type);
+        return -1;
     }
     proto = memory_alloc(sizeof(*proto));
     if (!proto) {
@@ -212,44 +598,184 @@ net_protocol_register(const char *name, uint16_t type, void (*handler)(const uin
     }
     strncpy(proto->name, name, sizeof(proto->name)-1);
     proto->type = type;
+    mutex_init(&proto->mutex);
+    proto->aqm = NET_INPUT_AQM_TAILDROP;
+    proto->limit = NET_INPUT_QUEUE_LIMIT_DEFAULT;
     proto->handler = handler;
     proto->next = protocols;
     protocols = proto;
+    proto->hnext = protocol_table[NET_PROTOCOL_HASH(type)];
+    protocol_table[NET_PROTOCOL_HASH(type)] = proto;
     infof("registered, type=%s(0x%04x)", proto->name, type);
     return 0;
 }
 
+int
+net_protocol_set_queue(uint16_t type, int aqm, unsigned int limit)
+{
+    struct net_protocol *proto;
+
+    if (aqm != NET_INPUT_AQM_TAILDROP && aqm != NET_INPUT_AQM_RED && aqm != NET_INPUT_AQM_CODEL) {
+        errorf("unknown aqm, aqm=%d", aqm);
+        return -1;
+    }
+    proto = net_protocol_lookup(type);
+    if (!proto) {
+        errorf("not registered, type=0x%04x", type);
+        return -1;
+    }
+    mutex_lock(&proto->mutex);
+    proto->aqm = aqm;
+    proto->limit = limit ? limit : NET_INPUT_QUEUE_LIMIT_DEFAULT;
+    memset(&proto->codel, 0, sizeof(proto->codel));
+    memset(&proto->red, 0, sizeof(proto->red));
+    mutex_unlock(&proto->mutex);
+    infof("type=%s(0x%04x), aqm=%d, limit=%u", proto->name, type, aqm, proto->limit);
+    return 0;
+}
+
+int
+net_protocol_get_stats(uint16_t type, struct net_input_stats *stats)
+{
+    struct net_protocol *proto;
+
+    proto = net_protocol_lookup(type);
+    if (!proto) {
+        errorf("not registered, type=0x%04x", type);
+        return -1;
+    }
+    mutex_lock(&proto->mutex);
+    *stats = proto->stats;
+    stats->backlog = proto->num;
+    mutex_unlock(&proto->mutex);
+    return 0;
+}
+
+/* NOTE: must not be call after net_run(), the packets of a protocol without a classifier are data */
+int
+net_protocol_set_classifier(uint16_t type, int (*classifier)(const uint8_t *data, size_t len))
+{
+    struct net_protocol *proto;
+
+    proto = net_protocol_lookup(type);
+    if (!proto) {
+        errorf("not registered, type=0x%04x", type);
+        return -1;
+    }
+    proto->classifier = classifier;
+    return 0;
+}
+
 char *
 net_protocol_name(uint16_t type)
 {
     struct net_protocol *entry;
 
+    entry = net_protocol_lookup(type);
+    if (!entry) {
+        return "UNKNOWN";
+    }
+    return entry->name;
+}
+
+/* NOTE: returns the number of the registered protocols, stores at most size of their types */
+int
+net_protocol_types(uint16_t *types, int size)
+{
+    struct net_protocol *entry;
+    int num = 0;
+
     for (entry = protocols; entry; entry = entry->next) {
-        if (entry->type == type) {
-            return entry->name;
+        if (num < size) {
+            types[num] = entry->type;
         }
+        num++;
     }
-    return "UNKNOWN";
+    return num;
 }
 
+static void
+net_protocol_run_batch(struct net_protocol *proto, int band)
+{
+    struct net_protocol_queue_entry *entries[NET_PROTOCOL_BATCH_SIZE], *entry;
+    unsigned int num;
+    uint64_t now, sojourn;
+    int count, i;
+
+    now = net_now();
+    mutex_lock(&proto->mutex);
+    for (count = 0; count < NET_PROTOCOL_BATCH_SIZE; count++) {
+        entries[count] = net_input_dequeue(proto, band, now);
+        if (!entries[count]) {
+            break;
+        }
+        sojourn = (now - entries[count]->tstamp) / 1000;
+        proto->stats.dequeued++;
+        proto->stats.sojourn_total += sojourn;
+        if (sojourn > proto->stats.sojourn_max) {
+            proto->stats.sojourn_max = sojourn;
+        }
+    }
+    num = proto->queue[band].num;
+    mutex_unlock(&proto->mutex);
+    for (i = 0; i < count; i++) {
+        entry = entries[i];
+        if (i + 1 < count) {
+            /* NOTE: warm up the headers of the next packet while this one is processed */
+            __builtin_prefetch(entries[i+1] + 1);
+        }
+        debugf("queue popped (num:%u), dev=%s, type=0x%04x, band=%d, len=%zd", num + count - i - 1, entry->dev->name, proto->type, band, entry->len);
+        debugdump((uint8_t *)(entry+1), entry->len);
+        __atomic_sub_fetch(&entry->dev->input_backlog, 1, __ATOMIC_RELAXED);
+        proto->handler((uint8_t *)(entry+1), entry->len, entry->dev, entry->flags);
+        free(entry);
+    }
+}
+
+/*
+ * NOTE: the packets are taken out of the input queue in batches and handed to the handler
+ *       back to back, so the handler stays in the cache across the batch and the queue
+ *       is locked once per batch. The highest band with packets is served first, the
+ *       protocols take turns batch by batch within the band. A lower band which has been
+ *       waiting for NET_INPUT_BAND_BUDGET batches gets one, so it is never starved.
+ */
 int
 net_protocol_handler(void)
 {
     struct net_protocol *proto;
-    struct net_protocol_queue_entry *entry;
-    unsigned int num;
+    struct net_device *dev;
+    int band, lower, waited = 0;
 
-    for (proto = protocols; proto; proto = proto->next) {
-        while (1) {
-            entry = queue_pop(&proto->queue);
-            if (!entry) {
+    while (1) {
+        for (band = 0; band < NET_INPUT_BANDS; band++) {
+            if (__atomic_load_n(&pending[band], __ATOMIC_RELAXED)) {
                 break;
             }
-            num = proto->queue.num;
-            debugf("queue popped (num:%u), dev=%s, type=0x%04x, len=%zd", num, entry->dev->name, proto->type, entry->len);
-            debugdump((uint8_t *)(entry+1), entry->len);
-            proto->handler((uint8_t *)(entry+1), entry->len, entry->dev);
-            free(entry);
+        }
+        if (band == NET_INPUT_BANDS) {
+            break;
+        }
+        for (lower = band + 1; lower < NET_INPUT_BANDS; lower++) {
+            if (__atomic_load_n(&pending[lower], __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+        if (lower < NET_INPUT_BANDS) {
+            if (++waited > NET_INPUT_BAND_BUDGET) {
+                band = lower;
+                waited = 0;
+            }
+        } else {
+            waited = 0;
+        }
+        for (proto = protocols; proto; proto = proto->next) {
+            net_protocol_run_batch(proto, band);
+        }
+        /* NOTE: push out what the handlers sent with NET_PACKET_FLAG_MORE (e.g. forwarded packets) */
+        for (dev = devices; dev; dev = dev->next) {
+            if (NET_DEVICE_IS_UP(dev) && dev->ops->flush) {
+                net_device_flush(dev);
+            }
         }
     }
     return 0;
@@ -361,6 +887,7 @@ net_shutdown(void)
 #include "arp.h"
 #include "ip.h"
 #include "icmp.h"
+#include "igmp.h"
 #include "udp.h"
 #include "tcp.h"
 
@@ -383,6 +910,10 @@ net_init(void)
         errorf("icmp_init() failure");
         return -1;
     }
+    if (igmp_init() == -1) {
+        errorf("igmp_init() failure");
+        return -1;
+    }
     if (udp_init() == -1) {
         errorf("udp_init() failure");
         return -1;
@@ -4,6 +4,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <signal.h>
 
 #ifndef IFNAMSIZ
@@ -13,6 +14,7 @@
 #define NET_DEVICE_TYPE_NULL      0x0000
 #define NET_DEVICE_TYPE_LOOPBACK  0x0001
 #define NET_DEVICE_TYPE_ETHERNET  0x0002
+#define NET_DEVICE_TYPE_TUN       0x0003
 
 #define NET_DEVICE_FLAG_UP        0x0001
 #define NET_DEVICE_FLAG_LOOPBACK  0x0010
@@ -20,8 +22,20 @@
 #define NET_DEVICE_FLAG_P2P       0x0040
 #define NET_DEVICE_FLAG_NEED_ARP  0x0100
 
+#define NET_DEVICE_FEATURE_TX_CSUM 0x0001 /* computes the TCP/UDP checksum on transmit */
+#define NET_DEVICE_FEATURE_TSO     0x0002 /* splits TCP super-segments into MTU sized segments */
+#define NET_DEVICE_FEATURE_RX_CSUM 0x0004 /* verifies the IP header and TCP/UDP/ICMP checksums of every received packet */
+#define NET_DEVICE_FEATURE_SG      0x0008 /* transmits a packet scattered over multiple buffers */
+#define NET_DEVICE_FEATURE_IP_CSUM 0x0010 /* computes the IP header checksum on transmit */
+
 #define NET_DEVICE_ADDR_LEN 16
 
+#define NET_DEVICE_GSO_SIZE_MAX UINT16_MAX /* maximum size of TCP super-segment (IP datagram) */
+
+#define NET_IOV_MAX 8 /* maximum number of fragments passed to net_device_output_iov() */
+
+#define NET_DEVICE_MCAST_HASH_SIZE 64 /* bits of the multicast filter of the device */
+
 #define NET_DEVICE_IS_UP(x) ((x)->flags & NET_DEVICE_FLAG_UP)
 #define NET_DEVICE_STATE(x) (NET_DEVICE_IS_UP(x) ? "up" : "down")
 
@@ -37,7 +51,27 @@
 
 #define NET_IRQ_SHARED 0x0001
 
+/* NOTE: management of the input queue of each protocol */
+#define NET_INPUT_AQM_TAILDROP 0 /* drops the arrivals while the queue is full */
+#define NET_INPUT_AQM_RED      1 /* drops the arrivals early by the average queue length */
+#define NET_INPUT_AQM_CODEL    2 /* drops at the head by the time spent in the queue */
+
+#define NET_INPUT_QUEUE_LIMIT_DEFAULT 1024 /* packets */
+
+/* NOTE: priority bands of the input queue, the lower value is processed first */
+#define NET_INPUT_BAND_CONTROL 0 /* ARP, TCP SYN without ACK */
+#define NET_INPUT_BAND_DATA    1 /* the rest, a flow is never split across the bands */
+#define NET_INPUT_BANDS        2
+
+/* NOTE: per-packet flags, carried between the device drivers and the protocols */
+#define NET_PACKET_FLAG_CSUM_VALID    0x0001 /* RX: the TCP/UDP checksum has already been verified */
+#define NET_PACKET_FLAG_CSUM_PARTIAL  0x0002 /* the TCP/UDP checksum field holds only the pseudo header sum */
+#define NET_PACKET_FLAG_GSO           0x0004 /* TCP segment which may be larger than the MTU */
+#define NET_PACKET_FLAG_MORE          0x0008 /* TX: more packets follow, the driver may hold it until flush() */
+#define NET_PACKET_FLAG_IP_CSUM_VALID 0x0010 /* RX: the IP header checksum has already been verified */
+
 struct net_device; /* forward declaration */
+struct qdisc; /* forward declaration */
 
 struct net_iface {
     struct net_iface *next;
@@ -49,8 +83,13 @@ struct net_iface {
 struct net_device_ops {
     int (*open)(struct net_device *dev);
     int (*close)(struct net_device *dev);
-    int (*transmit)(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst);
+    int (*transmit)(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst, int flags);
+    int (*transmit_iov)(struct net_device *dev, uint16_t type, const struct iovec *iov, int iovcnt, const void *dst, int flags); /* optional, requires NET_DEVICE_FEATURE_SG */
+    int (*flush)(struct net_device *dev); /* optional, pushes out the packets held by NET_PACKET_FLAG_MORE */
     int (*poll)(struct net_device *dev);
+    int (*set_filter)(struct net_device *dev); /* called when the interfaces or the multicast filter of the device change */
+    int (*set_mtu)(struct net_device *dev, uint16_t mtu); /* validates and applies it to the device */
+    int (*set_features)(struct net_device *dev, uint16_t features); /* optional, applies them to the device */
 };
 
 struct net_device {
@@ -61,6 +100,8 @@ struct net_device {
     uint16_t type;
     uint16_t mtu;
     uint16_t flags;
+    uint16_t hw_features; /* offloads supported by the device */
+    uint16_t features; /* offloads currently enabled, subset of hw_features */
     uint16_t hlen; /* header length */
     uint16_t alen; /* address length */
     uint8_t addr[NET_DEVICE_ADDR_LEN];
@@ -69,9 +110,25 @@ struct net_device {
         uint8_t broadcast[NET_DEVICE_ADDR_LEN];
     };
     struct net_device_ops *ops;
+    struct qdisc *qdisc; /* transmit queueing discipline, NULL transmits directly */
+    unsigned int input_limit; /* packets held in the input queues of all the protocols, 0 means unlimited */
+    unsigned int input_backlog;
+    uint64_t input_drops; /* dropped by input_limit */
+    uint64_t mcast_filter; /* hash filter of the multicast link addresses to accept, see ether_mcast_add() */
+    uint16_t mcast_refs[NET_DEVICE_MCAST_HASH_SIZE]; /* addresses in each bucket of the filter */
     void *priv;
 };
 
+struct net_input_stats {
+    uint64_t enqueued;
+    uint64_t dequeued; /* handed to the protocol */
+    uint64_t drops_limit; /* the queue was full */
+    uint64_t drops_aqm; /* dropped early by RED or CoDel */
+    uint64_t sojourn_total; /* time spent in the queue by the dequeued packets (usec) */
+    uint64_t sojourn_max; /* usec */
+    unsigned int backlog;
+};
+
 extern struct net_device *
 net_device_alloc(void (*setup)(struct net_device *dev));
 extern int
@@ -81,16 +138,38 @@ net_device_add_iface(struct net_device *dev, struct net_iface *iface);
 extern struct net_iface *
 net_device_get_iface(struct net_device *dev, int family);
 extern int
-net_device_output(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst);
+net_device_set_mtu(struct net_device *dev, uint16_t mtu);
+extern int
+net_device_set_features(struct net_device *dev, uint16_t features);
+extern int
+net_device_set_input_limit(struct net_device *dev, unsigned int limit);
+extern int
+net_device_output(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst, int flags);
+extern int
+net_device_output_iov(struct net_device *dev, uint16_t type, const struct iovec *iov, int iovcnt, const void *dst, int flags);
+extern int
+net_device_flush(struct net_device *dev);
+extern int
+net_device_transmit(struct net_device *dev, uint16_t type, const struct iovec *iov, int iovcnt, const void *dst, int flags);
 
 extern int
-net_input_handler(uint16_t type, const uint8_t *data, size_t len, struct net_device *dev);
+net_input_handler(uint16_t type, const uint8_t *data, size_t len, struct net_device *dev, int flags);
+extern int
+net_input_handler_iov(uint16_t type, const struct iovec *iov, int iovcnt, struct net_device *dev, int flags);
 
 extern int
-net_protocol_register(const char *name, uint16_t type, void (*handler)(const uint8_t *data, size_t len, struct net_device *dev));
+net_protocol_register(const char *name, uint16_t type, void (*handler)(const uint8_t *data, size_t len, struct net_device *dev, int flags));
+extern int
+net_protocol_set_queue(uint16_t type, int aqm, unsigned int limit);
+extern int
+net_protocol_get_stats(uint16_t type, struct net_input_stats *stats);
+extern int
+net_protocol_set_classifier(uint16_t type, int (*classifier)(const uint8_t *data, size_t len));
 extern char *
 net_protocol_name(uint16_t type);
 extern int
+net_protocol_types(uint16_t *types, int size);
+extern int
 net_protocol_handler(void);
 
 extern int
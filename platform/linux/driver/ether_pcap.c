@@ -10,24 +10,58 @@
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <sys/poll.h>
+#include <sys/uio.h>
 #include <linux/if.h>
 #include <linux/if_ether.h>
 #include <linux/if_packet.h>
+#include <linux/filter.h>
 
 #include "platform.h"
 
 #include "util.h"
 #include "net.h"
 #include "ether.h"
+#include "ip.h"
 
 #include "driver/ether_pcap.h"
 
 #define ETHER_PCAP_IRQ (SIGRTMIN+3)
 
+#define ETHER_PCAP_BATCH_SIZE 32 /* frames held by NET_PACKET_FLAG_MORE, sent by a single sendmmsg(2) */
+
+#define ETHER_PCAP_FILTER_PROTOCOLS_MAX 16
+#define ETHER_PCAP_FILTER_INSNS_MAX 64
+
+/* NOTE: jump targets of the filter program, resolved after all instructions are emitted */
+enum {
+    ETHER_PCAP_LABEL_NEXT = 0,
+    ETHER_PCAP_LABEL_BROADCAST,
+    ETHER_PCAP_LABEL_MULTICAST,
+    ETHER_PCAP_LABEL_TYPE,
+    ETHER_PCAP_LABEL_IP,
+    ETHER_PCAP_LABEL_DROP,
+    ETHER_PCAP_LABEL_ACCEPT,
+    ETHER_PCAP_LABEL_NUM,
+};
+
+struct ether_pcap_filter {
+    struct sock_filter insns[ETHER_PCAP_FILTER_INSNS_MAX];
+    uint8_t jt[ETHER_PCAP_FILTER_INSNS_MAX];
+    uint8_t jf[ETHER_PCAP_FILTER_INSNS_MAX];
+    int labels[ETHER_PCAP_LABEL_NUM];
+    int len;
+};
+
 struct ether_pcap {
     char name[IFNAMSIZ];
     int fd;
     unsigned int irq;
+    uint16_t mtu; /* set by net_device_set_mtu() before open, 0 means follow the host */
+    mutex_t mutex; /* protects the transmit batch */
+    struct mmsghdr msgs[ETHER_PCAP_BATCH_SIZE];
+    struct iovec iovs[ETHER_PCAP_BATCH_SIZE];
+    uint8_t frames[ETHER_PCAP_BATCH_SIZE][ETHER_FRAME_SIZE_JUMBO];
+    int num;
 };
 
 #define PRIV(x) ((struct ether_pcap *)x->priv)
@@ -54,12 +88,184 @@ ether_pcap_addr(struct net_device *dev) {
     return 0;
 }
 
+static void
+ether_pcap_filter_label(struct ether_pcap_filter *filter, int label)
+{
+    filter->labels[label] = filter->len;
+}
+
+static void
+ether_pcap_filter_emit(struct ether_pcap_filter *filter, uint16_t code, uint32_t k, uint8_t jt, uint8_t jf)
+{
+    if (filter->len < ETHER_PCAP_FILTER_INSNS_MAX) {
+        filter->insns[filter->len] = (struct sock_filter)BPF_STMT(code, k);
+        filter->jt[filter->len] = jt;
+        filter->jf[filter->len] = jf;
+    }
+    filter->len++;
+}
+
+static int
+ether_pcap_filter_resolve(struct ether_pcap_filter *filter)
+{
+    int i;
+
+    if (filter->len > ETHER_PCAP_FILTER_INSNS_MAX) {
+        return -1;
+    }
+    for (i = 0; i < filter->len; i++) {
+        if (BPF_CLASS(filter->insns[i].code) != BPF_JMP) {
+            continue;
+        }
+        if (BPF_OP(filter->insns[i].code) == BPF_JA) {
+            filter->insns[i].k = filter->labels[filter->jt[i]] - (i + 1);
+            continue;
+        }
+        if (filter->jt[i] != ETHER_PCAP_LABEL_NEXT) {
+            filter->insns[i].jt = filter->labels[filter->jt[i]] - (i + 1);
+        }
+        if (filter->jf[i] != ETHER_PCAP_LABEL_NEXT) {
+            filter->insns[i].jf = filter->labels[filter->jf[i]] - (i + 1);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Accept only the frames that ether_input_helper() would accept:
+ *   - destination MAC address is ours, broadcast, or multicast while any group is joined
+ *   - Ethernet type is one of the registered protocols
+ *   - for IP, destination address is one of ours (unicast, subnet broadcast or limited broadcast),
+ *     multicast while any group is joined, or any address while forwarding
+ *
+ * NOTE: the groups themselves are checked by the hash filter in ether_input_helper()
+ */
+static int
+ether_pcap_set_filter(struct net_device *dev)
+{
+    struct ether_pcap_filter filter = {};
+    struct sock_fprog prog;
+    uint16_t types[ETHER_PCAP_FILTER_PROTOCOLS_MAX];
+    struct ip_iface *iface;
+    int num, i, ip = 0, mcast;
+
+    num = net_protocol_types(types, countof(types));
+    if (num > (int)countof(types)) {
+        warnf("too many protocols, dev=%s, num=%d", dev->name, num);
+        num = countof(types);
+    }
+    mcast = __atomic_load_n(&dev->mcast_filter, __ATOMIC_ACQUIRE) != 0;
+    /* destination address: ours */
+    ether_pcap_filter_emit(&filter, BPF_LD | BPF_W | BPF_ABS, 2, 0, 0);
+    ether_pcap_filter_emit(&filter, BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)dev->addr[2] << 24 | dev->addr[3] << 16 | dev->addr[4] << 8 | dev->addr[5], ETHER_PCAP_LABEL_NEXT, ETHER_PCAP_LABEL_BROADCAST);
+    ether_pcap_filter_emit(&filter, BPF_LD | BPF_H | BPF_ABS, 0, 0, 0);
+    ether_pcap_filter_emit(&filter, BPF_JMP | BPF_JEQ | BPF_K, dev->addr[0] << 8 | dev->addr[1], ETHER_PCAP_LABEL_TYPE, ETHER_PCAP_LABEL_BROADCAST);
+    /* destination address: broadcast */
+    ether_pcap_filter_label(&filter, ETHER_PCAP_LABEL_BROADCAST);
+    ether_pcap_filter_emit(&filter, BPF_LD | BPF_W | BPF_ABS, 2, 0, 0);
+    ether_pcap_filter_emit(&filter, BPF_JMP | BPF_JEQ | BPF_K, 0xffffffff, ETHER_PCAP_LABEL_NEXT, ETHER_PCAP_LABEL_MULTICAST);
+    ether_pcap_filter_emit(&filter, BPF_LD | BPF_H | BPF_ABS, 0, 0, 0);
+    ether_pcap_filter_emit(&filter, BPF_JMP | BPF_JEQ | BPF_K, 0xffff, ETHER_PCAP_LABEL_TYPE, ETHER_PCAP_LABEL_MULTICAST);
+    /* destination address: multicast (the group bit) */
+    ether_pcap_filter_label(&filter, ETHER_PCAP_LABEL_MULTICAST);
+    if (mcast) {
+        ether_pcap_filter_emit(&filter, BPF_LD | BPF_B | BPF_ABS, 0, 0, 0);
+        ether_pcap_filter_emit(&filter, BPF_JMP | BPF_JSET | BPF_K, 0x01, ETHER_PCAP_LABEL_NEXT, ETHER_PCAP_LABEL_DROP);
+    } else {
+        ether_pcap_filter_emit(&filter, BPF_JMP | BPF_JA, 0, ETHER_PCAP_LABEL_DROP, 0);
+    }
+    /* type */
+    ether_pcap_filter_label(&filter, ETHER_PCAP_LABEL_TYPE);
+    ether_pcap_filter_emit(&filter, BPF_LD | BPF_H | BPF_ABS, 12, 0, 0);
+    for (i = 0; i < num; i++) {
+        if (types[i] == ETHER_TYPE_IP) {
+            ip = 1;
+            ether_pcap_filter_emit(&filter, BPF_JMP | BPF_JEQ | BPF_K, types[i], ETHER_PCAP_LABEL_IP, ETHER_PCAP_LABEL_NEXT);
+        } else {
+            ether_pcap_filter_emit(&filter, BPF_JMP | BPF_JEQ | BPF_K, types[i], ETHER_PCAP_LABEL_ACCEPT, ETHER_PCAP_LABEL_NEXT);
+        }
+    }
+    ether_pcap_filter_emit(&filter, BPF_JMP | BPF_JA, 0, ETHER_PCAP_LABEL_DROP, 0);
+    /* IP destination address */
+    ether_pcap_filter_label(&filter, ETHER_PCAP_LABEL_IP);
+    if (ip && ip_get_forwarding()) {
+        ether_pcap_filter_emit(&filter, BPF_JMP | BPF_JA, 0, ETHER_PCAP_LABEL_ACCEPT, 0);
+    } else if (ip) {
+        ether_pcap_filter_emit(&filter, BPF_LD | BPF_W | BPF_ABS, ETHER_HDR_SIZE + 16, 0, 0);
+        iface = (struct ip_iface *)net_device_get_iface(dev, NET_IFACE_FAMILY_IP);
+        if (iface) {
+            ether_pcap_filter_emit(&filter, BPF_JMP | BPF_JEQ | BPF_K, ntoh32(iface->unicast), ETHER_PCAP_LABEL_ACCEPT, ETHER_PCAP_LABEL_NEXT);
+            ether_pcap_filter_emit(&filter, BPF_JMP | BPF_JEQ | BPF_K, ntoh32(iface->broadcast), ETHER_PCAP_LABEL_ACCEPT, ETHER_PCAP_LABEL_NEXT);
+        }
+        ether_pcap_filter_emit(&filter, BPF_JMP | BPF_JEQ | BPF_K, ntoh32(IP_ADDR_BROADCAST), ETHER_PCAP_LABEL_ACCEPT, ETHER_PCAP_LABEL_NEXT);
+        if (mcast) {
+            ether_pcap_filter_emit(&filter, BPF_ALU | BPF_AND | BPF_K, 0xf0000000, 0, 0);
+            ether_pcap_filter_emit(&filter, BPF_JMP | BPF_JEQ | BPF_K, 0xe0000000, ETHER_PCAP_LABEL_ACCEPT, ETHER_PCAP_LABEL_NEXT);
+        }
+    }
+    ether_pcap_filter_label(&filter, ETHER_PCAP_LABEL_DROP);
+    ether_pcap_filter_emit(&filter, BPF_RET | BPF_K, 0, 0, 0);
+    ether_pcap_filter_label(&filter, ETHER_PCAP_LABEL_ACCEPT);
+    ether_pcap_filter_emit(&filter, BPF_RET | BPF_K, UINT32_MAX, 0, 0);
+    if (ether_pcap_filter_resolve(&filter) == -1) {
+        errorf("filter program too long, dev=%s, len=%d", dev->name, filter.len);
+        return -1;
+    }
+    prog.len = filter.len;
+    prog.filter = filter.insns;
+    if (setsockopt(PRIV(dev)->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) == -1) {
+        errorf("setsockopt(SO_ATTACH_FILTER): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    debugf("filter attached, dev=%s, len=%d", dev->name, filter.len);
+    return 0;
+}
+
+static int
+ether_pcap_host_mtu(struct net_device *dev, unsigned long request, int mtu)
+{
+    int soc;
+    struct ifreq ifr = {};
+
+    soc = socket(AF_INET, SOCK_DGRAM, 0);
+    if (soc == -1) {
+        errorf("socket: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    strncpy(ifr.ifr_name, PRIV(dev)->name, sizeof(ifr.ifr_name)-1);
+    ifr.ifr_mtu = mtu;
+    if (ioctl(soc, request, &ifr) == -1) {
+        errorf("ioctl(%s): %s, dev=%s", request == SIOCGIFMTU ? "SIOCGIFMTU" : "SIOCSIFMTU", strerror(errno), dev->name);
+        close(soc);
+        return -1;
+    }
+    close(soc);
+    return ifr.ifr_mtu;
+}
+
+static int
+ether_pcap_set_mtu(struct net_device *dev, uint16_t mtu)
+{
+    if (mtu < ETHER_PAYLOAD_SIZE_MIN || mtu > ETHER_PAYLOAD_SIZE_JUMBO) {
+        errorf("out of range, dev=%s, mtu=%u", dev->name, mtu);
+        return -1;
+    }
+    if (NET_DEVICE_IS_UP(dev)) {
+        if (ether_pcap_host_mtu(dev, SIOCSIFMTU, mtu) == -1) {
+            return -1;
+        }
+    }
+    PRIV(dev)->mtu = mtu;
+    return 0;
+}
+
 static int
 ether_pcap_open(struct net_device *dev)
 {
     struct ether_pcap *pcap;
     struct sockaddr_ll addr = {};
     struct ifreq ifr = {};
+    int mtu;
 
     pcap = PRIV(dev);
 
@@ -118,6 +324,21 @@ ether_pcap_open(struct net_device *dev)
             return -1;
         }
     }
+    if (pcap->mtu) {
+        /* NOTE: not fatal, the host side just keeps its own MTU */
+        if (ether_pcap_host_mtu(dev, SIOCSIFMTU, pcap->mtu) == -1) {
+            warnf("failed to apply the MTU to the host, dev=%s, mtu=%u", dev->name, pcap->mtu);
+        }
+    } else {
+        mtu = ether_pcap_host_mtu(dev, SIOCGIFMTU, 0);
+        if (mtu >= ETHER_PAYLOAD_SIZE_MIN) {
+            dev->mtu = MIN(mtu, ETHER_PAYLOAD_SIZE_JUMBO);
+        }
+    }
+    if (ether_pcap_set_filter(dev) == -1) {
+        /* NOTE: not fatal, all frames are filtered in user space as before */
+        warnf("ether_pcap_set_filter() failure, dev=%s", dev->name);
+    }
     return 0;
 };
 
@@ -128,16 +349,97 @@ ether_pcap_close(struct net_device *dev)
     return 0;
 }
 
+/* NOTE: must be called after mutex locked */
+static int
+ether_pcap_flush_locked(struct net_device *dev)
+{
+    struct ether_pcap *pcap;
+    int done = 0, ret;
+
+    pcap = PRIV(dev);
+    while (done < pcap->num) {
+        ret = sendmmsg(pcap->fd, pcap->msgs + done, pcap->num - done, 0);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            errorf("sendmmsg: %s, dev=%s, num=%d", strerror(errno), dev->name, pcap->num - done);
+            pcap->num = 0;
+            return -1;
+        }
+        done += ret;
+    }
+    pcap->num = 0;
+    return 0;
+}
+
+static int
+ether_pcap_flush(struct net_device *dev)
+{
+    int ret;
+
+    mutex_lock(&PRIV(dev)->mutex);
+    ret = ether_pcap_flush_locked(dev);
+    mutex_unlock(&PRIV(dev)->mutex);
+    return ret;
+}
+
+static ssize_t
+ether_pcap_writev(struct net_device *dev, const struct iovec *iov, int iovcnt, int flags)
+{
+    struct ether_pcap *pcap;
+    ssize_t flen;
+
+    pcap = PRIV(dev);
+    mutex_lock(&pcap->mutex);
+    if (!(flags & NET_PACKET_FLAG_MORE) && !pcap->num) {
+        /* nothing is held, send it directly without copying */
+        flen = writev(pcap->fd, iov, iovcnt);
+        mutex_unlock(&pcap->mutex);
+        return flen;
+    }
+    flen = iovec_len(iov, iovcnt);
+    if (flen > (ssize_t)sizeof(pcap->frames[0])) {
+        mutex_unlock(&pcap->mutex);
+        errorf("too long, dev=%s, len=%zd", dev->name, flen);
+        return -1;
+    }
+    /* NOTE: the caller's buffers do not outlive this call, the frame is copied into the batch */
+    iovec_copy(pcap->frames[pcap->num], sizeof(pcap->frames[0]), iov, iovcnt);
+    pcap->iovs[pcap->num].iov_base = pcap->frames[pcap->num];
+    pcap->iovs[pcap->num].iov_len = flen;
+    pcap->msgs[pcap->num].msg_hdr.msg_iov = &pcap->iovs[pcap->num];
+    pcap->msgs[pcap->num].msg_hdr.msg_iovlen = 1;
+    pcap->num++;
+    if (!(flags & NET_PACKET_FLAG_MORE) || pcap->num == ETHER_PCAP_BATCH_SIZE) {
+        if (ether_pcap_flush_locked(dev) == -1) {
+            flen = -1;
+        }
+    }
+    mutex_unlock(&pcap->mutex);
+    return flen;
+}
+
 static ssize_t
-ether_pcap_write(struct net_device *dev, const uint8_t *frame, size_t flen)
+ether_pcap_write(struct net_device *dev, const uint8_t *frame, size_t flen, int flags)
 {
-    return write(PRIV(dev)->fd, frame, flen);
+    struct iovec iov;
+
+    iov.iov_base = (void *)frame;
+    iov.iov_len = flen;
+    return ether_pcap_writev(dev, &iov, 1, flags);
 }
 
 int
-ether_pcap_transmit(struct net_device *dev, uint16_t type, const uint8_t *buf, size_t len, const void *dst)
+ether_pcap_transmit(struct net_device *dev, uint16_t type, const uint8_t *buf, size_t len, const void *dst, int flags)
+{
+    return ether_transmit_helper(dev, type, buf, len, dst, flags, ether_pcap_write);
+}
+
+static int
+ether_pcap_transmit_iov(struct net_device *dev, uint16_t type, const struct iovec *iov, int iovcnt, const void *dst, int flags)
 {
-    return ether_transmit_helper(dev, type, buf, len, dst, ether_pcap_write);
+    return ether_transmit_helper_iov(dev, type, iov, iovcnt, dst, flags, ether_pcap_writev);
 }
 
 static ssize_t
@@ -185,6 +487,10 @@ static struct net_device_ops ether_pcap_ops = {
     .open = ether_pcap_open,
     .close = ether_pcap_close,
     .transmit = ether_pcap_transmit,
+    .transmit_iov = ether_pcap_transmit_iov,
+    .flush = ether_pcap_flush,
+    .set_mtu = ether_pcap_set_mtu,
+    .set_filter = ether_pcap_set_filter,
 };
 
 struct net_device *
@@ -205,6 +511,7 @@ ether_pcap_init(const char *name, const char *addr)
         }
     }
     dev->ops = &ether_pcap_ops;
+    dev->hw_features = NET_DEVICE_FEATURE_SG;
     pcap = memory_alloc(sizeof(*pcap));
     if (!pcap) {
         errorf("memory_alloc() failure");
@@ -213,6 +520,7 @@ ether_pcap_init(const char *name, const char *addr)
     strncpy(pcap->name, name, sizeof(pcap->name)-1);
     pcap->fd = -1;
     pcap->irq = ETHER_PCAP_IRQ;
+    mutex_init(&pcap->mutex);
     dev->priv = pcap;
     if (net_device_register(dev) == -1) {
         errorf("net_device_register() failure");
@@ -10,14 +10,17 @@
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <sys/poll.h>
+#include <sys/uio.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
+#include <linux/virtio_net.h>
 
 #include "platform.h"
 
 #include "util.h"
 #include "net.h"
 #include "ether.h"
+#include "ip.h"
 
 #include "driver/ether_tap.h"
 
@@ -25,10 +28,18 @@
 
 #define ETHER_TAP_IRQ (SIGRTMIN+2)
 
+/* NOTE: the driver does not know the structure of the IP/TCP/UDP headers */
+#define IP_HDR_LEN(x)    ((((uint8_t *)(x))[0] & 0x0f) << 2)
+#define IP_HDR_PROTO(x)  (((uint8_t *)(x))[9])
+#define TCP_HDR_LEN(x)   ((((uint8_t *)(x))[12] >> 4) << 2)
+#define TCP_CSUM_OFFSET 16
+#define UDP_CSUM_OFFSET  6
+
 struct ether_tap {
     char name[IFNAMSIZ];
     int fd;
     unsigned int irq;
+    uint16_t mtu; /* set by net_device_set_mtu() before open, 0 means follow the host */
 };
 
 #define PRIV(x) ((struct ether_tap *)x->priv)
@@ -55,11 +66,78 @@ ether_tap_addr(struct net_device *dev) {
     return 0;
 }
 
+static int
+ether_tap_host_mtu(struct net_device *dev, unsigned long request, int mtu)
+{
+    int soc;
+    struct ifreq ifr = {};
+
+    soc = socket(AF_INET, SOCK_DGRAM, 0);
+    if (soc == -1) {
+        errorf("socket: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    strncpy(ifr.ifr_name, PRIV(dev)->name, sizeof(ifr.ifr_name)-1);
+    ifr.ifr_mtu = mtu;
+    if (ioctl(soc, request, &ifr) == -1) {
+        errorf("ioctl(%s): %s, dev=%s", request == SIOCGIFMTU ? "SIOCGIFMTU" : "SIOCSIFMTU", strerror(errno), dev->name);
+        close(soc);
+        return -1;
+    }
+    close(soc);
+    return ifr.ifr_mtu;
+}
+
+static int
+ether_tap_set_mtu(struct net_device *dev, uint16_t mtu)
+{
+    if (mtu < ETHER_PAYLOAD_SIZE_MIN || mtu > ETHER_PAYLOAD_SIZE_JUMBO) {
+        errorf("out of range, dev=%s, mtu=%u", dev->name, mtu);
+        return -1;
+    }
+    if (NET_DEVICE_IS_UP(dev)) {
+        if (ether_tap_host_mtu(dev, SIOCSIFMTU, mtu) == -1) {
+            return -1;
+        }
+    }
+    PRIV(dev)->mtu = mtu;
+    return 0;
+}
+
+/* NOTE: accept partial checksum and TCP super-segment in both directions, as far as enabled */
+static int
+ether_tap_offload(struct net_device *dev, uint16_t features)
+{
+    unsigned int offload = 0;
+
+    if (features & NET_DEVICE_FEATURE_TX_CSUM) {
+        offload |= TUN_F_CSUM;
+        if (features & NET_DEVICE_FEATURE_TSO) {
+            offload |= TUN_F_TSO4;
+        }
+    }
+    if (ioctl(PRIV(dev)->fd, TUNSETOFFLOAD, offload) == -1) {
+        errorf("ioctl(TUNSETOFFLOAD): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+ether_tap_set_features(struct net_device *dev, uint16_t features)
+{
+    if (NET_DEVICE_IS_UP(dev)) {
+        return ether_tap_offload(dev, features);
+    }
+    return 0; /* applied on open */
+}
+
 static int
 ether_tap_open(struct net_device *dev)
 {
     struct ether_tap *tap;
     struct ifreq ifr = {};
+    int mtu;
 
     tap = PRIV(dev);
     tap->fd = open(CLONE_DEVICE, O_RDWR);
@@ -68,12 +146,17 @@ ether_tap_open(struct net_device *dev)
         return -1;
     }
     strncpy(ifr.ifr_name, tap->name, sizeof(ifr.ifr_name)-1);
-    ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR;
     if (ioctl(tap->fd, TUNSETIFF, &ifr) == -1) {
         errorf("ioctl(TUNSETIFF): %s, dev=%s", strerror(errno), dev->name);
         close(tap->fd);
         return -1;
     }
+    if (ether_tap_offload(dev, dev->features) == -1) {
+        warnf("offloads disabled, dev=%s", dev->name);
+        dev->hw_features &= ~(NET_DEVICE_FEATURE_TX_CSUM | NET_DEVICE_FEATURE_TSO);
+        dev->features &= ~(NET_DEVICE_FEATURE_TX_CSUM | NET_DEVICE_FEATURE_TSO);
+    }
     /* Set Asynchronous I/O signal delivery destination */
     if (fcntl(tap->fd, F_SETOWN, getpid()) == -1) {
         errorf("fcntl(F_SETOWN): %s, dev=%s", strerror(errno), dev->name);
@@ -99,6 +182,17 @@ ether_tap_open(struct net_device *dev)
             return -1;
         }
     }
+    if (tap->mtu) {
+        /* NOTE: not fatal, the host side just keeps its own MTU */
+        if (ether_tap_host_mtu(dev, SIOCSIFMTU, tap->mtu) == -1) {
+            warnf("failed to apply the MTU to the host, dev=%s, mtu=%u", dev->name, tap->mtu);
+        }
+    } else {
+        mtu = ether_tap_host_mtu(dev, SIOCGIFMTU, 0);
+        if (mtu >= ETHER_PAYLOAD_SIZE_MIN) {
+            dev->mtu = MIN(mtu, ETHER_PAYLOAD_SIZE_JUMBO);
+        }
+    }
     return 0;
 };
 
@@ -110,30 +204,104 @@ ether_tap_close(struct net_device *dev)
 }
 
 static ssize_t
-ether_tap_write(struct net_device *dev, const uint8_t *frame, size_t flen)
+ether_tap_writev(struct net_device *dev, const struct iovec *iov, int iovcnt, int flags)
 {
-    return write(PRIV(dev)->fd, frame, flen);
+    struct virtio_net_hdr vnet = {};
+    uint8_t head[ETHER_HDR_SIZE + 60 + 60]; /* Ethernet, IP and TCP headers at most */
+    struct iovec vec[NET_IOV_MAX + 3];
+    const uint8_t *ip, *l4;
+    size_t flen;
+    ssize_t ret;
+    int i;
+
+    if (iovcnt >= (int)countof(vec)) {
+        return -1;
+    }
+    flen = iovec_len(iov, iovcnt);
+    if (flags & NET_PACKET_FLAG_CSUM_PARTIAL) {
+        /* NOTE: the headers may be scattered over the fragments */
+        iovec_copy(head, sizeof(head), iov, iovcnt);
+        ip = head + ETHER_HDR_SIZE;
+        l4 = ip + IP_HDR_LEN(ip);
+        vnet.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        vnet.csum_start = l4 - head;
+        vnet.csum_offset = IP_HDR_PROTO(ip) == IP_PROTOCOL_TCP ? TCP_CSUM_OFFSET : UDP_CSUM_OFFSET;
+        if ((flags & NET_PACKET_FLAG_GSO) && flen > (size_t)(ETHER_HDR_SIZE + dev->mtu)) {
+            /* the kernel splits it into MTU sized segments */
+            vnet.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+            vnet.hdr_len = (l4 - head) + TCP_HDR_LEN(l4);
+            vnet.gso_size = dev->mtu - ((l4 - ip) + TCP_HDR_LEN(l4));
+        }
+    }
+    vec[0].iov_base = &vnet;
+    vec[0].iov_len = sizeof(vnet);
+    for (i = 0; i < iovcnt; i++) {
+        vec[i+1] = iov[i];
+    }
+    ret = writev(PRIV(dev)->fd, vec, iovcnt + 1);
+    if (ret == -1) {
+        return -1;
+    }
+    return ret - sizeof(vnet);
+}
+
+static ssize_t
+ether_tap_write(struct net_device *dev, const uint8_t *frame, size_t flen, int flags)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *)frame;
+    iov.iov_len = flen;
+    return ether_tap_writev(dev, &iov, 1, flags);
 }
 
 int
-ether_tap_transmit(struct net_device *dev, uint16_t type, const uint8_t *buf, size_t len, const void *dst)
+ether_tap_transmit(struct net_device *dev, uint16_t type, const uint8_t *buf, size_t len, const void *dst, int flags)
 {
-    return ether_transmit_helper(dev, type, buf, len, dst, ether_tap_write);
+    return ether_transmit_helper(dev, type, buf, len, dst, flags, ether_tap_write);
 }
 
-static ssize_t
-ether_tap_read(struct net_device *dev, uint8_t *buf, size_t size)
+static int
+ether_tap_transmit_iov(struct net_device *dev, uint16_t type, const struct iovec *iov, int iovcnt, const void *dst, int flags)
 {
+    return ether_transmit_helper_iov(dev, type, iov, iovcnt, dst, flags, ether_tap_writev);
+}
+
+static int
+ether_tap_input(struct net_device *dev)
+{
+    struct virtio_net_hdr vnet;
+    uint8_t frame[ETHER_HDR_SIZE + NET_DEVICE_GSO_SIZE_MAX]; /* large enough for coalesced segment */
+    struct iovec iov[2];
     ssize_t len;
+    int flags = 0;
 
-    len = read(PRIV(dev)->fd, buf, size);
+    iov[0].iov_base = &vnet;
+    iov[0].iov_len = sizeof(vnet);
+    iov[1].iov_base = frame;
+    iov[1].iov_len = sizeof(frame);
+    len = readv(PRIV(dev)->fd, iov, countof(iov));
     if (len <= 0) {
         if (len == -1 && errno != EINTR) {
-            errorf("read: %s, dev=%s", strerror(errno), dev->name);
+            errorf("readv: %s, dev=%s", strerror(errno), dev->name);
         }
         return -1;
     }
-    return len;
+    if (len < (ssize_t)sizeof(vnet)) {
+        errorf("too short, dev=%s", dev->name);
+        return -1;
+    }
+    if (vnet.flags & VIRTIO_NET_HDR_F_DATA_VALID) {
+        flags |= NET_PACKET_FLAG_CSUM_VALID;
+    }
+    if (vnet.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+        /* sent by the host itself, the checksum is not filled in yet */
+        flags |= (NET_PACKET_FLAG_CSUM_VALID | NET_PACKET_FLAG_CSUM_PARTIAL);
+    }
+    if (vnet.gso_type != VIRTIO_NET_HDR_GSO_NONE) {
+        flags |= NET_PACKET_FLAG_GSO;
+    }
+    return ether_input_helper(dev, frame, len - sizeof(vnet), flags);
 }
 
 static int
@@ -157,7 +325,7 @@ ether_tap_isr(unsigned int irq, void *id)
         if (ret == 0) {
             break;
         }
-        ether_poll_helper(dev, ether_tap_read);
+        ether_tap_input(dev);
     }
     return 0;
 }
@@ -166,6 +334,9 @@ static struct net_device_ops ether_tap_ops = {
     .open = ether_tap_open,
     .close = ether_tap_close,
     .transmit = ether_tap_transmit,
+    .transmit_iov = ether_tap_transmit_iov,
+    .set_mtu = ether_tap_set_mtu,
+    .set_features = ether_tap_set_features,
 };
 
 struct net_device *
@@ -186,6 +357,8 @@ ether_tap_init(const char *name, const char *addr)
         }
     }
     dev->ops = &ether_tap_ops;
+    /* NOTE: negotiated with the host by TUNSETOFFLOAD on open, and again on net_device_set_features() */
+    dev->hw_features = (NET_DEVICE_FEATURE_TX_CSUM | NET_DEVICE_FEATURE_TSO | NET_DEVICE_FEATURE_SG);
     tap = memory_alloc(sizeof(*tap));
     if (!tap) {
         errorf("memory_alloc() failure");
@@ -0,0 +1,573 @@
+#define _GNU_SOURCE /* for memfd_create */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/poll.h>
+#include <sys/eventfd.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "ether.h"
+
+#include "driver/memif.h"
+
+#define MEMIF_VERSION 1
+
+#define MEMIF_RING_SIZE 256 /* must be a power of 2 */
+#define MEMIF_RING_MASK (MEMIF_RING_SIZE - 1)
+#define MEMIF_BUF_SIZE 9216 /* large enough for ETHER_FRAME_SIZE_JUMBO */
+
+#define MEMIF_RING_M2S 0 /* master to slave */
+#define MEMIF_RING_S2M 1 /* slave to master */
+
+#define MEMIF_RING_FLAG_NO_DOORBELL 0x0001 /* the consumer is polling, the producer does not need to kick */
+
+#define MEMIF_WAIT_TIMEOUT 100 /* ms */
+
+struct memif_desc {
+    uint32_t len;
+    uint32_t reserved;
+    uint8_t data[MEMIF_BUF_SIZE];
+};
+
+/* NOTE: head is written only by the producer, tail and flags only by the consumer */
+struct memif_ring {
+    uint32_t head;
+    uint8_t pad0[60]; /* keep the indexes on separate cache lines */
+    uint32_t tail;
+    uint32_t flags;
+    uint8_t pad1[56];
+    struct memif_desc desc[MEMIF_RING_SIZE];
+};
+
+struct memif_region {
+    struct memif_ring ring[2];
+};
+
+/* NOTE: sent by the master on connect, with the memfd and the doorbells (M2S, S2M) as SCM_RIGHTS */
+struct memif_msg_hello {
+    uint16_t version;
+    uint16_t ring_size;
+    uint32_t buf_size;
+    uint64_t region_size;
+};
+
+struct memif {
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    int flags;
+    int listener; /* master only */
+    int sock;
+    struct memif_region *region;
+    struct memif_ring *tx;
+    struct memif_ring *rx;
+    int efd[2]; /* doorbells, indexed by ring */
+    int tx_efd;
+    int rx_efd;
+    volatile int connected;
+    volatile int terminate;
+    pthread_t thread;
+    mutex_t mutex; /* serializes the producers of the tx ring against disconnect */
+    int kick; /* descriptors published without ringing the doorbell (NET_PACKET_FLAG_MORE) */
+};
+
+#define PRIV(x) ((struct memif *)x->priv)
+
+static void
+memif_attach(struct net_device *dev)
+{
+    struct memif *memif = PRIV(dev);
+    int tx, rx;
+
+    tx = (memif->flags & MEMIF_FLAG_MASTER) ? MEMIF_RING_M2S : MEMIF_RING_S2M;
+    rx = (memif->flags & MEMIF_FLAG_MASTER) ? MEMIF_RING_S2M : MEMIF_RING_M2S;
+    memif->tx = &memif->region->ring[tx];
+    memif->rx = &memif->region->ring[rx];
+    memif->tx_efd = memif->efd[tx];
+    memif->rx_efd = memif->efd[rx];
+    if (memif->flags & MEMIF_FLAG_POLLING) {
+        __atomic_or_fetch(&memif->rx->flags, MEMIF_RING_FLAG_NO_DOORBELL, __ATOMIC_RELEASE);
+    }
+    mutex_lock(&memif->mutex);
+    memif->connected = 1;
+    mutex_unlock(&memif->mutex);
+    infof("connected, dev=%s, path=%s, role=%s, mode=%s", dev->name, memif->path,
+        (memif->flags & MEMIF_FLAG_MASTER) ? "master" : "slave",
+        (memif->flags & MEMIF_FLAG_POLLING) ? "polling" : "interrupt");
+}
+
+static void
+memif_detach(struct net_device *dev)
+{
+    struct memif *memif = PRIV(dev);
+
+    mutex_lock(&memif->mutex);
+    memif->connected = 0;
+    memif->kick = 0;
+    mutex_unlock(&memif->mutex);
+    if (memif->region) {
+        munmap(memif->region, sizeof(*memif->region));
+        memif->region = NULL;
+    }
+    if (memif->efd[0] != -1) {
+        close(memif->efd[0]);
+        memif->efd[0] = -1;
+    }
+    if (memif->efd[1] != -1) {
+        close(memif->efd[1]);
+        memif->efd[1] = -1;
+    }
+    if (memif->sock != -1) {
+        close(memif->sock);
+        memif->sock = -1;
+    }
+}
+
+static int
+memif_master_connect(struct net_device *dev)
+{
+    struct memif *memif = PRIV(dev);
+    struct pollfd pfd;
+    struct memif_msg_hello hello = {};
+    int memfd, fds[3];
+    struct iovec iov;
+    struct msghdr msg = {};
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } cmsg = {};
+    int ret;
+
+    pfd.fd = memif->listener;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, MEMIF_WAIT_TIMEOUT) <= 0) {
+        return -1;
+    }
+    memif->sock = accept(memif->listener, NULL, NULL);
+    if (memif->sock == -1) {
+        errorf("accept: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    /* NOTE: a fresh region for each connection, nothing stale is left in the rings */
+    memfd = memfd_create("memif", MFD_CLOEXEC);
+    if (memfd == -1) {
+        errorf("memfd_create: %s, dev=%s", strerror(errno), dev->name);
+        memif_detach(dev);
+        return -1;
+    }
+    if (ftruncate(memfd, sizeof(*memif->region)) == -1) {
+        errorf("ftruncate: %s, dev=%s", strerror(errno), dev->name);
+        close(memfd);
+        memif_detach(dev);
+        return -1;
+    }
+    memif->region = mmap(NULL, sizeof(*memif->region), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (memif->region == MAP_FAILED) {
+        errorf("mmap: %s, dev=%s", strerror(errno), dev->name);
+        memif->region = NULL;
+        close(memfd);
+        memif_detach(dev);
+        return -1;
+    }
+    memif->efd[MEMIF_RING_M2S] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    memif->efd[MEMIF_RING_S2M] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (memif->efd[MEMIF_RING_M2S] == -1 || memif->efd[MEMIF_RING_S2M] == -1) {
+        errorf("eventfd: %s, dev=%s", strerror(errno), dev->name);
+        close(memfd);
+        memif_detach(dev);
+        return -1;
+    }
+    hello.version = MEMIF_VERSION;
+    hello.ring_size = MEMIF_RING_SIZE;
+    hello.buf_size = MEMIF_BUF_SIZE;
+    hello.region_size = sizeof(*memif->region);
+    iov.iov_base = &hello;
+    iov.iov_len = sizeof(hello);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg.buf;
+    msg.msg_controllen = sizeof(cmsg.buf);
+    fds[0] = memfd;
+    fds[1] = memif->efd[MEMIF_RING_M2S];
+    fds[2] = memif->efd[MEMIF_RING_S2M];
+    CMSG_FIRSTHDR(&msg)->cmsg_level = SOL_SOCKET;
+    CMSG_FIRSTHDR(&msg)->cmsg_type = SCM_RIGHTS;
+    CMSG_FIRSTHDR(&msg)->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(CMSG_FIRSTHDR(&msg)), fds, sizeof(fds));
+    ret = sendmsg(memif->sock, &msg, MSG_NOSIGNAL);
+    close(memfd); /* the mapping keeps the memory */
+    if (ret != sizeof(hello)) {
+        errorf("sendmsg: %s, dev=%s", strerror(errno), dev->name);
+        memif_detach(dev);
+        return -1;
+    }
+    memif_attach(dev);
+    return 0;
+}
+
+static int
+memif_slave_connect(struct net_device *dev)
+{
+    struct memif *memif = PRIV(dev);
+    struct sockaddr_un addr = {};
+    struct memif_msg_hello hello;
+    int fds[3];
+    struct iovec iov;
+    struct msghdr msg = {};
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } cmsg;
+    struct cmsghdr *c;
+
+    memif->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (memif->sock == -1) {
+        errorf("socket: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, memif->path, sizeof(addr.sun_path)-1);
+    if (connect(memif->sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        /* the master is not there yet, retry later */
+        memif_detach(dev);
+        usleep(MEMIF_WAIT_TIMEOUT * 1000);
+        return -1;
+    }
+    iov.iov_base = &hello;
+    iov.iov_len = sizeof(hello);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg.buf;
+    msg.msg_controllen = sizeof(cmsg.buf);
+    if (recvmsg(memif->sock, &msg, MSG_CMSG_CLOEXEC) != sizeof(hello)) {
+        errorf("recvmsg: failure, dev=%s", dev->name);
+        memif_detach(dev);
+        return -1;
+    }
+    c = CMSG_FIRSTHDR(&msg);
+    if (!c || c->cmsg_type != SCM_RIGHTS || c->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        errorf("no file descriptors, dev=%s", dev->name);
+        memif_detach(dev);
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(c), sizeof(fds));
+    memif->efd[MEMIF_RING_M2S] = fds[1];
+    memif->efd[MEMIF_RING_S2M] = fds[2];
+    if (hello.version != MEMIF_VERSION || hello.ring_size != MEMIF_RING_SIZE ||
+        hello.buf_size != MEMIF_BUF_SIZE || hello.region_size != sizeof(*memif->region)) {
+        errorf("incompatible master, dev=%s, version=%u, ring_size=%u, buf_size=%u",
+            dev->name, hello.version, hello.ring_size, hello.buf_size);
+        close(fds[0]);
+        memif_detach(dev);
+        return -1;
+    }
+    memif->region = mmap(NULL, sizeof(*memif->region), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    if (memif->region == MAP_FAILED) {
+        errorf("mmap: %s, dev=%s", strerror(errno), dev->name);
+        memif->region = NULL;
+        memif_detach(dev);
+        return -1;
+    }
+    memif_attach(dev);
+    return 0;
+}
+
+static int
+memif_peer_alive(struct net_device *dev, int timeout)
+{
+    struct memif *memif = PRIV(dev);
+    struct pollfd pfd[2];
+    uint64_t count;
+    char c;
+
+    pfd[0].fd = memif->sock;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = memif->rx_efd;
+    pfd[1].events = POLLIN;
+    if (poll(pfd, (memif->flags & MEMIF_FLAG_POLLING) ? 1 : 2, timeout) == -1) {
+        return errno == EINTR ? 1 : 0;
+    }
+    if (pfd[0].revents & (POLLHUP | POLLERR)) {
+        return 0;
+    }
+    if ((pfd[0].revents & POLLIN) && recv(memif->sock, &c, sizeof(c), MSG_DONTWAIT) <= 0) {
+        return 0;
+    }
+    if (!(memif->flags & MEMIF_FLAG_POLLING) && (pfd[1].revents & POLLIN)) {
+        /* clear the doorbell, the ring is drained afterwards */
+        if (read(memif->rx_efd, &count, sizeof(count)) == -1) {
+            /* ignore */
+        }
+    }
+    return 1;
+}
+
+static int
+memif_rx_burst(struct net_device *dev)
+{
+    struct memif_ring *ring = PRIV(dev)->rx;
+    struct memif_desc *desc;
+    uint32_t head, tail, len;
+    int num = 0;
+
+    tail = ring->tail;
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    while (tail != head) {
+        desc = &ring->desc[tail & MEMIF_RING_MASK];
+        /* NOTE: the peer can rewrite the descriptor at any time, the length is read once */
+        len = __atomic_load_n(&desc->len, __ATOMIC_RELAXED);
+        if (len <= MEMIF_BUF_SIZE) {
+            ether_input_helper(dev, desc->data, len, 0);
+        }
+        tail++;
+        num++;
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    return num;
+}
+
+static void *
+memif_thread(void *arg)
+{
+    struct net_device *dev = (struct net_device *)arg;
+    struct memif *memif = PRIV(dev);
+    int alive;
+
+    while (!memif->terminate) {
+        if (!memif->connected) {
+            if (memif->flags & MEMIF_FLAG_MASTER) {
+                memif_master_connect(dev);
+            } else {
+                memif_slave_connect(dev);
+            }
+            continue;
+        }
+        if (memif->flags & MEMIF_FLAG_POLLING) {
+            if (memif_rx_burst(dev)) {
+                continue;
+            }
+            /* NOTE: the ring is idle, it is a good time to look at the control socket */
+            alive = memif_peer_alive(dev, 0);
+        } else {
+            alive = memif_peer_alive(dev, MEMIF_WAIT_TIMEOUT);
+            memif_rx_burst(dev);
+        }
+        if (!alive) {
+            infof("disconnected, dev=%s", dev->name);
+            memif_detach(dev);
+        }
+    }
+    return NULL;
+}
+
+static int
+memif_open(struct net_device *dev)
+{
+    struct memif *memif = PRIV(dev);
+    struct sockaddr_un addr = {};
+    int err;
+
+    if (memif->flags & MEMIF_FLAG_MASTER) {
+        memif->listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (memif->listener == -1) {
+            errorf("socket: %s, dev=%s", strerror(errno), dev->name);
+            return -1;
+        }
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, memif->path, sizeof(addr.sun_path)-1);
+        unlink(memif->path);
+        if (bind(memif->listener, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+            errorf("bind: %s, dev=%s, path=%s", strerror(errno), dev->name, memif->path);
+            close(memif->listener);
+            return -1;
+        }
+        if (listen(memif->listener, 1) == -1) {
+            errorf("listen: %s, dev=%s", strerror(errno), dev->name);
+            close(memif->listener);
+            return -1;
+        }
+    }
+    memif->terminate = 0;
+    err = pthread_create(&memif->thread, NULL, memif_thread, dev);
+    if (err) {
+        errorf("pthread_create: %s, dev=%s", strerror(err), dev->name);
+        if (memif->listener != -1) {
+            close(memif->listener);
+            memif->listener = -1;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+static int
+memif_close(struct net_device *dev)
+{
+    struct memif *memif = PRIV(dev);
+
+    memif->terminate = 1;
+    pthread_join(memif->thread, NULL);
+    memif_detach(dev);
+    if (memif->listener != -1) {
+        close(memif->listener);
+        memif->listener = -1;
+        unlink(memif->path);
+    }
+    return 0;
+}
+
+/* NOTE: the MTU is not negotiated, both ends must be configured alike */
+static int
+memif_set_mtu(struct net_device *dev, uint16_t mtu)
+{
+    if (mtu < ETHER_PAYLOAD_SIZE_MIN || mtu > ETHER_PAYLOAD_SIZE_JUMBO) {
+        errorf("out of range, dev=%s, mtu=%u", dev->name, mtu);
+        return -1;
+    }
+    return 0;
+}
+
+/* NOTE: must be called after mutex locked */
+static void
+memif_kick(struct memif *memif)
+{
+    uint64_t one = 1;
+
+    memif->kick = 0;
+    if (!(__atomic_load_n(&memif->tx->flags, __ATOMIC_ACQUIRE) & MEMIF_RING_FLAG_NO_DOORBELL)) {
+        if (write(memif->tx_efd, &one, sizeof(one)) == -1) {
+            /* ignore: the counter is saturated, the peer is already woken up */
+        }
+    }
+}
+
+static int
+memif_flush(struct net_device *dev)
+{
+    struct memif *memif = PRIV(dev);
+
+    mutex_lock(&memif->mutex);
+    if (memif->connected && memif->kick) {
+        memif_kick(memif);
+    }
+    mutex_unlock(&memif->mutex);
+    return 0;
+}
+
+static ssize_t
+memif_write(struct net_device *dev, const uint8_t *frame, size_t flen, int flags)
+{
+    struct memif *memif = PRIV(dev);
+    struct memif_ring *ring;
+    struct memif_desc *desc;
+    uint32_t head, tail;
+
+    if (flen > MEMIF_BUF_SIZE) {
+        errorf("too long, dev=%s, len=%zu", dev->name, flen);
+        return -1;
+    }
+    mutex_lock(&memif->mutex);
+    if (!memif->connected) {
+        mutex_unlock(&memif->mutex);
+        debugf("not connected, dev=%s", dev->name);
+        return -1;
+    }
+    ring = memif->tx;
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail >= MEMIF_RING_SIZE) {
+        if (memif->kick) {
+            /* the peer may be sleeping on the held descriptors */
+            memif_kick(memif);
+        }
+        mutex_unlock(&memif->mutex);
+        debugf("ring full, dev=%s", dev->name);
+        return -1;
+    }
+    desc = &ring->desc[head & MEMIF_RING_MASK];
+    memcpy(desc->data, frame, flen);
+    desc->len = flen;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    if (flags & NET_PACKET_FLAG_MORE) {
+        /* NOTE: one doorbell for the whole burst, rung by the last one or flush() */
+        memif->kick = 1;
+    } else {
+        memif_kick(memif);
+    }
+    mutex_unlock(&memif->mutex);
+    return flen;
+}
+
+static int
+memif_transmit(struct net_device *dev, uint16_t type, const uint8_t *buf, size_t len, const void *dst, int flags)
+{
+    return ether_transmit_helper(dev, type, buf, len, dst, flags, memif_write);
+}
+
+static struct net_device_ops memif_ops = {
+    .open = memif_open,
+    .close = memif_close,
+    .transmit = memif_transmit,
+    .flush = memif_flush,
+    .set_mtu = memif_set_mtu,
+};
+
+struct net_device *
+memif_init(const char *path, int flags, const char *addr)
+{
+    struct net_device *dev;
+    struct memif *memif;
+    pid_t pid;
+
+    dev = net_device_alloc(ether_setup_helper);
+    if (!dev) {
+        errorf("net_device_alloc() failure");
+        return NULL;
+    }
+    if (addr) {
+        if (ether_addr_pton(addr, dev->addr) == -1) {
+            errorf("invalid address, addr=%s", addr);
+            return NULL;
+        }
+    } else {
+        /* locally administered address, unique among the processes on the host */
+        pid = getpid();
+        dev->addr[0] = 0x02;
+        dev->addr[1] = (flags & MEMIF_FLAG_MASTER) ? 0x4d : 0x53;
+        dev->addr[2] = (pid >> 24) & 0xff;
+        dev->addr[3] = (pid >> 16) & 0xff;
+        dev->addr[4] = (pid >> 8) & 0xff;
+        dev->addr[5] = pid & 0xff;
+    }
+    dev->ops = &memif_ops;
+    memif = memory_alloc(sizeof(*memif));
+    if (!memif) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    strncpy(memif->path, path, sizeof(memif->path)-1);
+    memif->flags = flags;
+    memif->listener = -1;
+    memif->sock = -1;
+    memif->efd[0] = memif->efd[1] = -1;
+    mutex_init(&memif->mutex);
+    dev->priv = memif;
+    if (net_device_register(dev) == -1) {
+        errorf("net_device_register() failure");
+        memory_free(memif);
+        return NULL;
+    }
+    debugf("memif device initialized, dev=%s, path=%s", dev->name, memif->path);
+    return dev;
+}
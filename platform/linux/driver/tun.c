@@ -0,0 +1,193 @@
+#define _GNU_SOURCE /* for F_SETSIG */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/poll.h>
+#include <linux/if.h>
+#include <linux/if_tun.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "ip.h"
+
+#include "driver/tun.h"
+
+#define CLONE_DEVICE "/dev/net/tun"
+
+#define TUN_IRQ (SIGRTMIN+4)
+#define TUN_MTU 1500
+
+struct tun {
+    char name[IFNAMSIZ];
+    int fd;
+    unsigned int irq;
+};
+
+#define PRIV(x) ((struct tun *)x->priv)
+
+static int
+tun_open(struct net_device *dev)
+{
+    struct tun *tun;
+    struct ifreq ifr = {};
+
+    tun = PRIV(dev);
+    tun->fd = open(CLONE_DEVICE, O_RDWR);
+    if (tun->fd == -1) {
+        errorf("open: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    strncpy(ifr.ifr_name, tun->name, sizeof(ifr.ifr_name)-1);
+    ifr.ifr_flags = IFF_TUN | IFF_NO_PI; /* raw IP packets, no packet information header */
+    if (ioctl(tun->fd, TUNSETIFF, &ifr) == -1) {
+        errorf("ioctl(TUNSETIFF): %s, dev=%s", strerror(errno), dev->name);
+        close(tun->fd);
+        return -1;
+    }
+    /* Set Asynchronous I/O signal delivery destination */
+    if (fcntl(tun->fd, F_SETOWN, getpid()) == -1) {
+        errorf("fcntl(F_SETOWN): %s, dev=%s", strerror(errno), dev->name);
+        close(tun->fd);
+        return -1;
+    }
+    /* Enable Asynchronous I/O */
+    if (fcntl(tun->fd, F_SETFL, O_ASYNC) == -1) {
+        errorf("fcntl(F_SETFL): %s, dev=%s", strerror(errno), dev->name);
+        close(tun->fd);
+        return -1;
+    }
+    /* Use other signal instead of SIGIO */
+    if (fcntl(tun->fd, F_SETSIG, tun->irq) == -1) {
+        errorf("fcntl(F_SETSIG): %s, dev=%s", strerror(errno), dev->name);
+        close(tun->fd);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+tun_close(struct net_device *dev)
+{
+    close(PRIV(dev)->fd);
+    return 0;
+}
+
+static int
+tun_transmit(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst, int flags)
+{
+    if (type != NET_PROTOCOL_TYPE_IP) {
+        errorf("unsupported protocol, dev=%s, type=0x%04x", dev->name, type);
+        return -1;
+    }
+    debugf("dev=%s, len=%zu", dev->name, len);
+    debugdump(data, len);
+    if (write(PRIV(dev)->fd, data, len) != (ssize_t)len) {
+        errorf("write: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+tun_input(struct net_device *dev)
+{
+    uint8_t buf[IP_TOTAL_SIZE_MAX];
+    ssize_t len;
+
+    len = read(PRIV(dev)->fd, buf, sizeof(buf));
+    if (len <= 0) {
+        if (len == -1 && errno != EINTR) {
+            errorf("read: %s, dev=%s", strerror(errno), dev->name);
+        }
+        return -1;
+    }
+    if ((buf[0] >> 4) != IP_VERSION_IPV4) {
+        /* NOTE: IPv6 packets are also delivered to the tun device */
+        return -1;
+    }
+    debugf("dev=%s, len=%zd", dev->name, len);
+    debugdump(buf, len);
+    return net_input_handler(NET_PROTOCOL_TYPE_IP, buf, len, dev, 0);
+}
+
+static int
+tun_isr(unsigned int irq, void *id)
+{
+    struct net_device *dev = (struct net_device *)id;
+    struct pollfd pfd;
+    int ret;
+
+    pfd.fd = PRIV(dev)->fd;
+    pfd.events = POLLIN;
+    while (1) {
+        ret = poll(&pfd, 1, 0);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            errorf("poll: %s, dev=%s", strerror(errno), dev->name);
+            return -1;
+        }
+        if (ret == 0) {
+            break;
+        }
+        tun_input(dev);
+    }
+    return 0;
+}
+
+static struct net_device_ops tun_ops = {
+    .open = tun_open,
+    .close = tun_close,
+    .transmit = tun_transmit,
+};
+
+static void
+tun_setup(struct net_device *dev)
+{
+    dev->type = NET_DEVICE_TYPE_TUN;
+    dev->mtu = TUN_MTU;
+    dev->hlen = 0; /* non header */
+    dev->alen = 0; /* non address */
+    dev->flags = NET_DEVICE_FLAG_P2P; /* no link layer, no ARP */
+    dev->ops = &tun_ops;
+}
+
+struct net_device *
+tun_init(const char *name)
+{
+    struct net_device *dev;
+    struct tun *tun;
+
+    dev = net_device_alloc(tun_setup);
+    if (!dev) {
+        errorf("net_device_alloc() failure");
+        return NULL;
+    }
+    tun = memory_alloc(sizeof(*tun));
+    if (!tun) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    strncpy(tun->name, name, sizeof(tun->name)-1);
+    tun->fd = -1;
+    tun->irq = TUN_IRQ;
+    dev->priv = tun;
+    if (net_device_register(dev) == -1) {
+        errorf("net_device_register() failure");
+        memory_free(tun);
+        return NULL;
+    }
+    intr_request_irq(tun->irq, tun_isr, NET_IRQ_SHARED, dev->name, dev);
+    debugf("tun device initialized, dev=%s", dev->name);
+    return dev;
+}
@@ -0,0 +1,602 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "qdisc.h"
+
+/*
+ * Transmit Queueing Discipline
+ *
+ * NOTE: the senders push packets into a lock-free MPSC ring. The sender which
+ *       wins the "running" flag moves them from the ring into the scheduler and
+ *       transmits what the scheduler hands out, until both are empty. So only
+ *       the running thread touches the scheduler and it needs no locks.
+ */
+
+/* NOTE: the data follows immediately after the structure */
+struct qdisc_packet {
+    struct qdisc_packet *next;
+    uint64_t tstamp; /* enqueued time (nsec) */
+    uint32_t hash; /* flow hash */
+    uint16_t type;
+    int flags;
+    int has_dst;
+    uint8_t dst[NET_DEVICE_ADDR_LEN];
+    size_t len;
+};
+
+struct qdisc_list {
+    struct qdisc_packet *head;
+    struct qdisc_packet *tail;
+    size_t bytes;
+    unsigned int num;
+};
+
+struct qdisc_slot {
+    unsigned int seq;
+    struct qdisc_packet *pkt;
+};
+
+struct qdisc_fq_flow {
+    struct qdisc_fq_flow *next; /* active list */
+    struct qdisc_list queue;
+    int deficit;
+    int active;
+};
+
+struct qdisc;
+
+struct qdisc_ops {
+    const char *name;
+    void (*enqueue)(struct qdisc *q, struct qdisc_packet *pkt);
+    struct qdisc_packet *(*dequeue)(struct qdisc *q);
+};
+
+struct qdisc {
+    const struct qdisc_ops *ops;
+    size_t limit; /* byte queue limit */
+    size_t backlog; /* bytes held by the scheduler */
+    uint16_t mtu; /* including the link header */
+    struct qdisc_slot ring[QDISC_RING_SIZE];
+    unsigned int head; /* producers reserve slots here */
+    unsigned int tail; /* consumed by the running thread only */
+    int running;
+    struct qdisc_stats stats;
+    union {
+        struct qdisc_list fifo;
+        struct {
+            struct qdisc_fq_flow flows[QDISC_FQ_FLOWS];
+            struct qdisc_fq_flow *head;
+            struct qdisc_fq_flow *tail;
+        } fq;
+        struct {
+            struct qdisc_list queue;
+            uint64_t first_above_time;
+            uint64_t drop_next;
+            uint32_t count;
+            uint32_t lastcount;
+            int dropping;
+        } codel;
+    };
+};
+
+static uint64_t
+qdisc_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t
+qdisc_fnv1a(uint32_t hash, const uint8_t *data, size_t len)
+{
+    while (len--) {
+        hash ^= *data++;
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+/* NOTE: addresses and ports of IPv4, the protocol type for the others */
+static uint32_t
+qdisc_flow_hash(uint16_t type, const uint8_t *data, size_t len)
+{
+    uint32_t hash = 2166136261;
+    size_t hlen;
+
+    hash = qdisc_fnv1a(hash, (uint8_t *)&type, sizeof(type));
+    if (type != NET_PROTOCOL_TYPE_IP || len < 20 || (data[0] >> 4) != 4) {
+        return hash;
+    }
+    hash = qdisc_fnv1a(hash, data + 9, 1); /* protocol */
+    hash = qdisc_fnv1a(hash, data + 12, 8); /* src and dst */
+    hlen = (data[0] & 0x0f) << 2;
+    if ((data[9] == 6 || data[9] == 17) && !(ntoh16(*(uint16_t *)(data + 6)) & 0x1fff) && len >= hlen + 4) {
+        hash = qdisc_fnv1a(hash, data + hlen, 4); /* ports of TCP/UDP, only in the first fragment */
+    }
+    return hash;
+}
+
+static void
+qdisc_list_push(struct qdisc_list *list, struct qdisc_packet *pkt)
+{
+    pkt->next = NULL;
+    if (list->tail) {
+        list->tail->next = pkt;
+    } else {
+        list->head = pkt;
+    }
+    list->tail = pkt;
+    list->bytes += pkt->len;
+    list->num++;
+}
+
+static struct qdisc_packet *
+qdisc_list_pop(struct qdisc_list *list)
+{
+    struct qdisc_packet *pkt;
+
+    pkt = list->head;
+    if (!pkt) {
+        return NULL;
+    }
+    list->head = pkt->next;
+    if (!list->head) {
+        list->tail = NULL;
+    }
+    list->bytes -= pkt->len;
+    list->num--;
+    return pkt;
+}
+
+static void
+qdisc_drop(struct qdisc *q, struct qdisc_packet *pkt)
+{
+    q->backlog -= pkt->len;
+    q->stats.drops++;
+    memory_free(pkt);
+}
+
+/* NOTE: a packet is always admitted into an empty queue, a super-segment may exceed the limit alone */
+static int
+qdisc_overlimit(struct qdisc *q, size_t len)
+{
+    return q->backlog > q->limit && q->backlog > len;
+}
+
+/*
+ * FIFO
+ */
+
+static void
+qdisc_fifo_enqueue(struct qdisc *q, struct qdisc_packet *pkt)
+{
+    if (qdisc_overlimit(q, pkt->len)) {
+        qdisc_drop(q, pkt);
+        return;
+    }
+    qdisc_list_push(&q->fifo, pkt);
+}
+
+static struct qdisc_packet *
+qdisc_fifo_dequeue(struct qdisc *q)
+{
+    return qdisc_list_pop(&q->fifo);
+}
+
+/*
+ * FQ (Deficit Round Robin)
+ */
+
+static void
+qdisc_fq_enqueue(struct qdisc *q, struct qdisc_packet *pkt)
+{
+    struct qdisc_fq_flow *flow, *fat;
+    size_t len = pkt->len;
+    int i;
+
+    flow = &q->fq.flows[pkt->hash % QDISC_FQ_FLOWS];
+    qdisc_list_push(&flow->queue, pkt);
+    if (!flow->active) {
+        flow->active = 1;
+        flow->deficit = q->mtu;
+        flow->next = NULL;
+        if (q->fq.tail) {
+            q->fq.tail->next = flow;
+        } else {
+            q->fq.head = flow;
+        }
+        q->fq.tail = flow;
+    }
+    while (qdisc_overlimit(q, len)) {
+        /* NOTE: drop from the flow which occupies the most, the sparse flows keep their packets */
+        fat = &q->fq.flows[0];
+        for (i = 1; i < QDISC_FQ_FLOWS; i++) {
+            if (q->fq.flows[i].queue.bytes > fat->queue.bytes) {
+                fat = &q->fq.flows[i];
+            }
+        }
+        qdisc_drop(q, qdisc_list_pop(&fat->queue));
+    }
+}
+
+static struct qdisc_packet *
+qdisc_fq_dequeue(struct qdisc *q)
+{
+    struct qdisc_fq_flow *flow;
+    struct qdisc_packet *pkt;
+
+    while ((flow = q->fq.head) != NULL) {
+        if (!flow->queue.num) {
+            /* emptied, or drained by the limit */
+            q->fq.head = flow->next;
+            if (!q->fq.head) {
+                q->fq.tail = NULL;
+            }
+            flow->active = 0;
+            continue;
+        }
+        if (flow->deficit <= 0) {
+            flow->deficit += q->mtu;
+            if (flow != q->fq.tail) {
+                q->fq.head = flow->next;
+                flow->next = NULL;
+                q->fq.tail->next = flow;
+                q->fq.tail = flow;
+            }
+            continue;
+        }
+        pkt = qdisc_list_pop(&flow->queue);
+        flow->deficit -= pkt->len;
+        return pkt;
+    }
+    return NULL;
+}
+
+/*
+ * CoDel (RFC 8289)
+ */
+
+static uint64_t
+qdisc_isqrt(uint64_t x)
+{
+    uint64_t r, prev;
+
+    if (x < 2) {
+        return x;
+    }
+    r = x;
+    do {
+        prev = r;
+        r = (r + x / r) / 2;
+    } while (r < prev);
+    return prev;
+}
+
+static uint64_t
+qdisc_codel_control_law(uint64_t t, uint32_t count)
+{
+    /* t + interval / sqrt(count), scaled by 2^8 to keep the precision */
+    return t + ((uint64_t)QDISC_CODEL_INTERVAL << 8) / qdisc_isqrt((uint64_t)count << 16);
+}
+
+/* NOTE: sets CE if the IPv4 packet is ECN capable, updates the header checksum by RFC 1624 */
+static int
+qdisc_codel_mark(struct qdisc_packet *pkt)
+{
+    uint8_t *data;
+    uint16_t old, new;
+    uint32_t sum;
+
+    data = (uint8_t *)(pkt + 1);
+    if (pkt->type != NET_PROTOCOL_TYPE_IP || pkt->len < 20 || !(data[1] & 0x03)) {
+        return 0;
+    }
+    old = (data[0] << 8) | data[1];
+    data[1] |= 0x03;
+    new = (data[0] << 8) | data[1];
+    sum = (uint16_t)~((data[10] << 8) | data[11]);
+    sum += (uint16_t)~old + new;
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = ~sum;
+    data[10] = sum >> 8;
+    data[11] = sum & 0xff;
+    return 1;
+}
+
+/* NOTE: marks the packet and returns it, or drops it and returns NULL */
+static struct qdisc_packet *
+qdisc_codel_signal(struct qdisc *q, struct qdisc_packet *pkt)
+{
+    if (qdisc_codel_mark(pkt)) {
+        q->stats.marks++;
+        return pkt;
+    }
+    qdisc_drop(q, pkt);
+    return NULL;
+}
+
+static void
+qdisc_codel_enqueue(struct qdisc *q, struct qdisc_packet *pkt)
+{
+    if (qdisc_overlimit(q, pkt->len)) {
+        qdisc_drop(q, pkt);
+        return;
+    }
+    qdisc_list_push(&q->codel.queue, pkt);
+}
+
+static struct qdisc_packet *
+qdisc_codel_pop(struct qdisc *q, uint64_t now, int *ok_to_drop)
+{
+    struct qdisc_packet *pkt;
+
+    *ok_to_drop = 0;
+    pkt = qdisc_list_pop(&q->codel.queue);
+    if (!pkt) {
+        q->codel.first_above_time = 0;
+        return NULL;
+    }
+    if (now - pkt->tstamp < QDISC_CODEL_TARGET || q->codel.queue.bytes <= q->mtu) {
+        q->codel.first_above_time = 0;
+    } else if (!q->codel.first_above_time) {
+        q->codel.first_above_time = now + QDISC_CODEL_INTERVAL;
+    } else if (now >= q->codel.first_above_time) {
+        *ok_to_drop = 1;
+    }
+    return pkt;
+}
+
+static struct qdisc_packet *
+qdisc_codel_dequeue(struct qdisc *q)
+{
+    struct qdisc_packet *pkt;
+    uint64_t now;
+    uint32_t delta;
+    int drop;
+
+    now = qdisc_now();
+    pkt = qdisc_codel_pop(q, now, &drop);
+    if (!pkt) {
+        q->codel.dropping = 0;
+        return NULL;
+    }
+    if (q->codel.dropping) {
+        if (!drop) {
+            q->codel.dropping = 0;
+            return pkt;
+        }
+        while (q->codel.dropping && now >= q->codel.drop_next) {
+            q->codel.count++;
+            if (qdisc_codel_signal(q, pkt)) {
+                q->codel.drop_next = qdisc_codel_control_law(q->codel.drop_next, q->codel.count);
+                return pkt;
+            }
+            pkt = qdisc_codel_pop(q, now, &drop);
+            if (!pkt) {
+                q->codel.dropping = 0;
+                return NULL;
+            }
+            if (!drop) {
+                q->codel.dropping = 0;
+            } else {
+                q->codel.drop_next = qdisc_codel_control_law(q->codel.drop_next, q->codel.count);
+            }
+        }
+    } else if (drop) {
+        if (!qdisc_codel_signal(q, pkt)) {
+            pkt = qdisc_codel_pop(q, now, &drop);
+        }
+        q->codel.dropping = 1;
+        delta = q->codel.count - q->codel.lastcount;
+        if (delta > 1 && now - q->codel.drop_next < 16 * (uint64_t)QDISC_CODEL_INTERVAL) {
+            q->codel.count = delta;
+        } else {
+            q->codel.count = 1;
+        }
+        q->codel.drop_next = qdisc_codel_control_law(now, q->codel.count);
+        q->codel.lastcount = q->codel.count;
+    }
+    return pkt;
+}
+
+static const struct qdisc_ops qdisc_ops[] = {
+    [QDISC_TYPE_FIFO]  = {"fifo", qdisc_fifo_enqueue, qdisc_fifo_dequeue},
+    [QDISC_TYPE_FQ]    = {"fq", qdisc_fq_enqueue, qdisc_fq_dequeue},
+    [QDISC_TYPE_CODEL] = {"codel", qdisc_codel_enqueue, qdisc_codel_dequeue},
+};
+
+/*
+ * MPSC Ring
+ */
+
+static int
+qdisc_ring_push(struct qdisc *q, struct qdisc_packet *pkt)
+{
+    struct qdisc_slot *slot;
+    unsigned int pos, seq;
+
+    pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    while (1) {
+        slot = &q->ring[pos & (QDISC_RING_SIZE - 1)];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            /* NOTE: pos is reloaded when another producer took the slot */
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if ((int)(seq - pos) < 0) {
+            return -1; /* full */
+        } else {
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
+    slot->pkt = pkt;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+static int
+qdisc_ring_ready(struct qdisc *q)
+{
+    struct qdisc_slot *slot;
+
+    slot = &q->ring[q->tail & (QDISC_RING_SIZE - 1)];
+    return __atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) == q->tail + 1;
+}
+
+/* NOTE: must be called by the running thread */
+static struct qdisc_packet *
+qdisc_ring_pop(struct qdisc *q)
+{
+    struct qdisc_slot *slot;
+    struct qdisc_packet *pkt;
+
+    if (!qdisc_ring_ready(q)) {
+        return NULL;
+    }
+    slot = &q->ring[q->tail & (QDISC_RING_SIZE - 1)];
+    pkt = slot->pkt;
+    __atomic_store_n(&slot->seq, q->tail + QDISC_RING_SIZE, __ATOMIC_RELEASE);
+    q->tail++;
+    return pkt;
+}
+
+static void
+qdisc_run(struct net_device *dev, struct qdisc *q)
+{
+    struct qdisc_packet *pkt;
+    struct iovec iov;
+    int flags, more = 0;
+
+    do {
+        if (__atomic_exchange_n(&q->running, 1, __ATOMIC_SEQ_CST)) {
+            return; /* the running thread picks up our packet */
+        }
+        while (1) {
+            while ((pkt = qdisc_ring_pop(q)) != NULL) {
+                q->backlog += pkt->len;
+                q->ops->enqueue(q, pkt);
+            }
+            pkt = q->ops->dequeue(q);
+            if (!pkt) {
+                break;
+            }
+            q->backlog -= pkt->len;
+            iov.iov_base = pkt + 1;
+            iov.iov_len = pkt->len;
+            /* NOTE: the batching hint reflects what is queued here, not what the sender expected */
+            more = q->backlog || qdisc_ring_ready(q);
+            flags = (pkt->flags & ~NET_PACKET_FLAG_MORE) | (more ? NET_PACKET_FLAG_MORE : 0);
+            if (net_device_transmit(dev, pkt->type, &iov, 1, pkt->has_dst ? pkt->dst : NULL, flags) == -1) {
+                q->stats.drops++;
+            } else {
+                q->stats.packets++;
+                q->stats.bytes += pkt->len;
+            }
+            memory_free(pkt);
+        }
+        if (more) {
+            /* the scheduler dropped the packets which were expected to follow */
+            net_device_flush(dev);
+            more = 0;
+        }
+        __atomic_store_n(&q->running, 0, __ATOMIC_SEQ_CST);
+        /* NOTE: a packet pushed after the last pop would be left behind without this check */
+    } while (qdisc_ring_ready(q));
+}
+
+/* NOTE: must not be call after net_run() */
+int
+qdisc_attach(struct net_device *dev, int type, size_t limit)
+{
+    struct qdisc *q;
+    unsigned int i;
+
+    if (type < 0 || type >= (int)countof(qdisc_ops)) {
+        errorf("unknown type, dev=%s, type=%d", dev->name, type);
+        return -1;
+    }
+    if (dev->qdisc) {
+        errorf("already attached, dev=%s", dev->name);
+        return -1;
+    }
+    q = memory_alloc(sizeof(*q));
+    if (!q) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    q->ops = &qdisc_ops[type];
+    q->limit = limit ? limit : QDISC_LIMIT_DEFAULT;
+    q->mtu = dev->mtu + dev->hlen;
+    for (i = 0; i < QDISC_RING_SIZE; i++) {
+        q->ring[i].seq = i;
+    }
+    dev->qdisc = q;
+    infof("dev=%s, qdisc=%s, limit=%zu", dev->name, q->ops->name, q->limit);
+    return 0;
+}
+
+/* NOTE: returns -1 only when the ring is full, drops by the scheduler are not reported to the sender */
+int
+qdisc_enqueue(struct net_device *dev, uint16_t type, const struct iovec *iov, int iovcnt, const void *dst, int flags)
+{
+    struct qdisc *q;
+    struct qdisc_packet *pkt;
+    size_t len;
+
+    q = dev->qdisc;
+    len = iovec_len(iov, iovcnt);
+    pkt = memory_alloc(sizeof(*pkt) + len);
+    if (!pkt) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    pkt->tstamp = qdisc_now();
+    pkt->type = type;
+    pkt->flags = flags;
+    if (dst) {
+        pkt->has_dst = 1;
+        memcpy(pkt->dst, dst, dev->alen);
+    }
+    pkt->len = len;
+    iovec_copy((uint8_t *)(pkt + 1), len, iov, iovcnt);
+    pkt->hash = qdisc_flow_hash(type, (uint8_t *)(pkt + 1), len);
+    if (qdisc_ring_push(q, pkt) == -1) {
+        __atomic_add_fetch(&q->stats.overruns, 1, __ATOMIC_RELAXED);
+        memory_free(pkt);
+        qdisc_run(dev, q);
+        return -1;
+    }
+    qdisc_run(dev, q);
+    return 0;
+}
+
+int
+qdisc_get_stats(struct net_device *dev, struct qdisc_stats *stats)
+{
+    struct qdisc *q;
+
+    q = dev->qdisc;
+    if (!q) {
+        errorf("not attached, dev=%s", dev->name);
+        return -1;
+    }
+    /* NOTE: a snapshot, the counters may move while being copied */
+    stats->packets = __atomic_load_n(&q->stats.packets, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&q->stats.bytes, __ATOMIC_RELAXED);
+    stats->drops = __atomic_load_n(&q->stats.drops, __ATOMIC_RELAXED);
+    stats->overruns = __atomic_load_n(&q->stats.overruns, __ATOMIC_RELAXED);
+    stats->marks = __atomic_load_n(&q->stats.marks, __ATOMIC_RELAXED);
+    stats->backlog = __atomic_load_n(&q->backlog, __ATOMIC_RELAXED);
+    return 0;
+}
@@ -0,0 +1,38 @@
+#ifndef QDISC_H
+#define QDISC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "net.h"
+
+#define QDISC_TYPE_FIFO  0 /* tail-drop when the byte limit is exceeded */
+#define QDISC_TYPE_FQ    1 /* per-flow queues served by deficit round robin */
+#define QDISC_TYPE_CODEL 2 /* single queue, drops (or ECN marks) by sojourn time */
+
+#define QDISC_RING_SIZE 256 /* slots of the MPSC ring, must be a power of 2 */
+#define QDISC_LIMIT_DEFAULT (4 * NET_DEVICE_GSO_SIZE_MAX) /* bytes, holds a few super-segments */
+
+#define QDISC_FQ_FLOWS 64
+
+#define QDISC_CODEL_TARGET   5000000 /* 5ms (nsec) */
+#define QDISC_CODEL_INTERVAL 100000000 /* 100ms (nsec) */
+
+struct qdisc_stats {
+    uint64_t packets; /* transmitted */
+    uint64_t bytes; /* transmitted */
+    uint64_t drops; /* dropped by the byte limit or by the scheduler */
+    uint64_t overruns; /* rejected because the ring was full */
+    uint64_t marks; /* ECN CE marked instead of dropped (CoDel) */
+    size_t backlog; /* bytes held by the scheduler */
+};
+
+extern int
+qdisc_attach(struct net_device *dev, int type, size_t limit);
+extern int
+qdisc_enqueue(struct net_device *dev, uint16_t type, const struct iovec *iov, int iovcnt, const void *dst, int flags);
+extern int
+qdisc_get_stats(struct net_device *dev, struct qdisc_stats *stats);
+
+#endif
@@ -322,3 +322,44 @@ sock_send(int id, const void *buf, size_t n)
     }
     return -1;
 }
+
+int
+sock_setsockopt(int id, int level, int optname, const void *optval, int optlen)
+{
+    struct sock *s;
+    const struct ip_mreq *mreq;
+
+    s = sock_get(id);
+    if (!s) {
+        return -1;
+    }
+    if (s->type != SOCK_DGRAM || s->family != AF_INET) {
+        return -1;
+    }
+    switch (level) {
+    case SOL_SOCKET:
+        switch (optname) {
+        case SO_REUSEADDR:
+            if (optlen < (int)sizeof(int)) {
+                return -1;
+            }
+            return udp_set_reuseaddr(s->desc, *(const int *)optval);
+        }
+        return -1;
+    case IPPROTO_IP:
+        switch (optname) {
+        case IP_ADD_MEMBERSHIP:
+        case IP_DROP_MEMBERSHIP:
+            if (optlen < (int)sizeof(*mreq)) {
+                return -1;
+            }
+            mreq = (const struct ip_mreq *)optval;
+            if (optname == IP_ADD_MEMBERSHIP) {
+                return udp_join_group(s->desc, mreq->imr_multiaddr, mreq->imr_interface);
+            }
+            return udp_leave_group(s->desc, mreq->imr_multiaddr, mreq->imr_interface);
+        }
+        return -1;
+    }
+    return -1;
+}
@@ -19,9 +19,17 @@
 #define SOCK_STREAM 1
 #define SOCK_DGRAM  2
 
+#define IPPROTO_IP  0
 #define IPPROTO_TCP 0
 #define IPPROTO_UDP 0
 
+#define SOL_SOCKET  1
+
+/* NOTE: same values as Linux */
+#define SO_REUSEADDR        2 /* level SOL_SOCKET */
+#define IP_ADD_MEMBERSHIP  35 /* level IPPROTO_IP */
+#define IP_DROP_MEMBERSHIP 36 /* level IPPROTO_IP */
+
 #define INADDR_ANY ((ip_addr_t)0)
 
 #define SOCKADDR_STR_LEN IP_ENDPOINT_STR_LEN
@@ -44,6 +52,11 @@ struct sockaddr_in {
     ip_addr_t sin_addr;
 };
 
+struct ip_mreq {
+    ip_addr_t imr_multiaddr; /* group */
+    ip_addr_t imr_interface; /* local address of the iface, INADDR_ANY means by the route */
+};
+
 #define IFNAMSIZ 16
 
 extern int
@@ -71,5 +84,7 @@ extern ssize_t
 sock_recv(int id, void *buf, size_t n);
 extern ssize_t
 sock_send(int id, const void *buf, size_t n);
+extern int
+sock_setsockopt(int id, int level, int optname, const void *optval, int optlen);
 
 #endif
@@ -44,6 +44,15 @@
 #define TCP_RETRANSMIT_DEADLINE 12 /* seconds */
 #define TCP_TIMEWAIT_SEC 30 /* substitute for 2MSL */
 
+#define TCP_OPT_EOL 0
+#define TCP_OPT_NOP 1
+#define TCP_OPT_MSS 2
+
+#define TCP_DEFAULT_MSS 536 /* rfc1122: used when the peer does not send the MSS option */
+
+#define TCP_MTU_PROBING_BASE 1024 /* rfc4821: segments up to this size are not suspected of a black hole */
+#define TCP_MTU_PROBING_RETRIES 2 /* a full sized segment lost this many times is tried at a smaller MTU */
+
 #define TCP_SOURCE_PORT_MIN 49152
 #define TCP_SOURCE_PORT_MAX 65535
 
@@ -73,6 +82,7 @@ struct tcp_segment_info {
     uint16_t len;
     uint16_t wnd;
     uint16_t up;
+    uint16_t mss; /* MSS option (SYN only), 0 if not present */
 };
 
 struct tcp_pcb {
@@ -97,6 +107,9 @@ struct tcp_pcb {
     uint32_t irs;
     uint16_t mtu;
     uint16_t mss;
+    uint16_t probe_mtu; /* rfc4821, the smaller path MTU on trial, 0 means none */
+    uint32_t probe_seq; /* the trial succeeds once acked up to here */
+    struct ip_dst_cache dst; /* route and link address of the foreign address */
     uint8_t buf[65535]; /* receive buffer */
     struct sched_ctx ctx;
     struct queue_head queue; /* retransmit queue */
@@ -112,13 +125,16 @@ struct tcp_queue_entry {
     uint32_t seq;
     uint8_t flg;
     size_t len;
+    unsigned int retries;
 };
 
 static mutex_t mutex = MUTEX_INITIALIZER;
 static struct tcp_pcb pcbs[TCP_PCB_SIZE];
+static int loopback_fastpath = 1;
+static int mtu_probing = 0;
 
 static ssize_t
-tcp_output_segment(uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign);
+tcp_output_segment(uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign, struct ip_dst_cache *cache, int flags);
 
 static char *
 tcp_flg_ntoa(uint8_t flg)
@@ -186,6 +202,7 @@ tcp_pcb_release(struct tcp_pcb *pcb)
     char ep1[IP_ENDPOINT_STR_LEN];
     char ep2[IP_ENDPOINT_STR_LEN];
 
+    ip_flow_remove(pcb);
     if (sched_ctx_destroy(&pcb->ctx) == -1) {
         sched_wakeup(&pcb->ctx);
         return;
@@ -247,6 +264,75 @@ tcp_pcb_id(struct tcp_pcb *pcb)
     return indexof(pcbs, pcb);
 }
 
+/*
+ * TCP Loopback Fast Path
+ *
+ * NOTE: when the both ends of a connection live in this stack and talk over the loopback
+ *       device, the data is copied straight into the receive buffer of the peer PCB instead
+ *       of going through segments. The sequence numbers are advanced on the both sides as if
+ *       the segment had been sent and acknowledged, so the connection can fall back to the
+ *       normal path (e.g. FIN) at any time.
+ * NOTE: these functions must be called after mutex locked
+ */
+
+static struct tcp_pcb *
+tcp_pcb_peer(struct tcp_pcb *pcb)
+{
+    struct tcp_pcb *entry;
+
+    for (entry = pcbs; entry < tailof(pcbs); entry++) {
+        if (entry == pcb || entry->state == TCP_PCB_STATE_FREE || entry->state == TCP_PCB_STATE_LISTEN) {
+            continue;
+        }
+        if (entry->local.addr == pcb->foreign.addr && entry->local.port == pcb->foreign.port &&
+            entry->foreign.addr == pcb->local.addr && entry->foreign.port == pcb->local.port) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static struct tcp_pcb *
+tcp_loopback_peer(struct tcp_pcb *pcb, struct net_device *dev)
+{
+    struct tcp_pcb *peer;
+
+    if (!loopback_fastpath || !(dev->flags & NET_DEVICE_FLAG_LOOPBACK)) {
+        return NULL;
+    }
+    peer = tcp_pcb_peer(pcb);
+    if (!peer) {
+        return NULL;
+    }
+    switch (peer->state) {
+    case TCP_PCB_STATE_ESTABLISHED:
+    case TCP_PCB_STATE_FIN_WAIT1:
+    case TCP_PCB_STATE_FIN_WAIT2:
+        break;
+    default:
+        return NULL;
+    }
+    /* NOTE: segments still on the wire must arrive first to keep the stream in order */
+    if (pcb->snd.una != pcb->snd.nxt || peer->rcv.nxt != pcb->snd.nxt) {
+        return NULL;
+    }
+    return peer;
+}
+
+static void
+tcp_loopback_deliver(struct tcp_pcb *pcb, struct tcp_pcb *peer, uint8_t *data, size_t len)
+{
+    memcpy(peer->buf + (sizeof(peer->buf) - peer->rcv.wnd), data, len);
+    peer->rcv.nxt += len;
+    peer->rcv.wnd -= len;
+    pcb->snd.nxt += len;
+    pcb->snd.una = pcb->snd.nxt;
+    pcb->snd.wnd = peer->rcv.wnd;
+    pcb->snd.wl1 = pcb->rcv.nxt;
+    pcb->snd.wl2 = pcb->snd.una;
+    sched_wakeup(&peer->ctx);
+}
+
 /*
  * TCP Retransmit
  *
@@ -264,6 +350,7 @@ tcp_retransmit_queue_add(struct tcp_pcb *pcb, uint32_t seq, uint8_t flg, uint8_t
         return -1;
     }
     entry->rto = TCP_DEFAULT_RTO;
+    entry->retries = 0;
     entry->seq = seq;
     entry->flg = flg;
     entry->len = len;
@@ -291,15 +378,74 @@ tcp_retransmit_queue_cleanup(struct tcp_pcb *pcb)
         debugf("remove, seq=%u, flags=%s, len=%zu", entry->seq, tcp_flg_ntoa(entry->flg), entry->len);
         memory_free(entry);
     }
+    if (pcb->probe_mtu && pcb->snd.una >= pcb->probe_seq) {
+        /* NOTE: the segment went through at the smaller MTU, it is taken for the path */
+        debugf("black hole confirmed, mtu=%u", pcb->probe_mtu);
+        ip_pmtu_update(pcb->foreign.addr, pcb->probe_mtu);
+        pcb->probe_mtu = 0;
+    }
     return;
 }
 
+/* NOTE: the largest segment the path takes, 0 if there is no route */
+static size_t
+tcp_path_mss(struct tcp_pcb *pcb)
+{
+    if (!ip_dst_cache_check(&pcb->dst, pcb->foreign.addr)) {
+        return 0;
+    }
+    return MIN(pcb->mss, ip_dst_cache_mtu(&pcb->dst) - (IP_HDR_SIZE_MIN + sizeof(struct tcp_hdr)));
+}
+
+/*
+ * NOTE: rfc4821, the fallback for the paths which drop the large packets without telling
+ *       (an ICMP black hole). A full sized segment lost again and again is retransmitted in
+ *       pieces of the next plateau (and the one below if they are lost too), the path MTU is
+ *       lowered only when they are acked, a loss by congestion alone does not lower it. The
+ *       timeout of the path MTU raises it again later. A super-segment for TSO counts by its
+ *       retransmissions, they are sent in MSS sized pieces without TSO.
+ */
+static void
+tcp_mtu_probing(struct tcp_pcb *pcb, struct tcp_queue_entry *entry)
+{
+    uint16_t mtu;
+
+    if (!mtu_probing || !entry->retries || entry->retries % TCP_MTU_PROBING_RETRIES) {
+        return;
+    }
+    if (pcb->probe_mtu) {
+        if (entry->seq >= pcb->probe_seq) {
+            /* waits for the one on trial */
+            return;
+        }
+        mtu = pcb->probe_mtu;
+    } else {
+        if (IP_HDR_SIZE_MIN + sizeof(struct tcp_hdr) + entry->len <= TCP_MTU_PROBING_BASE) {
+            return;
+        }
+        if (entry->len < tcp_path_mss(pcb)) {
+            /* not a full sized one */
+            return;
+        }
+        mtu = ip_dst_cache_mtu(&pcb->dst);
+        pcb->probe_seq = entry->seq + entry->len;
+    }
+    mtu = MAX(ip_pmtu_plateau(mtu), TCP_MTU_PROBING_BASE);
+    if (mtu == pcb->probe_mtu) {
+        /* no lower one to try */
+        return;
+    }
+    debugf("suspect a black hole, try mtu=%u", mtu);
+    pcb->probe_mtu = mtu;
+}
+
 static void
 tcp_retransmit_queue_emit(void *arg, void *data)
 {
     struct tcp_pcb *pcb;
     struct tcp_queue_entry *entry;
     struct timeval now, diff, timeout;
+    size_t mss, off = 0, n;
 
     pcb = (struct tcp_pcb *)arg;
     entry = (struct tcp_queue_entry *)data;
@@ -313,7 +459,22 @@ tcp_retransmit_queue_emit(void *arg, void *data)
     timeout = entry->last;
     timeval_add_usec(&timeout, entry->rto);
     if (timercmp(&now, &timeout, >)) {
-        tcp_output_segment(entry->seq, pcb->rcv.nxt, entry->flg, pcb->rcv.wnd, (uint8_t *)(entry+1), entry->len, &pcb->local, &pcb->foreign);
+        entry->retries++;
+        tcp_mtu_probing(pcb, entry);
+        mss = tcp_path_mss(pcb);
+        if (mss && pcb->probe_mtu && entry->seq < pcb->probe_seq) {
+            mss = MIN(mss, pcb->probe_mtu - (IP_HDR_SIZE_MIN + sizeof(struct tcp_hdr)));
+        }
+        if (!mss || TCP_FLG_ISSET(entry->flg, TCP_FLG_SYN)) {
+            mss = entry->len;
+        }
+        /* NOTE: the path MTU may have shrunk since, the segment is sent again in pieces */
+        do {
+            n = MIN(entry->len - off, mss);
+            tcp_output_segment(entry->seq + off, pcb->rcv.nxt, (off + n < entry->len) ? entry->flg & ~TCP_FLG_FIN : entry->flg,
+                pcb->rcv.wnd, (uint8_t *)(entry+1) + off, n, &pcb->local, &pcb->foreign, &pcb->dst, NET_PACKET_FLAG_MORE);
+            off += n;
+        } while (off < entry->len);
         entry->last = now;
         entry->rto *= 2;
     }
@@ -328,46 +489,78 @@ tcp_set_timewait_timer(struct tcp_pcb *pcb)
 }
 
 static ssize_t
-tcp_output_segment(uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign)
+tcp_output_segment(uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign, struct ip_dst_cache *cache, int flags)
 {
-    uint8_t buf[IP_PAYLOAD_SIZE_MAX] = {};
+    uint8_t buf[sizeof(struct tcp_hdr) + 4] = {}; /* header and MSS option, the payload is not copied */
+    struct iovec iov[2];
     struct tcp_hdr *hdr;
+    uint8_t *opt;
     struct pseudo_hdr pseudo;
-    uint16_t psum;
-    uint16_t total;
+    struct ip_iface *iface;
+    uint16_t hlen, total, mss;
     char ep1[IP_ENDPOINT_STR_LEN];
     char ep2[IP_ENDPOINT_STR_LEN];
 
     hdr = (struct tcp_hdr *)buf;
+    hlen = sizeof(*hdr);
+    if (cache) {
+        ip_dst_cache_set_flow(cache, IP_PROTOCOL_TCP, local, foreign);
+    }
+    if (TCP_FLG_ISSET(flg, TCP_FLG_SYN)) {
+        /* advertise the largest segment the outgoing device can receive */
+        iface = cache ? ip_dst_cache_check(cache, foreign->addr) : ip_route_get_iface(foreign->addr);
+        if (iface) {
+            mss = NET_IFACE(iface)->dev->mtu - (IP_HDR_SIZE_MIN + sizeof(*hdr));
+            opt = (uint8_t *)(hdr + 1);
+            opt[0] = TCP_OPT_MSS;
+            opt[1] = 4;
+            opt[2] = mss >> 8;
+            opt[3] = mss & 0xff;
+            hlen += 4;
+        }
+    }
     hdr->src = local->port;
     hdr->dst = foreign->port;
     hdr->seq = hton32(seq);
     hdr->ack = hton32(ack);
-    hdr->off = (sizeof(*hdr) >> 2) << 4;
+    hdr->off = (hlen >> 2) << 4;
     hdr->flg = flg;
     hdr->wnd = hton16(wnd);
     hdr->sum = 0;
     hdr->up = 0;
-    memcpy(hdr + 1, data, len);
     pseudo.src = local->addr;
     pseudo.dst = foreign->addr;
     pseudo.zero = 0;
     pseudo.protocol = IP_PROTOCOL_TCP;
-    total = sizeof(*hdr) + len;
+    total = hlen + len;
     pseudo.len = hton16(total);
-    psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
-    hdr->sum = cksum16((uint16_t *)hdr, total, psum);
+    /* NOTE: leave the checksum partial, it is completed by the device or the IP layer */
+    hdr->sum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
+    flags |= NET_PACKET_FLAG_CSUM_PARTIAL;
+    if (len) {
+        flags |= NET_PACKET_FLAG_GSO;
+    }
     debugf("%s => %s, len=%u (payload=%zu)",
         ip_endpoint_ntop(local, ep1, sizeof(ep1)), ip_endpoint_ntop(foreign, ep2, sizeof(ep2)), total, len);
-    tcp_dump((uint8_t *)hdr, total);
-    if (ip_output(IP_PROTOCOL_TCP, (uint8_t *)hdr, total, local->addr, foreign->addr) == -1) {
+    tcp_dump((uint8_t *)hdr, hlen);
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = hlen;
+    iov[1].iov_base = data;
+    iov[1].iov_len = len;
+    if (cache) {
+        if (ip_output_cache(cache, IP_PROTOCOL_TCP, iov, len ? 2 : 1, local->addr, foreign->addr, flags) == -1) {
+            return -1;
+        }
+        return len;
+    }
+    if (ip_output_iov(IP_PROTOCOL_TCP, iov, len ? 2 : 1, local->addr, foreign->addr, flags) == -1) {
         return -1;
     }
     return len;
 }
 
 static ssize_t
-tcp_output(struct tcp_pcb *pcb, uint8_t flg, uint8_t *data, size_t len)
+tcp_output(struct tcp_pcb *pcb, uint8_t flg, uint8_t *data, size_t len, int flags)
 {
     uint32_t seq;
 
@@ -378,25 +571,43 @@ tcp_output(struct tcp_pcb *pcb, uint8_t flg, uint8_t *data, size_t len)
     if (TCP_FLG_ISSET(flg, TCP_FLG_SYN | TCP_FLG_FIN) || len) {
         tcp_retransmit_queue_add(pcb, seq, flg, data, len);
     }
-    return tcp_output_segment(seq, pcb->rcv.nxt, flg, pcb->rcv.wnd, data, len, &pcb->local, &pcb->foreign);
+    return tcp_output_segment(seq, pcb->rcv.nxt, flg, pcb->rcv.wnd, data, len, &pcb->local, &pcb->foreign, &pcb->dst, flags);
 }
 
 /* rfc793 - section 3.9 [Event Processing > SEGMENT ARRIVES] */
 static void
-tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign)
+tcp_input_flow(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface, int flags, void *arg);
+
+/* NOTE: pcb is the hint from the flow cache, NULL means to look it up */
+static void
+tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign, struct tcp_pcb *pcb)
 {
-    struct tcp_pcb *pcb, *new_pcb;
+    struct tcp_pcb *new_pcb;
     int acceptable = 0;
 
-    pcb = tcp_pcb_select(local, foreign);
+    if (pcb) {
+        if (pcb->state == TCP_PCB_STATE_FREE || pcb->state == TCP_PCB_STATE_LISTEN ||
+            pcb->local.addr != local->addr || pcb->local.port != local->port ||
+            pcb->foreign.addr != foreign->addr || pcb->foreign.port != foreign->port) {
+            /* released (or reused) after it was cached */
+            pcb = NULL;
+        }
+    }
+    if (!pcb) {
+        pcb = tcp_pcb_select(local, foreign);
+        if (pcb && pcb->state >= TCP_PCB_STATE_ESTABLISHED) {
+            /* (re)learn the flow of a synchronized connection */
+            ip_flow_insert(IP_PROTOCOL_TCP, local, foreign, tcp_input_flow, pcb);
+        }
+    }
     if (!pcb || pcb->state == TCP_PCB_STATE_CLOSED) {
         if (TCP_FLG_ISSET(flags, TCP_FLG_RST)) {
             return;
         }
         if (!TCP_FLG_ISSET(flags, TCP_FLG_ACK)) {
-            tcp_output_segment(0, seg->seq + seg->len, TCP_FLG_RST | TCP_FLG_ACK, 0, NULL, 0, local, foreign);
+            tcp_output_segment(0, seg->seq + seg->len, TCP_FLG_RST | TCP_FLG_ACK, 0, NULL, 0, local, foreign, NULL, 0);
         } else {
-            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
+            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign, NULL, 0);
         }
         return;
     }
@@ -412,7 +623,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
          * second check for an ACK
          */
         if (TCP_FLG_ISSET(flags, TCP_FLG_ACK)) {
-            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
+            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign, NULL, 0);
             return;
         }
         /*
@@ -436,8 +647,9 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
             pcb->rcv.wnd = sizeof(pcb->buf);
             pcb->rcv.nxt = seg->seq + 1;
             pcb->irs = seg->seq;
+            pcb->mss = seg->mss ? seg->mss : TCP_DEFAULT_MSS;
             pcb->iss = random();
-            tcp_output(pcb, TCP_FLG_SYN | TCP_FLG_ACK, NULL, 0);
+            tcp_output(pcb, TCP_FLG_SYN | TCP_FLG_ACK, NULL, 0, 0);
             pcb->snd.nxt = pcb->iss + 1;
             pcb->snd.una = pcb->iss;
             pcb->state = TCP_PCB_STATE_SYN_RECEIVED;
@@ -456,7 +668,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
          */
         if (TCP_FLG_ISSET(flags, TCP_FLG_ACK)) {
             if (seg->ack <= pcb->iss || seg->ack > pcb->snd.nxt) {
-                tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
+                tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign, NULL, 0);
                 return;
             }
             if (pcb->snd.una <= seg->ack && seg->ack <= pcb->snd.nxt) {
@@ -484,13 +696,14 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
         if (TCP_FLG_ISSET(flags, TCP_FLG_SYN)) {
             pcb->rcv.nxt = seg->seq + 1;
             pcb->irs = seg->seq;
+            pcb->mss = seg->mss ? seg->mss : TCP_DEFAULT_MSS;
             if (acceptable) {
                 pcb->snd.una = seg->ack;
                 tcp_retransmit_queue_cleanup(pcb);
             }
             if (pcb->snd.una > pcb->iss) {
                 pcb->state = TCP_PCB_STATE_ESTABLISHED;
-                tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
+                tcp_output(pcb, TCP_FLG_ACK, NULL, 0, 0);
                 /* NOTE: not specified in the RFC793, but send window initialization required */
                 pcb->snd.wnd = seg->wnd;
                 pcb->snd.wl1 = seg->seq;
@@ -500,7 +713,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
                 return;
             } else {
                 pcb->state = TCP_PCB_STATE_SYN_RECEIVED;
-                tcp_output(pcb, TCP_FLG_SYN | TCP_FLG_ACK, NULL, 0);
+                tcp_output(pcb, TCP_FLG_SYN | TCP_FLG_ACK, NULL, 0, 0);
                 /* ignore: If there are other controls or text in the segment, queue them for processing after the ESTABLISHED state has been reached */
                 return;
             }
@@ -548,7 +761,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
         }
         if (!acceptable) {
             if (!TCP_FLG_ISSET(flags, TCP_FLG_RST)) {
-                tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
+                tcp_output(pcb, TCP_FLG_ACK, NULL, 0, 0);
             }
             return;
         }
@@ -610,7 +823,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
     case TCP_PCB_STATE_LAST_ACK:
     case TCP_PCB_STATE_TIME_WAIT:
         if (TCP_FLG_ISSET(flags, TCP_FLG_SYN)) {
-            tcp_output(pcb, TCP_FLG_RST, NULL, 0);
+            tcp_output(pcb, TCP_FLG_RST, NULL, 0, 0);
             errorf("connection reset");
             pcb->state = TCP_PCB_STATE_CLOSED;
             tcp_pcb_release(pcb);
@@ -634,7 +847,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
                 sched_wakeup(&pcb->parent->ctx);
             }
         } else {
-            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
+            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign, NULL, 0);
             return;
         }
         /* fall through */
@@ -656,7 +869,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
         } else if (seg->ack < pcb->snd.una) {
             /* ignore */
         } else if (seg->ack > pcb->snd.nxt) {
-            tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
+            tcp_output(pcb, TCP_FLG_ACK, NULL, 0, 0);
             return;
         }
         switch (pcb->state) {
@@ -703,11 +916,17 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
     case TCP_PCB_STATE_ESTABLISHED:
     case TCP_PCB_STATE_FIN_WAIT1:
     case TCP_PCB_STATE_FIN_WAIT2:
+        if (len > pcb->rcv.wnd) {
+            /* trim off the portion beyond the window (e.g. large coalesced segment) */
+            len = pcb->rcv.wnd;
+            seg->len = len;
+            flags &= ~TCP_FLG_FIN;
+        }
         if (len) {
             memcpy(pcb->buf + (sizeof(pcb->buf) - pcb->rcv.wnd), data, len);
             pcb->rcv.nxt = seg->seq + seg->len;
             pcb->rcv.wnd -= len;
-            tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
+            tcp_output(pcb, TCP_FLG_ACK, NULL, 0, 0);
             sched_wakeup(&pcb->ctx);
         }
         break;
@@ -731,7 +950,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
             return;
         }
         pcb->rcv.nxt = seg->seq + 1;
-        tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
+        tcp_output(pcb, TCP_FLG_ACK, NULL, 0, 0);
         switch (pcb->state) {
         case TCP_PCB_STATE_SYN_RECEIVED:
         case TCP_PCB_STATE_ESTABLISHED:
@@ -768,8 +987,33 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
     return;
 }
 
+/* returns the value of the MSS option, 0 if not present */
+static uint16_t
+tcp_option_mss(const uint8_t *opt, size_t len)
+{
+    size_t i = 0;
+
+    while (i < len) {
+        switch (opt[i]) {
+        case TCP_OPT_EOL:
+            return 0;
+        case TCP_OPT_NOP:
+            i++;
+            continue;
+        }
+        if (i + 1 >= len || opt[i+1] < 2 || i + opt[i+1] > len) {
+            return 0; /* malformed */
+        }
+        if (opt[i] == TCP_OPT_MSS && opt[i+1] == 4) {
+            return (opt[i+2] << 8) | opt[i+3];
+        }
+        i += opt[i+1];
+    }
+    return 0;
+}
+
 static void
-tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
+tcp_input_core(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface, int flags, struct tcp_pcb *pcb)
 {
     struct tcp_hdr *hdr;
     struct pseudo_hdr pseudo;
@@ -784,15 +1028,17 @@ tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
         return;
     }
     hdr = (struct tcp_hdr *)data;
-    pseudo.src = src;
-    pseudo.dst = dst;
-    pseudo.zero = 0;
-    pseudo.protocol = IP_PROTOCOL_TCP;
-    pseudo.len = hton16(len);
-    psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
-    if (cksum16((uint16_t *)hdr, len, psum) != 0) {
-        errorf("checksum error: sum=0x%04x, verify=0x%04x", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)hdr, len, -hdr->sum + psum)));
-        return;
+    if (!(flags & NET_PACKET_FLAG_CSUM_VALID)) {
+        pseudo.src = src;
+        pseudo.dst = dst;
+        pseudo.zero = 0;
+        pseudo.protocol = IP_PROTOCOL_TCP;
+        pseudo.len = hton16(len);
+        psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
+        if (cksum16((uint16_t *)hdr, len, psum) != 0) {
+            errorf("checksum error: sum=0x%04x, verify=0x%04x", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)hdr, len, -hdr->sum + psum)));
+            return;
+        }
     }
     if (src == IP_ADDR_BROADCAST || src == iface->broadcast || dst == IP_ADDR_BROADCAST || dst == iface->broadcast) {
         errorf("only supports unicast, src=%s, dst=%s",
@@ -802,13 +1048,21 @@ tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
     debugf("%s:%d => %s:%d, len=%zu (payload=%zu)",
         ip_addr_ntop(src, addr1, sizeof(addr1)), ntoh16(hdr->src),
         ip_addr_ntop(dst, addr2, sizeof(addr2)), ntoh16(hdr->dst),
-        len, len - sizeof(*hdr));
+        len, len - ((hdr->off >> 4) << 2));
     tcp_dump(data, len);
     local.addr = dst;
     local.port = hdr->dst;
     foreign.addr = src;
     foreign.port = hdr->src;
     hlen = (hdr->off >> 4) << 2;
+    if (hlen < sizeof(*hdr) || hlen > len) {
+        errorf("invalid header length, hlen=%u, len=%zu", hlen, len);
+        return;
+    }
+    seg.mss = 0;
+    if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_SYN)) {
+        seg.mss = tcp_option_mss((uint8_t *)(hdr + 1), hlen - sizeof(*hdr));
+    }
     seg.seq = ntoh32(hdr->seq);
     seg.ack = ntoh32(hdr->ack);
     seg.len = len - hlen;
@@ -821,11 +1075,24 @@ tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
     seg.wnd = ntoh16(hdr->wnd);
     seg.up = ntoh16(hdr->up);
     mutex_lock(&mutex);
-    tcp_segment_arrives(&seg, hdr->flg, (uint8_t *)hdr + hlen, len - hlen, &local, &foreign);
+    tcp_segment_arrives(&seg, hdr->flg, (uint8_t *)hdr + hlen, len - hlen, &local, &foreign, pcb);
     mutex_unlock(&mutex);
     return;
 }
 
+static void
+tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface, int flags)
+{
+    tcp_input_core(data, len, src, dst, iface, flags, NULL);
+}
+
+/* NOTE: called by ip_input() on a hit in the flow cache */
+static void
+tcp_input_flow(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface, int flags, void *arg)
+{
+    tcp_input_core(data, len, src, dst, iface, flags, arg);
+}
+
 static void
 tcp_timer(void)
 {
@@ -848,7 +1115,11 @@ tcp_timer(void)
                 continue;
             }
         }
-        queue_foreach(&pcb->queue, tcp_retransmit_queue_emit, pcb);
+        if (pcb->queue.num) {
+            queue_foreach(&pcb->queue, tcp_retransmit_queue_emit, pcb);
+            /* NOTE: the expired entries are emitted as a burst, push them out at once */
+            ip_dst_cache_flush(&pcb->dst);
+        }
     }
     mutex_unlock(&mutex);
 }
@@ -867,6 +1138,24 @@ event_handler(void *arg)
     mutex_unlock(&mutex);
 }
 
+/* NOTE: disabled by default, the black hole detection of rfc4821 */
+void
+tcp_set_mtu_probing(int enable)
+{
+    mutex_lock(&mutex);
+    mtu_probing = enable;
+    mutex_unlock(&mutex);
+}
+
+/* NOTE: enabled by default, disable it to see the segments on the loopback device */
+void
+tcp_set_loopback_fastpath(int enable)
+{
+    mutex_lock(&mutex);
+    loopback_fastpath = enable;
+    mutex_unlock(&mutex);
+}
+
 int
 tcp_init(void)
 {
@@ -918,7 +1207,7 @@ tcp_open_rfc793(struct ip_endpoint *local, struct ip_endpoint *foreign, int acti
         pcb->foreign = *foreign;
         pcb->rcv.wnd = sizeof(pcb->buf);
         pcb->iss = random();
-        if (tcp_output(pcb, TCP_FLG_SYN, NULL, 0) == -1) {
+        if (tcp_output(pcb, TCP_FLG_SYN, NULL, 0, 0) == -1) {
             errorf("tcp_output() failure");
             pcb->state = TCP_PCB_STATE_CLOSED;
             tcp_pcb_release(pcb);
@@ -1030,9 +1319,11 @@ tcp_connect(int id, struct ip_endpoint *foreign)
     local.addr = pcb->local.addr;
     local.port = pcb->local.port;
     if (local.addr == IP_ADDR_ANY) {
-        iface = ip_route_get_iface(foreign->addr);
+        /* NOTE: the flow picks one of the equal-cost paths, the source address follows it */
+        ip_dst_cache_set_flow(&pcb->dst, IP_PROTOCOL_TCP, &local, foreign);
+        iface = ip_dst_cache_check(&pcb->dst, foreign->addr);
         if (!iface) {
-            errorf("ip_route_get_iface() failure");
+            errorf("ip_dst_cache_check() failure");
             mutex_unlock(&mutex);
             return -1;
         }
@@ -1060,7 +1351,7 @@ tcp_connect(int id, struct ip_endpoint *foreign)
     pcb->foreign.port = foreign->port;
     pcb->rcv.wnd = sizeof(pcb->buf);
     pcb->iss = random();
-    if (tcp_output(pcb, TCP_FLG_SYN, NULL, 0) == -1) {
+    if (tcp_output(pcb, TCP_FLG_SYN, NULL, 0, 0) == -1) {
         errorf("tcp_output() failure");
         pcb->state = TCP_PCB_STATE_CLOSED;
         tcp_pcb_release(pcb);
@@ -1203,9 +1494,11 @@ tcp_accept(int id, struct ip_endpoint *foreign)
 ssize_t
 tcp_send(int id, uint8_t *data, size_t len)
 {
-    struct tcp_pcb *pcb;
+    struct tcp_pcb *pcb, *peer;
     ssize_t sent = 0;
     struct ip_iface *iface;
+    struct net_device *dev;
+    uint16_t mtu;
     size_t mss, cap, slen;
 
     mutex_lock(&mutex);
@@ -1234,16 +1527,29 @@ RETRY:
         return -1;
     case TCP_PCB_STATE_ESTABLISHED:
     case TCP_PCB_STATE_CLOSE_WAIT:
-        iface = ip_route_get_iface(pcb->local.addr);
+        iface = ip_dst_cache_check(&pcb->dst, pcb->foreign.addr);
         if (!iface) {
             errorf("iface not found");
             mutex_unlock(&mutex);
             return -1;
         }
-        mss = NET_IFACE(iface)->dev->mtu - (IP_HDR_SIZE_MIN + sizeof(struct tcp_hdr));
+        dev = NET_IFACE(iface)->dev;
+        mtu = ip_dst_cache_mtu(&pcb->dst);
+        mss = MIN(pcb->mss, mtu - (IP_HDR_SIZE_MIN + sizeof(struct tcp_hdr)));
+        if ((dev->features & NET_DEVICE_FEATURE_TSO) && mtu == dev->mtu &&
+            pcb->mss >= dev->mtu - (IP_HDR_SIZE_MIN + sizeof(struct tcp_hdr))) {
+            /* hand the device a super-segment, it will be split into MTU sized segments (the peer takes them) */
+            mss = NET_DEVICE_GSO_SIZE_MAX - (IP_HDR_SIZE_MIN + sizeof(struct tcp_hdr));
+        }
         while (sent < (ssize_t)len) {
-            cap = pcb->snd.wnd - (pcb->snd.nxt - pcb->snd.una);
+            peer = tcp_loopback_peer(pcb, dev);
+            if (peer) {
+                cap = peer->rcv.wnd;
+            } else {
+                cap = pcb->snd.wnd - (pcb->snd.nxt - pcb->snd.una);
+            }
             if (!cap) {
+                ip_dst_cache_flush(&pcb->dst);
                 if (sched_sleep(&pcb->ctx, &mutex, NULL) == -1) {
                     debugf("interrupted");
                     if (!sent) {
@@ -1255,9 +1561,16 @@ RETRY:
                 }
                 goto RETRY;
             }
+            if (peer) {
+                slen = MIN(len - sent, cap);
+                tcp_loopback_deliver(pcb, peer, data + sent, slen);
+                sent += slen;
+                continue;
+            }
             slen = MIN(MIN(mss, len - sent), cap);
-            if (tcp_output(pcb, TCP_FLG_ACK | TCP_FLG_PSH, data + sent, slen) == -1) {
+            if (tcp_output(pcb, TCP_FLG_ACK | TCP_FLG_PSH, data + sent, slen, NET_PACKET_FLAG_MORE) == -1) {
                 errorf("tcp_output() failure");
+                ip_dst_cache_flush(&pcb->dst);
                 pcb->state = TCP_PCB_STATE_CLOSED;
                 tcp_pcb_release(pcb);
                 mutex_unlock(&mutex);
@@ -1266,6 +1579,7 @@ RETRY:
             pcb->snd.nxt += slen;
             sent += slen;
         }
+        ip_dst_cache_flush(&pcb->dst);
         break;
     case TCP_PCB_STATE_FIN_WAIT1:
     case TCP_PCB_STATE_FIN_WAIT2:
@@ -1287,7 +1601,7 @@ RETRY:
 ssize_t
 tcp_receive(int id, uint8_t *buf, size_t size)
 {
-    struct tcp_pcb *pcb;
+    struct tcp_pcb *pcb, *peer;
     size_t remain, len;
 
     mutex_lock(&mutex);
@@ -1345,6 +1659,13 @@ RETRY:
     memcpy(buf, pcb->buf, len);
     memmove(pcb->buf, pcb->buf + len, remain - len);
     pcb->rcv.wnd += len;
+    if (loopback_fastpath) {
+        /* NOTE: the window opened, a sender on the fast path may be waiting for it */
+        peer = tcp_pcb_peer(pcb);
+        if (peer) {
+            sched_wakeup(&peer->ctx);
+        }
+    }
     mutex_unlock(&mutex);
     return len;
 }
@@ -1373,12 +1694,12 @@ tcp_close(int id)
         pcb->state = TCP_PCB_STATE_CLOSED;
         break;
     case TCP_PCB_STATE_SYN_RECEIVED:
-        tcp_output(pcb, TCP_FLG_ACK | TCP_FLG_FIN, NULL, 0);
+        tcp_output(pcb, TCP_FLG_ACK | TCP_FLG_FIN, NULL, 0, 0);
         pcb->snd.nxt++;
         pcb->state = TCP_PCB_STATE_FIN_WAIT1;
         break;
     case TCP_PCB_STATE_ESTABLISHED:
-        tcp_output(pcb, TCP_FLG_ACK | TCP_FLG_FIN,  NULL, 0);
+        tcp_output(pcb, TCP_FLG_ACK | TCP_FLG_FIN,  NULL, 0, 0);
         pcb->snd.nxt++;
         pcb->state = TCP_PCB_STATE_FIN_WAIT1;
         break;
@@ -1388,7 +1709,7 @@ tcp_close(int id)
         mutex_unlock(&mutex);
         return -1;
     case TCP_PCB_STATE_CLOSE_WAIT:
-        tcp_output(pcb, TCP_FLG_ACK | TCP_FLG_FIN, NULL, 0);
+        tcp_output(pcb, TCP_FLG_ACK | TCP_FLG_FIN, NULL, 0, 0);
         pcb->snd.nxt++;
         pcb->state = TCP_PCB_STATE_LAST_ACK; /* RFC793 says "enter CLOSING state", but it seems to be LAST-ACK state */
         break;
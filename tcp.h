@@ -20,6 +20,10 @@
 
 extern int
 tcp_init(void);
+extern void
+tcp_set_loopback_fastpath(int enable);
+extern void
+tcp_set_mtu_probing(int enable);
 
 extern int
 tcp_open_rfc793(struct ip_endpoint *local, struct ip_endpoint *foreign, int active);
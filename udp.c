@@ -10,9 +10,11 @@
 #include "util.h"
 #include "net.h"
 #include "ip.h"
+#include "igmp.h"
 #include "udp.h"
 
 #define UDP_PCB_SIZE 16
+#define UDP_PCB_GROUPS_MAX 8 /* multicast groups joined by a PCB */
 
 #define UDP_PCB_STATE_FREE    0
 #define UDP_PCB_STATE_OPEN    1
@@ -37,15 +39,27 @@ struct udp_hdr {
     uint16_t sum;
 };
 
+struct udp_group {
+    struct ip_iface *iface; /* NULL means unused */
+    ip_addr_t group;
+};
+
 struct udp_pcb {
     int state;
+    int reuse; /* the port is shared with the other PCBs which set it too */
     struct ip_endpoint local;
+    struct ip_dst_cache dst; /* route and link address of the last destination */
     struct queue_head queue; /* receive queue */
     struct sched_ctx ctx;
+    struct udp_group groups[UDP_PCB_GROUPS_MAX];
 };
 
-/* NOTE: the data follows immediately after the structure */
+/*
+ * NOTE: the data follows immediately after the structure. A multicast or broadcast datagram
+ *       is queued to all the receivers as is, the last one to dequeue it frees it.
+ */
 struct udp_queue_entry {
+    unsigned int refs;
     struct ip_endpoint foreign;
     uint16_t len;
 };
@@ -70,6 +84,15 @@ udp_dump(const uint8_t *data, size_t len)
     funlockfile(stderr);
 }
 
+/* NOTE: dequeued under the mutex but released after it is unlocked, the count is atomic */
+static void
+udp_queue_entry_put(struct udp_queue_entry *entry)
+{
+    if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        memory_free(entry);
+    }
+}
+
 /*
  * UDP Protocol Control Block (PCB)
  *
@@ -94,18 +117,28 @@ udp_pcb_alloc(void)
 static void
 udp_pcb_release(struct udp_pcb *pcb)
 {
-    struct queue_entry *entry;
+    struct udp_queue_entry *entry;
+    struct udp_group *group;
 
+    ip_flow_remove(pcb);
+    for (group = pcb->groups; group < tailof(pcb->groups); group++) {
+        if (group->iface) {
+            igmp_leave(group->iface, group->group);
+            group->iface = NULL;
+        }
+    }
     pcb->state = UDP_PCB_STATE_CLOSING;
     if (sched_ctx_destroy(&pcb->ctx) == -1) {
         sched_wakeup(&pcb->ctx);
         return;
     }
     pcb->state = UDP_PCB_STATE_FREE;
+    pcb->reuse = 0;
     pcb->local.addr = IP_ADDR_ANY;
     pcb->local.port = 0;
+    memset(&pcb->dst, 0, sizeof(pcb->dst));
     while ((entry = queue_pop(&pcb->queue)) != NULL) {
-        memory_free(entry);
+        udp_queue_entry_put(entry);
     }
 }
 
@@ -124,6 +157,41 @@ udp_pcb_select(ip_addr_t addr, uint16_t port)
     return NULL;
 }
 
+/*
+ * NOTE: returns a pcb holding the port which the caller can not share, the port is shared
+ *       only when all of the holders allow the reuse. The port of an unbound address is taken
+ *       on every address.
+ */
+static struct udp_pcb *
+udp_pcb_conflict(ip_addr_t addr, uint16_t port, int reuse)
+{
+    struct udp_pcb *pcb;
+
+    for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
+        if (pcb->state == UDP_PCB_STATE_OPEN && pcb->local.port == port) {
+            if (addr == IP_ADDR_ANY || pcb->local.addr == IP_ADDR_ANY || pcb->local.addr == addr) {
+                if (!reuse || !pcb->reuse) {
+                    return pcb;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+static struct udp_group *
+udp_pcb_group(struct udp_pcb *pcb, struct ip_iface *iface, ip_addr_t group)
+{
+    struct udp_group *entry;
+
+    for (entry = pcb->groups; entry < tailof(pcb->groups); entry++) {
+        if (entry->iface == iface && (!iface || entry->group == group)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
 static struct udp_pcb *
 udp_pcb_get(int id)
 {
@@ -147,15 +215,74 @@ udp_pcb_id(struct udp_pcb *pcb)
 }
 
 static void
-udp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
+udp_input_flow(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface, int flags, void *arg);
+
+static struct udp_queue_entry *
+udp_queue_entry_alloc(const struct udp_hdr *hdr, size_t len, ip_addr_t src)
+{
+    struct udp_queue_entry *entry;
+
+    entry = memory_alloc(sizeof(*entry) + (len - sizeof(*hdr)));
+    if (!entry) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    entry->foreign.addr = src;
+    entry->foreign.port = hdr->src;
+    entry->len = len - sizeof(*hdr);
+    memcpy(entry + 1, hdr + 1, entry->len);
+    return entry;
+}
+
+/*
+ * NOTE: a multicast goes to the PCBs which joined the group on the iface, a broadcast goes to
+ *       the PCBs bound to the port. They share a single copy. Must be called after mutex locked.
+ */
+static void
+udp_input_fanout(const struct udp_hdr *hdr, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
+{
+    struct udp_pcb *pcb;
+    struct udp_queue_entry *entry = NULL;
+
+    for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
+        if (pcb->state != UDP_PCB_STATE_OPEN || pcb->local.port != hdr->dst) {
+            continue;
+        }
+        if (pcb->local.addr != IP_ADDR_ANY && pcb->local.addr != dst) {
+            continue;
+        }
+        if (IP_ADDR_IS_MULTICAST(dst) && !udp_pcb_group(pcb, iface, dst)) {
+            continue;
+        }
+        if (!entry) {
+            entry = udp_queue_entry_alloc(hdr, len, src);
+            if (!entry) {
+                return;
+            }
+        }
+        if (!queue_push(&pcb->queue, entry)) {
+            errorf("queue_push() failure");
+            continue;
+        }
+        entry->refs++;
+        sched_wakeup(&pcb->ctx);
+    }
+    if (entry && !entry->refs) {
+        memory_free(entry);
+    }
+}
+
+/* NOTE: pcb is the hint from the flow cache, NULL means to look it up */
+static void
+udp_input_core(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface, int flags, struct udp_pcb *pcb)
 {
     struct pseudo_hdr pseudo;
     uint16_t psum = 0;
     struct udp_hdr *hdr;
     char addr1[IP_ADDR_STR_LEN];
     char addr2[IP_ADDR_STR_LEN];
-    struct udp_pcb *pcb;
     struct udp_queue_entry *entry;
+    struct ip_endpoint local, foreign;
 
     if (len < sizeof(*hdr)) {
         errorf("too short");
@@ -166,15 +293,17 @@ udp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
         errorf("length error: len=%zu, hdr->len=%u", len, ntoh16(hdr->len));
         return;
     }
-    pseudo.src = src;
-    pseudo.dst = dst;
-    pseudo.zero = 0;
-    pseudo.protocol = IP_PROTOCOL_UDP;
-    pseudo.len = hton16(len);
-    psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
-    if (cksum16((uint16_t *)hdr, len, psum) != 0) {
-        errorf("checksum error: sum=0x%04x, verify=0x%04x", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)hdr, len, -hdr->sum + psum)));
-        return;
+    if (!(flags & NET_PACKET_FLAG_CSUM_VALID) && hdr->sum) { /* zero means the sender did not compute it */
+        pseudo.src = src;
+        pseudo.dst = dst;
+        pseudo.zero = 0;
+        pseudo.protocol = IP_PROTOCOL_UDP;
+        pseudo.len = hton16(len);
+        psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
+        if (cksum16((uint16_t *)hdr, len, psum) != 0) {
+            errorf("checksum error: sum=0x%04x, verify=0x%04x", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)hdr, len, -hdr->sum + psum)));
+            return;
+        }
     }
     debugf("%s:%d => %s:%d, len=%zu (payload=%zu)",
         ip_addr_ntop(src, addr1, sizeof(addr1)), ntoh16(hdr->src),
@@ -182,69 +311,117 @@ udp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
         len, len - sizeof(*hdr));
     udp_dump(data, len);
     mutex_lock(&mutex);
-    pcb = udp_pcb_select(dst, hdr->dst);
-    if (!pcb) {
-        /* port is not in use */
+    if (IP_ADDR_IS_MULTICAST(dst) || dst == iface->broadcast || dst == IP_ADDR_BROADCAST) {
+        udp_input_fanout(hdr, len, src, dst, iface);
         mutex_unlock(&mutex);
         return;
     }
-    entry = memory_alloc(sizeof(*entry) + (len - sizeof(*hdr)));
+    if (pcb) {
+        if (pcb->state != UDP_PCB_STATE_OPEN || pcb->local.port != hdr->dst ||
+            (pcb->local.addr != IP_ADDR_ANY && pcb->local.addr != dst)) {
+            /* released (or reused) after it was cached */
+            pcb = NULL;
+        }
+    }
+    if (!pcb) {
+        pcb = udp_pcb_select(dst, hdr->dst);
+        if (!pcb) {
+            /* port is not in use */
+            mutex_unlock(&mutex);
+            return;
+        }
+        if (dst == iface->unicast) {
+            local.addr = dst;
+            local.port = hdr->dst;
+            foreign.addr = src;
+            foreign.port = hdr->src;
+            ip_flow_insert(IP_PROTOCOL_UDP, &local, &foreign, udp_input_flow, pcb);
+        }
+    }
+    entry = udp_queue_entry_alloc(hdr, len, src);
     if (!entry) {
         mutex_unlock(&mutex);
-        errorf("memory_alloc() failure");
         return;
     }
-    entry->foreign.addr = src;
-    entry->foreign.port = hdr->src;
-    entry->len = len - sizeof(*hdr);
-    memcpy(entry + 1, hdr + 1, entry->len);
     if (!queue_push(&pcb->queue, entry)) {
         mutex_unlock(&mutex);
+        memory_free(entry);
         errorf("queue_push() failure");
         return;
     }
+    entry->refs = 1;
     sched_wakeup(&pcb->ctx);
     mutex_unlock(&mutex);
 }
 
-ssize_t
-udp_output(struct ip_endpoint *src, struct ip_endpoint *dst, const  uint8_t *data, size_t len)
+static void
+udp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface, int flags)
 {
-    uint8_t buf[IP_PAYLOAD_SIZE_MAX];
-    struct udp_hdr *hdr;
+    udp_input_core(data, len, src, dst, iface, flags, NULL);
+}
+
+/* NOTE: called by ip_input() on a hit in the flow cache */
+static void
+udp_input_flow(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface, int flags, void *arg)
+{
+    udp_input_core(data, len, src, dst, iface, flags, arg);
+}
+
+/* NOTE: cache may be NULL */
+static ssize_t
+udp_output_core(struct ip_endpoint *src, struct ip_endpoint *dst, const uint8_t *data, size_t len, struct ip_dst_cache *cache)
+{
+    struct udp_hdr hdr;
+    struct iovec iov[2];
     struct pseudo_hdr pseudo;
-    uint16_t total, psum = 0;
+    uint16_t total;
     char ep1[IP_ENDPOINT_STR_LEN];
     char ep2[IP_ENDPOINT_STR_LEN];
 
-    if (len > IP_PAYLOAD_SIZE_MAX - sizeof(*hdr)) {
+    if (len > IP_PAYLOAD_SIZE_MAX - sizeof(hdr)) {
         errorf("too long");
         return -1;
     }
-    hdr = (struct udp_hdr *)buf;
-    hdr->src = src->port;
-    hdr->dst = dst->port;
-    total = sizeof(*hdr) + len;
-    hdr->len = hton16(total);
-    hdr->sum = 0;
-    memcpy(hdr + 1, data, len);
+    hdr.src = src->port;
+    hdr.dst = dst->port;
+    total = sizeof(hdr) + len;
+    hdr.len = hton16(total);
     pseudo.src = src->addr;
     pseudo.dst = dst->addr;
     pseudo.zero = 0;
     pseudo.protocol = IP_PROTOCOL_UDP;
     pseudo.len = hton16(total);
-    psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
-    hdr->sum = cksum16((uint16_t *)hdr, total, psum);
+    /* NOTE: leave the checksum partial, it is completed by the device or the IP layer */
+    hdr.sum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
     debugf("%s => %s, len=%u (payload=%zu)",
         ip_endpoint_ntop(src, ep1, sizeof(ep1)), ip_endpoint_ntop(dst, ep2, sizeof(ep2)), total, len);
-    udp_dump((uint8_t *)hdr, total);
-    if (ip_output(IP_PROTOCOL_UDP, (uint8_t *)hdr, total, src->addr, dst->addr) == -1) {
-        errorf("ip_output() failure");
+    udp_dump((uint8_t *)&hdr, sizeof(hdr));
+    /* NOTE: the payload is passed by reference, no copy into a bounce buffer */
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = len;
+    if (cache) {
+        /* NOTE: the flow of the cache is set by the caller */
+        if (ip_output_cache(cache, IP_PROTOCOL_UDP, iov, len ? 2 : 1, src->addr, dst->addr, NET_PACKET_FLAG_CSUM_PARTIAL) == -1) {
+            errorf("ip_output_cache() failure");
+            return -1;
+        }
+        return len;
+    }
+    if (ip_output_iov(IP_PROTOCOL_UDP, iov, len ? 2 : 1, src->addr, dst->addr, NET_PACKET_FLAG_CSUM_PARTIAL) == -1) {
+        errorf("ip_output_iov() failure");
         return -1;
     }
     return len;
 }
 
+ssize_t
+udp_output(struct ip_endpoint *src, struct ip_endpoint *dst, const  uint8_t *data, size_t len)
+{
+    return udp_output_core(src, dst, data, len, NULL);
+}
+
 static void
 event_handler(void *arg)
 {
@@ -323,7 +500,7 @@ udp_bind(int id, struct ip_endpoint *local)
         mutex_unlock(&mutex);
         return -1;
     }
-    exist = udp_pcb_select(local->addr, local->port);
+    exist = udp_pcb_conflict(local->addr, local->port, pcb->reuse);
     if (exist) {
         errorf("already in use, id=%d, want=%s, exist=%s",
             id, ip_endpoint_ntop(local, ep1, sizeof(ep1)), ip_endpoint_ntop(&exist->local, ep2, sizeof(ep2)));
@@ -344,6 +521,7 @@ udp_sendto(int id, uint8_t *data, size_t len, struct ip_endpoint *foreign)
     struct ip_iface *iface;
     char addr[IP_ADDR_STR_LEN];
     uint32_t p;
+    ssize_t ret;
 
     mutex_lock(&mutex);
     pcb = udp_pcb_get(id);
@@ -352,35 +530,42 @@ udp_sendto(int id, uint8_t *data, size_t len, struct ip_endpoint *foreign)
         mutex_unlock(&mutex);
         return -1;
     }
-    local.addr = pcb->local.addr;
-    if (local.addr == IP_ADDR_ANY) {
-        iface = ip_route_get_iface(foreign->addr);
-        if (!iface) {
-            errorf("iface not found that can reach foreign address, addr=%s",
-                ip_addr_ntop(foreign->addr, addr, sizeof(addr)));
-            mutex_unlock(&mutex);
-            return -1;
-        }
-        local.addr = iface->unicast;
-        debugf("select local address, addr=%s", ip_addr_ntop(local.addr, addr, sizeof(addr)));
-    }
     if (!pcb->local.port) {
         for (p = UDP_SOURCE_PORT_MIN; p <= UDP_SOURCE_PORT_MAX; p++) {
-            if (!udp_pcb_select(local.addr, hton16(p))) {
+            if (!udp_pcb_conflict(pcb->local.addr, hton16(p), 0)) {
                 pcb->local.port = hton16(p);
                 debugf("dynamic assign local port, port=%d", p);
                 break;
             }
         }
         if (!pcb->local.port) {
-            debugf("failed to dynamic assign local port, addr=%s", ip_addr_ntop(local.addr, addr, sizeof(addr)));
+            debugf("failed to dynamic assign local port, addr=%s", ip_addr_ntop(pcb->local.addr, addr, sizeof(addr)));
             mutex_unlock(&mutex);
             return -1;
         }
     }
-    local.port = pcb->local.port;
+    /*
+     * NOTE: the flow is keyed by the binding of the PCB, so it stays the same datagram after
+     *       datagram and the cache is kept. An unbound address takes the source address of
+     *       the path the flow picks.
+     */
+    local = pcb->local;
+    ip_dst_cache_set_flow(&pcb->dst, IP_PROTOCOL_UDP, &local, foreign);
+    if (local.addr == IP_ADDR_ANY) {
+        iface = ip_dst_cache_check(&pcb->dst, foreign->addr);
+        if (!iface) {
+            errorf("iface not found that can reach foreign address, addr=%s",
+                ip_addr_ntop(foreign->addr, addr, sizeof(addr)));
+            mutex_unlock(&mutex);
+            return -1;
+        }
+        local.addr = iface->unicast;
+        debugf("select local address, addr=%s", ip_addr_ntop(local.addr, addr, sizeof(addr)));
+    }
+    /* NOTE: sent under the mutex, the cache belongs to the PCB */
+    ret = udp_output_core(&local, foreign, data, len, &pcb->dst);
     mutex_unlock(&mutex);
-    return udp_output(&local, foreign, data, len);
+    return ret;
 }
 
 ssize_t
@@ -417,6 +602,115 @@ udp_recvfrom(int id, uint8_t *buf, size_t size, struct ip_endpoint *foreign)
     }
     len = MIN(size, entry->len); /* truncate */
     memcpy(buf, entry + 1, len);
-    memory_free(entry);
+    udp_queue_entry_put(entry);
     return len;
 }
+
+int
+udp_set_reuseaddr(int id, int enable)
+{
+    struct udp_pcb *pcb;
+
+    mutex_lock(&mutex);
+    pcb = udp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found, id=%d", id);
+        mutex_unlock(&mutex);
+        return -1;
+    }
+    pcb->reuse = enable;
+    mutex_unlock(&mutex);
+    return 0;
+}
+
+/* NOTE: addr picks the iface by its address, IP_ADDR_ANY means the one the route to the group goes out */
+static struct ip_iface *
+udp_group_iface(ip_addr_t group, ip_addr_t addr)
+{
+    char addr1[IP_ADDR_STR_LEN];
+
+    if (!IP_ADDR_IS_MULTICAST(group)) {
+        errorf("not a multicast address, group=%s", ip_addr_ntop(group, addr1, sizeof(addr1)));
+        return NULL;
+    }
+    if (addr != IP_ADDR_ANY) {
+        return ip_iface_select(addr);
+    }
+    return ip_route_get_iface(group);
+}
+
+int
+udp_join_group(int id, ip_addr_t group, ip_addr_t addr)
+{
+    struct udp_pcb *pcb;
+    struct ip_iface *iface;
+    struct udp_group *entry;
+    char addr1[IP_ADDR_STR_LEN];
+
+    iface = udp_group_iface(group, addr);
+    if (!iface) {
+        errorf("iface not found, addr=%s", ip_addr_ntop(addr, addr1, sizeof(addr1)));
+        return -1;
+    }
+    mutex_lock(&mutex);
+    pcb = udp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found, id=%d", id);
+        mutex_unlock(&mutex);
+        return -1;
+    }
+    if (udp_pcb_group(pcb, iface, group)) {
+        errorf("already joined, id=%d, group=%s", id, ip_addr_ntop(group, addr1, sizeof(addr1)));
+        mutex_unlock(&mutex);
+        return -1;
+    }
+    entry = udp_pcb_group(pcb, NULL, IP_ADDR_ANY);
+    if (!entry) {
+        errorf("too many groups, id=%d", id);
+        mutex_unlock(&mutex);
+        return -1;
+    }
+    if (igmp_join(iface, group) == -1) {
+        errorf("igmp_join() failure");
+        mutex_unlock(&mutex);
+        return -1;
+    }
+    entry->iface = iface;
+    entry->group = group;
+    debugf("joined, id=%d, group=%s", id, ip_addr_ntop(group, addr1, sizeof(addr1)));
+    mutex_unlock(&mutex);
+    return 0;
+}
+
+int
+udp_leave_group(int id, ip_addr_t group, ip_addr_t addr)
+{
+    struct udp_pcb *pcb;
+    struct ip_iface *iface;
+    struct udp_group *entry;
+    char addr1[IP_ADDR_STR_LEN];
+
+    iface = udp_group_iface(group, addr);
+    if (!iface) {
+        errorf("iface not found, addr=%s", ip_addr_ntop(addr, addr1, sizeof(addr1)));
+        return -1;
+    }
+    mutex_lock(&mutex);
+    pcb = udp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found, id=%d", id);
+        mutex_unlock(&mutex);
+        return -1;
+    }
+    entry = udp_pcb_group(pcb, iface, group);
+    if (!entry) {
+        errorf("not joined, id=%d, group=%s", id, ip_addr_ntop(group, addr1, sizeof(addr1)));
+        mutex_unlock(&mutex);
+        return -1;
+    }
+    igmp_leave(iface, group);
+    entry->iface = NULL;
+    debugf("left, id=%d, group=%s", id, ip_addr_ntop(group, addr1, sizeof(addr1)));
+    mutex_unlock(&mutex);
+    return 0;
+}
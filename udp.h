@@ -22,5 +22,11 @@ extern ssize_t
 udp_recvfrom(int id, uint8_t *buf, size_t size, struct ip_endpoint *foreign);
 extern int
 udp_close(int id);
+extern int
+udp_set_reuseaddr(int id, int enable);
+extern int
+udp_join_group(int id, ip_addr_t group, ip_addr_t addr);
+extern int
+udp_leave_group(int id, ip_addr_t group, ip_addr_t addr);
 
 #endif
@@ -7,6 +7,7 @@
 #include <limits.h>
 #include <ctype.h>
 #include <time.h>
+#include <sched.h>
 #include <sys/time.h>
 
 #include "platform.h"
@@ -150,6 +151,71 @@ queue_foreach(struct queue_head *queue, void (*func)(void *arg, void *data), voi
     }
 }
 
+size_t
+iovec_len(const struct iovec *iov, int iovcnt)
+{
+    size_t len = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    return len;
+}
+
+/* NOTE: gathers the fragments into buf, stops when buf is full */
+size_t
+iovec_copy(uint8_t *buf, size_t size, const struct iovec *iov, int iovcnt)
+{
+    size_t len = 0, n;
+    int i;
+
+    for (i = 0; i < iovcnt && len < size; i++) {
+        n = MIN(iov[i].iov_len, size - len);
+        memcpy(buf + len, iov[i].iov_base, n);
+        len += n;
+    }
+    return len;
+}
+
+/*
+ * RCU (Read-Copy-Update)
+ *
+ * NOTE: the readers are counted per epoch. The writer publishes a new version with an atomic
+ *       store, then waits for the readers of the old epochs before it frees the old version.
+ *       The writers must be serialized by the caller.
+ */
+
+int
+rcu_read_lock(struct rcu *rcu)
+{
+    int idx;
+
+    idx = __atomic_load_n(&rcu->epoch, __ATOMIC_SEQ_CST) & 1;
+    __atomic_add_fetch(&rcu->readers[idx], 1, __ATOMIC_SEQ_CST);
+    return idx;
+}
+
+void
+rcu_read_unlock(struct rcu *rcu, int idx)
+{
+    __atomic_sub_fetch(&rcu->readers[idx], 1, __ATOMIC_RELEASE);
+}
+
+void
+rcu_synchronize(struct rcu *rcu)
+{
+    int i, idx;
+
+    /* NOTE: flip twice, a reader may have picked its epoch just before the previous flip */
+    for (i = 0; i < 2; i++) {
+        idx = __atomic_fetch_add(&rcu->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+        while (__atomic_load_n(&rcu->readers[idx], __ATOMIC_ACQUIRE)) {
+            sched_yield();
+        }
+    }
+}
+
 #ifndef __BIG_ENDIAN
 #define __BIG_ENDIAN 4321
 #endif
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 #ifndef MAX
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
@@ -71,6 +72,25 @@ queue_peek(struct queue_head *queue);
 extern void
 queue_foreach(struct queue_head *queue, void (*func)(void *arg, void *data), void *arg);
 
+extern size_t
+iovec_len(const struct iovec *iov, int iovcnt);
+extern size_t
+iovec_copy(uint8_t *buf, size_t size, const struct iovec *iov, int iovcnt);
+
+struct rcu {
+    unsigned int epoch;
+    unsigned int readers[2];
+};
+
+#define RCU_INITIALIZER {0, {0, 0}}
+
+extern int
+rcu_read_lock(struct rcu *rcu);
+extern void
+rcu_read_unlock(struct rcu *rcu, int idx);
+extern void
+rcu_synchronize(struct rcu *rcu);
+
 extern uint16_t
 hton16(uint16_t h);
 extern uint16_t